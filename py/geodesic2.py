@@ -0,0 +1,161 @@
+"""
+Binding of libgeodesic2 (src/geodesic2.h). Arrays are numpy arrays passed
+to library without copying, context keeps backend between calculations:
+
+    with Geodesic2("metrics/cl/schwarzschild.cl", [rs]) as g:
+        pos, dir, finished = g.emit(t0, r0, fov, nrays)
+        g.calculate(pos, dir, finished, T, h, num_steps)
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+CURDIR = os.path.dirname(os.path.abspath(__file__))
+LIBRARY = os.environ.get("GEODESIC2_LIBRARY", os.path.join(CURDIR, "libgeodesic2.so"))
+
+SOA = 1
+NUMERIC_DERIVATIVE = 2
+BACKEND_CPU = 4
+
+# integrator of fixed step mode, see --integrator
+INTEGRATORS = {
+    "rk4": 0,
+    "dp5": 8,
+    "gl4": 16,
+    "gl6": 24,
+}
+
+# precision of OpenCL program, see --precision
+PRECISIONS = {
+    "double": 0,
+    "float": 32,
+    "mixed": 64,
+}
+
+DIM = 4
+
+# status of ray in finished array, see space.cl
+RAY_RUNNING = 0
+RAY_STOPPED = 1
+RAY_ESCAPED = 2
+RAY_CAPTURED = 3
+
+_double_p = ctypes.POINTER(ctypes.c_double)
+_int32_p = ctypes.POINTER(ctypes.c_int32)
+
+_lib = ctypes.CDLL(LIBRARY)
+
+_lib.geodesic2_create.restype = ctypes.c_void_p
+_lib.geodesic2_create.argtypes = [ctypes.c_char_p, _double_p, ctypes.c_size_t, ctypes.c_int, ctypes.c_int]
+
+_lib.geodesic2_set_args.restype = ctypes.c_int
+_lib.geodesic2_set_args.argtypes = [ctypes.c_void_p, _double_p, ctypes.c_size_t]
+
+_lib.geodesic2_emit.restype = ctypes.c_int
+_lib.geodesic2_emit.argtypes = [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_double,
+                                ctypes.c_size_t, _double_p, _double_p, _int32_p]
+
+_lib.geodesic2_emit_angles.restype = ctypes.c_int
+_lib.geodesic2_emit_angles.argtypes = [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, _double_p,
+                                       ctypes.c_size_t, _double_p, _double_p, _int32_p]
+
+_lib.geodesic2_calculate.restype = ctypes.c_int
+_lib.geodesic2_calculate.argtypes = [ctypes.c_void_p, _double_p, _double_p, _int32_p, ctypes.c_size_t,
+                                     ctypes.c_double, ctypes.c_double, ctypes.c_int,
+                                     ctypes.c_double, ctypes.c_double, ctypes.c_char_p]
+
+_lib.geodesic2_release.restype = None
+_lib.geodesic2_release.argtypes = [ctypes.c_void_p]
+
+
+def _check(array, dtype, shape, name):
+    # library works in place, so array can not be converted here
+    if array.dtype != dtype or not array.flags['C_CONTIGUOUS'] or not array.flags['WRITEABLE']:
+        raise ValueError("%s must be writeable C contiguous array of %s" % (name, np.dtype(dtype).name))
+    if array.shape != shape:
+        raise ValueError("%s must have shape %s" % (name, shape))
+
+
+class Geodesic2(object):
+    def __init__(self, metric, args, backend="opencl", threads=0, soa=False, numeric_derivative=False,
+                 integrator="rk4", precision="double"):
+        self.soa = soa
+        if integrator not in INTEGRATORS:
+            raise ValueError("Unknown integrator %s" % integrator)
+        if precision not in PRECISIONS:
+            raise ValueError("Unknown precision %s" % precision)
+        flags = INTEGRATORS[integrator] | PRECISIONS[precision]
+        if soa:
+            flags |= SOA
+        if numeric_derivative:
+            flags |= NUMERIC_DERIVATIVE
+        if backend == "cpu":
+            flags |= BACKEND_CPU
+        elif backend != "opencl":
+            raise ValueError("Unknown backend %s" % backend)
+
+        args = np.ascontiguousarray(args, dtype=np.float64)
+        self.ctx = _lib.geodesic2_create(metric.encode(), args.ctypes.data_as(_double_p), len(args), flags, threads)
+        if not self.ctx:
+            raise RuntimeError("Can not create context for %s" % metric)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.release()
+
+    def __del__(self):
+        self.release()
+
+    def release(self):
+        if getattr(self, "ctx", None):
+            _lib.geodesic2_release(self.ctx)
+            self.ctx = None
+
+    def _shape(self, num):
+        return (DIM, num) if self.soa else (num, DIM)
+
+    def set_args(self, args):
+        args = np.ascontiguousarray(args, dtype=np.float64)
+        _lib.geodesic2_set_args(self.ctx, args.ctypes.data_as(_double_p), len(args))
+
+    def emit(self, t0, r0, fov, nrays):
+        """Rays of observer, fov in degrees, see --emit"""
+        pos = np.empty(self._shape(nrays), dtype=np.float64)
+        dir = np.empty(self._shape(nrays), dtype=np.float64)
+        finished = np.empty(nrays, dtype=np.int32)
+        valid = _lib.geodesic2_emit(self.ctx, t0, r0, fov, nrays,
+                                    pos.ctypes.data_as(_double_p), dir.ctypes.data_as(_double_p),
+                                    finished.ctypes.data_as(_int32_p))
+        if valid < 0:
+            raise RuntimeError("Metric can not emit rays")
+        return pos, dir, finished
+
+    def emit_angles(self, t0, r0, angles):
+        """Rays of observer with given angles in radians, for non-uniform sets of rays"""
+        angles = np.ascontiguousarray(angles, dtype=np.float64)
+        nrays = len(angles)
+        pos = np.empty(self._shape(nrays), dtype=np.float64)
+        dir = np.empty(self._shape(nrays), dtype=np.float64)
+        finished = np.empty(nrays, dtype=np.int32)
+        valid = _lib.geodesic2_emit_angles(self.ctx, t0, r0, angles.ctypes.data_as(_double_p), nrays,
+                                           pos.ctypes.data_as(_double_p), dir.ctypes.data_as(_double_p),
+                                           finished.ctypes.data_as(_int32_p))
+        if valid < 0:
+            raise RuntimeError("Metric can not emit rays")
+        return pos, dir, finished
+
+    def calculate(self, pos, dir, finished, T, h, num_steps, atol=0, rtol=0, trajectory=None):
+        """Integrate rays in place, atol or rtol enable adaptive step"""
+        num = len(finished)
+        _check(pos, np.float64, self._shape(num), "pos")
+        _check(dir, np.float64, self._shape(num), "dir")
+        _check(finished, np.int32, (num,), "finished")
+        res = _lib.geodesic2_calculate(self.ctx, pos.ctypes.data_as(_double_p), dir.ctypes.data_as(_double_p),
+                                       finished.ctypes.data_as(_int32_p), num, T, h, num_steps, atol, rtol,
+                                       trajectory.encode() if trajectory is not None else None)
+        if res != 0:
+            raise RuntimeError("Calculation failed")
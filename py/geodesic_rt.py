@@ -1,109 +1,38 @@
 import os
-import tempfile
 import pandas as pd
-import subprocess
+import numpy as np
 import math
 
 import metrics.lemaitre as lemaitre
 import metrics.kruskal as kruskal
 import metrics.schwarzschild as schwarzschild
 
+import geodesic2
+
 import sys
 import yaml
 
 
 CURDIR = os.path.dirname(os.path.abspath(__file__))
-BINARY = os.path.join(CURDIR, "geodesic2")
-
-def run_calculation(rays, metric, args, length, h, num_steps, save_rays_dir):
-
-    # saving initial to file
-    input_file = tempfile.NamedTemporaryFile(mode='wt',delete=False)
-    input_fname = input_file.name
-
-    inp = rays.to_csv(sep=',', index=False, line_terminator='\n')
-    input_file.write(inp)
-    input_file.close()
-
-    # saving args to file
-    args_file = tempfile.NamedTemporaryFile(mode='wt',delete=False)
-    args_fname = args_file.name
-
-    args_csv = args.to_csv(sep=',', index=False, line_terminator='\n')
-    args_file.write(args_csv)
-    args_file.close()
-
-    # create file for output
-    output_file = tempfile.NamedTemporaryFile(mode='wt', delete=False)
-    output_fname = output_file.name
-    output_file.close()
-
-    run_args = [
-        BINARY,
-        input_fname,                            # inital rays position & direction
-        output_fname,                           # result of calculation
-        os.path.join(CURDIR, metric + ".cl"),   # file with metric description
-        args_fname,
-        "%lf" % length,                         # length of integration
-        "%lf" % h,                              # step of integration
-        str(num_steps),                         # extract data from OpenCL every each `num_steps`
-        ]
-    if save_rays_dir is not None:
-        run_args.append(save_rays_dir)
-
-    print("Command: %s" % (' '.join(run_args)))
-
-    subprocess.run(run_args)
-
-    print("input:  %s" % input_fname)
-    print("output: %s" % output_fname)
-
-    types = {}
-    
-    types['collided'] = "bool"
-    for i in range(4):
-        types['pos%i' % i] = 'float'
-        types['dir%i' % i] = 'float'
-
-    result = pd.read_csv(output_fname, sep=',', dtype=types)
-
-    os.remove(input_fname)
-    os.remove(output_fname)
-    os.remove(args_fname)
-    return result
-
-def init_rays(space, t0, r0, fov, nrays):
-    columns = []
-    dtypes = []
-
-    for i in range(dimensions):
-        columns.append('pos%i' % i)
-        dtypes.append('float64')
-
-    for i in range(dimensions):
-        columns.append('dir%i' % i)
-        dtypes.append('float64')
 
-    rays = pd.DataFrame(columns=columns)
-    angles = pd.DataFrame(columns=['init_angle'])
+def rays_frame(pos, dir):
+    columns = ['pos%i' % i for i in range(dimensions)] + ['dir%i' % i for i in range(dimensions)]
+    return pd.DataFrame(np.hstack([pos, dir]), columns=columns)
 
-    nr = 0
-    for i in range(nrays):
-        angle = fov/2 * i / (nrays - 1)
+def integrate(g, pos, dir, finished, length, h, num_steps, trajectory_file):
+    # rays are integrated in place, arrays are shared with libgeodesic2
+    rays = rays_frame(pos, dir)
+    g.calculate(pos, dir, finished, length, h, num_steps, trajectory=trajectory_file)
 
-        valid, pos, dir = space.emit_ray(t0, r0, angle)
+    result = rays_frame(pos, dir)
+    result.insert(0, 'status', finished)
+    result.insert(0, 'finished', finished != geodesic2.RAY_RUNNING)
+    return rays, result
 
-        maxd = max([abs(item) for item in dir])
-        if maxd > 10:
-            k = maxd / 10
-            dir = [item/k for item in dir]
-
-        if valid:
-            rays.loc[nr] = [pos[0], pos[1], pos[2], pos[3], dir[0], dir[1], dir[2], dir[3]]
-            angles.loc[nr] = [angle]
-            nr += 1
-
-    return rays, angles
+def init_angles(fov, nrays):
+    # rays are emitted by geodesic2 (kernel_emit), same as space.emit_ray
+    angles = [fov/2 * i / (nrays - 1) if nrays > 1 else 0 for i in range(nrays)]
+    return pd.DataFrame({'init_angle': angles})
 
 def get_output_angle(space, pos, dir):
     pos_valid, dir_valid, pos, dir, attrs = space.transform_from(pos, dir)
@@ -134,11 +63,73 @@ def get_output_angle(space, pos, dir):
         world = 1
     return True, gamma, world
 
-def calculate_rays(rs, rays, T, h, numsteps, metric, save_rays_dir):
-    args = pd.DataFrame(columns=['arg'])
-    args.loc[0] = [rs]
-    final = run_calculation(rays, "metrics/cl/" + metric, args, T, h, numsteps, save_rays_dir)
-    return final
+def final_angles(space, init, final):
+    angles = pd.DataFrame({'init_angle': init})
+    angles['final_angle'] = pd.Series(0.0, index=angles.index)
+    angles['collided'] = pd.Series(False, index=angles.index)
+    angles['world'] = pd.Series(-1, index=angles.index)
+
+    for pix in range(len(angles)):
+        pos = [final.loc[pix]['pos%i' % i] for i in range(dimensions)]
+        dir = [final.loc[pix]['dir%i' % i] for i in range(dimensions)]
+
+        # captured rays are stopped by metric before they reach horizon
+        is_collided = final.loc[pix]['status'] == geodesic2.RAY_CAPTURED or space.check_collision(pos)
+
+        if is_collided:
+            angles.at[pix, 'collided'] = True
+        else:
+            valid, gamma, world = get_output_angle(space, pos, dir)
+
+            if valid:
+                angles.at[pix, 'final_angle'] = gamma
+                angles.at[pix, 'world'] = world
+            else:
+                angles.at[pix, 'collided'] = True
+    return angles
+
+def refine_angles(angles, tolerance):
+    # midpoints of intervals between neighbour rays, where world changes
+    # or final angle jumps by more than tolerance, angles sorted by init_angle
+    init = angles['init_angle'].values
+    final = angles['final_angle'].values
+    world = angles['world'].values
+
+    jump = np.abs(np.diff(final))
+    jump = np.minimum(jump, 2*math.pi - jump)
+    split = (world[1:] != world[:-1]) | ((world[1:] != -1) & (jump > tolerance))
+    # rays closer than precision of angle can not be split further
+    split &= np.diff(init) > 1e-12 * np.maximum(np.abs(init[1:]), 1)
+    return (init[:-1][split] + init[1:][split]) / 2
+
+def calculate_rays(space, rs, T, h, numsteps, metric, trajectory_file, emitter, integrator, precision,
+                   tolerance, max_rounds):
+    with geodesic2.Geodesic2(os.path.join(CURDIR, "metrics/cl/" + metric + ".cl"), [rs],
+                             integrator=integrator, precision=precision) as g:
+        pos, dir, finished = g.emit(emitter["t0"], emitter["r0"], emitter["fov"], emitter["nrays"])
+        rays, final = integrate(g, pos, dir, finished, T, h, numsteps, trajectory_file)
+        init = init_angles(emitter["fov"] * math.pi/180, emitter["nrays"])['init_angle'].values
+        angles = final_angles(space, init, final)
+
+        # coarse rays are integrated again only in intervals, where result is not converged
+        for r in range(max_rounds if tolerance is not None else 0):
+            new_angles = refine_angles(angles, tolerance)
+            if len(new_angles) == 0:
+                break
+            print("Refinement round %i: %i rays" % (r + 1, len(new_angles)))
+            pos, dir, finished = g.emit_angles(emitter["t0"], emitter["r0"], new_angles)
+            new_rays, new_final = integrate(g, pos, dir, finished, T, h, numsteps, None)
+
+            rays = pd.concat([rays, new_rays], ignore_index=True)
+            final = pd.concat([final, new_final], ignore_index=True)
+            angles = pd.concat([angles, final_angles(space, new_angles, new_final)], ignore_index=True)
+
+            order = np.argsort(angles['init_angle'].values, kind='stable')
+            rays = rays.iloc[order].reset_index(drop=True)
+            final = final.iloc[order].reset_index(drop=True)
+            angles = angles.iloc[order].reset_index(drop=True)
+
+    return rays, final, angles
 
 dimensions = 4
 
@@ -154,18 +145,23 @@ T = float(profile["scene"]["T"])
 h = float(profile["scene"]["h"])
 numsteps = int(profile["scene"]["numsteps"])
 metric = profile["scene"]["metric"]
+integrator = profile["scene"].get("integrator", "rk4")
+precision = profile["scene"].get("precision", "double")
+refine = profile["scene"].get("refine", {})
+refine_tolerance = float(refine["tolerance"]) if "tolerance" in refine else None
+refine_rounds = int(refine.get("rounds", 10))
 
+# trajectories of all rays are written to one binary file, see geodesic2_trajectory2csv
 if "save_rays_dir" in profile["scene"]:
-    save_rays_dir = profile["scene"]["save_rays_dir"]
-else:
-    save_rays_dir = None
+    raise ValueError("save_rays_dir is replaced by files.trajectory, binary file of all trajectories")
+trajectory_file = profile["scene"]["files"].get("trajectory")
 
 #metric = 'schwarzschild'
 #metric = 'lemaitre'
 #metric = 'kruskal'
 
-#save_rays_dir = 'rays'
-#save_rays_dir = None
+#trajectory_file = 'calcs/trajectory.bin'
+#trajectory_file = None
 
 if metric == "schwarzschild":
     space = schwarzschild.SchwarzschildSpace(rs)
@@ -176,30 +172,21 @@ elif metric == "kruskal":
 else:
     raise "Unknown metric"
 
-rays, angles = init_rays(space, t0, r0, fov, pixels)
-final = calculate_rays(rs, rays, T, h, numsteps, metric, save_rays_dir)
-
-angles['final_angle'] = pd.Series(0.0, index=angles.index)
-angles['collided'] = pd.Series(False, index=angles.index)
-
-for pix in range(pixels):
-    pos = [final.loc[pix]['pos%i' % i] for i in range(dimensions)]
-    dir = [final.loc[pix]['dir%i' % i] for i in range(dimensions)]
-
-    is_collided = space.check_collision(pos)
-
-    if is_collided:
-        angles.at[pix, 'collided'] = True
-        angles.at[pix, 'world'] = -1
-    else:
-        valid, gamma, world = get_output_angle(space, pos, dir)
-
-        if valid:
-            angles.at[pix, 'final_angle'] = gamma
-            angles.at[pix, 'world'] = world
-        else:
-            angles.at[pix, 'collided'] = True
-            angles.at[pix, 'world'] = -1
+emitter = {
+    "t0": t0,
+    "r0": r0,
+    "fov": float(profile["scene"]["fov"]),      # degrees
+    "nrays": pixels,
+}
+print("Integrator: %s, precision: %s" % (integrator, precision))
+rays, final, angles = calculate_rays(space, rs, T, h, numsteps, metric, trajectory_file, emitter, integrator, precision,
+                                     refine_tolerance, refine_rounds)
+
+if refine_tolerance is not None:
+    # uniform set with smallest interval of refined one
+    step = np.diff(angles['init_angle'].values)
+    uniform = int(math.ceil(fov/2 / step[step > 0].min())) + 1 if len(angles) > 1 else 1
+    print("Rays: %i, uniform set of same resolution: %i" % (len(angles), uniform))
 
 print("Saving results")
 rays.to_csv(profile["scene"]["files"]["input"], sep=',', index=False, line_terminator='\n')
@@ -1,112 +1,40 @@
-real euler(real x)
-{
-    return x * exp(x);
-}
-
-real euler_dot(real x)
-{
-    return (1+x)*exp(x);
-}
-
-real newton_iteration(real x, real y)
-{
-    // x' = x - f(x) / f'(x)
-    // f(x) = euler(x) - y
-    // x' = x - (x*exp(x) - y) / ((x+1)*exp(x))
-    real expx = exp(x);
-    return x - (x*expx - y) / ((x+1)*expx);
-}
-
-real W0_newton(real y)
-{
-    const real e = 2.718281828459045;
-    if (y <= -1)
-        return -1/e;
-    real x = 0;
-    real xn = x;
-    const real dx = 1e-8;
-
-    do
-    {
-        x = xn;
-        xn = newton_iteration(x, y);
-        if (xn <= -1)
-        {
-            xn = (xn+x)/2;
-        }
-    } while (fabs(x - xn) > dx);
-
-    return xn;
-}
-
-real W0_binary(real y)
-{
-    const real e = 2.718281828459045;
-    if (y <= -1)
-        return -1/e;
-    
-    real dx = 1e-8;
-    
-    real x1 = -1;
-    real x2 = 100000;
-
-    real e1 = euler(x1);
-    real e2 = euler(x2);
-
-    while (x2 - x1 > dx)
-    {
-        real xv = (x1 + x2)/2;
-        real ev = euler(xv);
-
-        if (ev > y)
-        {
-            x2 = xv;
-            e2 = ev;
-        }
-        else
-        {
-            x1 = xv;
-            e1 = ev;
-        }
-    }
+#define METRIC_TENSOR_DUAL
+#define METRIC_OBSERVER_POSITION
 
-    return (x1 + x2)/2;
-}
-
-real W0(real y)
+real radius_relative(real T, real X)
 {
-//    return W0_newton(y);
-    return W0_binary(y);
+    // T**2 - X**2 = (1 - r/rs) * exp(r/rs)
+    return 1 + lambert_w0((X*X - T*T) / SPECIAL_E);
 }
 
-real radius_relative(real T, real X)
+struct dual radius_relative_dual(struct dual T, struct dual X)
 {
-    // T**2 - X**2 = (1 - r/rs) * exp(r/rs)
-    return 1 + W0((X*X - T*T) / 2.71828182846);
+    return dual_add_real(dual_lambert_w0(dual_scale(dual_sub(dual_sqr(X), dual_sqr(T)), 1 / SPECIAL_E)), 1);
 }
 
-struct tensor_2 metric_tensor(const struct tensor_1 *pos, __global const real *args)
+struct dual_tensor_2 metric_tensor_dual(const struct dual_tensor_1 *pos, __global const real *args)
 {
 	real rs = args[0];
 
-    struct tensor_2 g = {
+    struct dual_tensor_2 g = {
         .covar = {true, true}
     };
 
-    real T = pos->x[0];
-    real X = pos->x[1];
+    struct dual T = pos->x[0];
+    struct dual X = pos->x[1];
 
-    real theta = pos->x[2];
-    real phi = pos->x[3];
+    struct dual theta = pos->x[2];
+    struct dual phi = pos->x[3];
 
-    real r = radius_relative(T, X);
+    struct dual r = radius_relative_dual(T, X);
 
-    real k = 4 * rs*rs / r * exp(-r);
+    // k = 4 * rs*rs / r * exp(-r)
+    struct dual k = dual_scale(dual_div(dual_exp(dual_neg(r)), r), 4 * rs*rs);
 
-    g.x[0][0] = -k;                // g_TT
-    g.x[1][1] = k;                 // g_XX
-    g.x[2][2] = SQR(r*rs);            // g_thth
-    g.x[3][3] = SQR(r*rs*sin(theta)); //g_ff
+    g.x[0][0] = dual_neg(k);                                // g_TT
+    g.x[1][1] = k;                                          // g_XX
+    g.x[2][2] = dual_sqr(dual_scale(r, rs));                // g_thth
+    g.x[3][3] = dual_sqr(dual_scale(dual_mul(r, dual_sin(theta)), rs)); //g_ff
 
     return g;
 }
@@ -150,6 +78,31 @@ bool allowed_delta(const struct tensor_1 *pos,
     return true;
 }
 
+bool observer_position(real t, real r, struct tensor_1 *pos, __global const real *args)
+{
+    real rs = args[0];
+
+    real k = r/rs - 1;
+    real e = exp(r/(2*rs));
+    real sh = sinh(t/(2*rs));
+    real ch = cosh(t/(2*rs));
+
+    pos->covar[0] = false;
+    if (r > rs)
+    {
+        pos->x[0] = sqrt(k) * e * sh;     // T
+        pos->x[1] = sqrt(k) * e * ch;     // X
+    }
+    else
+    {
+        pos->x[0] = sqrt(-k) * e * ch;
+        pos->x[1] = sqrt(-k) * e * sh;
+    }
+    pos->x[2] = M_PI / 2;
+    pos->x[3] = 0;
+    return true;
+}
+
 struct tensor_2 contravariant_metric_tensor(const struct tensor_2 *g)
 {
     return contravariant_metric_tensor_diagonal(g);
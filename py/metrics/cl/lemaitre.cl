@@ -1,23 +1,27 @@
-struct tensor_2 metric_tensor(const struct tensor_1 *pos, __global const real *args)
+#define METRIC_TENSOR_DUAL
+#define METRIC_OBSERVER_POSITION
+
+struct dual_tensor_2 metric_tensor_dual(const struct dual_tensor_1 *pos, __global const real *args)
 {
 	real rs = args[0];
 
-    struct tensor_2 g = {
+    struct dual_tensor_2 g = {
         .covar = {true, true}
     };
 
-    real tau = pos->x[0];
-    real rho = pos->x[1];
+    struct dual tau = pos->x[0];
+    struct dual rho = pos->x[1];
 
-    real theta = pos->x[2];
-    real phi = pos->x[3];
+    struct dual theta = pos->x[2];
+    struct dual phi = pos->x[3];
 
-    real r = powr(3.0/2.0 * (rho - tau), 2.0/3.0) * powr(rs, 1.0/3.0);
+    // r = (3/2 * (rho - tau))^(2/3) * rs^(1/3)
+    struct dual r = dual_scale(dual_powr(dual_scale(dual_sub(rho, tau), 3.0/2.0), 2.0/3.0), powr(rs, 1.0/3.0));
 
-    g.x[0][0] = 1;                  // g_tau_tau
-    g.x[1][1] = -rs/r;              // g_rho_rho
-    g.x[2][2] = -SQR(r);            // g_thth
-    g.x[3][3] = -SQR(r*sin(theta)); // g_ff
+    g.x[0][0] = dual_const(1);                              // g_tau_tau
+    g.x[1][1] = dual_scale(dual_inv(r), -rs);               // g_rho_rho
+    g.x[2][2] = dual_neg(dual_sqr(r));                      // g_thth
+    g.x[3][3] = dual_neg(dual_sqr(dual_mul(r, dual_sin(theta)))); // g_ff
 
     return g;
 }
@@ -53,6 +57,19 @@ bool allowed_delta(const struct tensor_1 *pos,
     return true;
 }
 
+bool observer_position(real t, real r, struct tensor_1 *pos, __global const real *args)
+{
+    real rs = args[0];
+
+    // tau = t, rho = tau + 2/3 * r^(3/2) / rs^(1/2)
+    pos->covar[0] = false;
+    pos->x[0] = t;
+    pos->x[1] = t + 2.0/3.0 * powr(r, 1.5) / sqrt(rs);
+    pos->x[2] = M_PI / 2;
+    pos->x[3] = 0;
+    return true;
+}
+
 struct tensor_2 contravariant_metric_tensor(const struct tensor_2 *g)
 {
     return contravariant_metric_tensor_diagonal(g);
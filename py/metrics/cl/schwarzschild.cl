@@ -1,20 +1,27 @@
-struct tensor_2 metric_tensor(const struct tensor_1 *pos, __global const real *args)
+#define METRIC_TENSOR_DUAL
+#define METRIC_OBSERVER_POSITION
+#define METRIC_STOP_CONDITION
+#define METRIC_STATIC_SPHERICAL
+
+#define ESCAPE_RADIUS 100       // in rs, outgoing rays beyond it are completed analytically
+
+struct dual_tensor_2 metric_tensor_dual(const struct dual_tensor_1 *pos, __global const real *args)
 {
 	real rs = args[0];
 
-    struct tensor_2 g = {
+    struct dual_tensor_2 g = {
         .covar = {true, true}
     };
-    real r = pos->x[1];
-    real theta = pos->x[2];
-    real phi = pos->x[3];
+    struct dual r = pos->x[1];
+    struct dual theta = pos->x[2];
+    struct dual phi = pos->x[3];
 
-    real k = 1 - rs / r;
+    struct dual k = dual_add_real(dual_scale(dual_inv(r), -rs), 1);     // 1 - rs / r
 
-    g.x[0][0] = k;                  // g_tt
-    g.x[1][1] = -1/k;               // g_rr
-    g.x[2][2] = -SQR(r);            // g_thth
-    g.x[3][3] = -SQR(r*sin(theta)); //g_ff
+    g.x[0][0] = k;                                          // g_tt
+    g.x[1][1] = dual_neg(dual_inv(k));                      // g_rr
+    g.x[2][2] = dual_neg(dual_sqr(r));                      // g_thth
+    g.x[3][3] = dual_neg(dual_sqr(dual_mul(r, dual_sin(theta)))); //g_ff
 
     return g;
 }
@@ -43,6 +50,57 @@ bool allowed_delta(const struct tensor_1 *pos,
     return true;
 }
 
+bool observer_position(real t, real r, struct tensor_1 *pos, __global const real *args)
+{
+    pos->covar[0] = false;
+    pos->x[0] = t;
+    pos->x[1] = r;
+    pos->x[2] = M_PI / 2;
+    pos->x[3] = 0;
+    return true;
+}
+
+/**
+ * Ray inside photon sphere moving inward is captured. Outgoing equatorial
+ * ray far from black hole escapes: remaining change of phi is
+ * asin(b/r) - rs/(2b) (1 - s)^2 / s, s = sqrt(1 - b^2/r^2), to first order
+ * in rs/r, where b is impact parameter, and direction becomes radial
+ */
+int stop_condition(struct tensor_1 *pos, struct tensor_1 *dir, __global const real *args)
+{
+    real rs = args[0];
+    real r = pos->x[1];
+    real dt = fabs(dir->x[0]);
+    real dr = dir->x[1];
+
+    if (r > rs && r < 1.5 * rs && dr < 0)
+        return RAY_CAPTURED;
+
+    if (r < ESCAPE_RADIUS * rs || dr <= 0)
+        return RAY_RUNNING;
+    if (fabs(cos(pos->x[2])) > 1e-6 || fabs(r * dir->x[2]) > 1e-6 * dt)
+        return RAY_RUNNING;
+
+    real k = 1 - rs / r;
+    real b = r * r * dir->x[3] / (k * dt);
+    real x = fabs(b) / r;
+    /* expansion does not hold near periapsis */
+    if (x > 0.9)
+        return RAY_RUNNING;
+
+    real dphi = 0;
+    if (x > 0)
+    {
+        real s = sqrt(1 - x * x);
+        dphi = asin(x) - rs / (2 * fabs(b)) * (1 - s) * (1 - s) / s;
+    }
+
+    pos->x[3] += b < 0 ? -dphi : dphi;
+    dir->x[1] = k * dt;
+    dir->x[3] = 0;
+    return RAY_ESCAPED;
+}
+
 struct tensor_2 contravariant_metric_tensor(const struct tensor_2 *g)
 {
     return contravariant_metric_tensor_diagonal(g);
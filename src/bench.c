@@ -0,0 +1,701 @@
+/*
+ * Fixed benchmark scenarios of geodesic2. Reports throughput, time of each
+ * phase and peak memory as JSON, and checks final rays against reference
+ * outputs, so that performance changes can not silently change results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <config.h>
+#include <dispatcher.h>
+#include <context.h>
+#include <input.h>
+
+struct scenario_s {
+    const char *metric;
+    real rs;
+    real t0;            // observer
+    real r0;
+    real fov;           // degrees
+    size_t num_rays;
+    real T;
+    real h;
+    int num_steps;
+    int block;          // min_per_block of dispatcher, block of each cpu thread
+};
+
+/*
+ * Final rays of scenario do not depend on num_steps and block, so
+ * scenarios which differ only in them share reference output
+ */
+static const struct scenario_s scenarios[] = {
+    {"schwarzschild", 1, 0, 10,  360, 256,  1, 1e-3, 100,  64},
+    {"schwarzschild", 1, 0, 10,  360, 1024, 1, 1e-3, 100,  64},
+    {"schwarzschild", 1, 0, 10,  360, 1024, 1, 1e-3, 10,   64},
+    {"schwarzschild", 1, 0, 10,  360, 1024, 1, 1e-3, 1000, 64},
+    {"schwarzschild", 1, 0, 10,  360, 1024, 1, 1e-3, 100,  16},
+    {"schwarzschild", 1, 0, 10,  360, 1024, 1, 1e-3, 100,  512},
+    {"lemaitre",      1, 0, 10,  360, 256,  1, 1e-3, 100,  64},
+    {"lemaitre",      1, 0, 10,  360, 1024, 1, 1e-3, 100,  64},
+    {"kruskal",       1, 1, 0.6, 360, 256,  1, 1e-3, 100,  64},
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/*
+ * Comparison of fixed step integrators, --integrators. Rays are integrated
+ * with each integrator and step, and compared with adaptive integration
+ * with tight tolerance, so error can be weighed against time. Steps are
+ * powers of two, so all integrators make exactly T / h steps
+ */
+static const struct scenario_s integrator_scenario =
+    {"schwarzschild", 1, 0, 10, 360, 256, 20, 0, 100, 64};
+static const char *integrators[] = {"rk4", "dp5", "gl4", "gl6"};
+static const real integrator_steps[] = {0.25, 0.125, 0.0625};
+#define INTEGRATOR_REFERENCE_TOL 1e-13
+
+/*
+ * Comparison of precisions of OpenCL program, --precisions. Scenarios of
+ * 256 rays are integrated in float and mixed precision and compared with
+ * double
+ */
+static const char *precisions[] = {"double", "float", "mixed"};
+
+#define NUM_PRECISIONS (sizeof(precisions) / sizeof(precisions[0]))
+#define NUM_INTEGRATORS (sizeof(integrators) / sizeof(integrators[0]))
+#define NUM_INTEGRATOR_STEPS (sizeof(integrator_steps) / sizeof(integrator_steps[0]))
+
+/* backend of scenarios, context is kept while consecutive scenarios use the same metric */
+struct bench_backend_s {
+    bool use_cpu;
+    struct context_s context;
+    const char *metric;     // metric of context, NULL before first scenario
+};
+
+struct reference_check_s {
+    bool checked;
+    bool ok;
+    double max_error;   // relative to 1 + |reference value|
+    size_t mismatched_finished;
+};
+
+static double seconds_between(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void reference_name(char *fname, size_t size, const char *dir, const struct scenario_s *s)
+{
+    snprintf(fname, size, "%s/%s_%zu.csv", dir, s->metric, s->num_rays);
+}
+
+/**
+ * Save finished flag, pos and dir of each ray
+ */
+static int save_reference(const char *fname, const struct input_rays_s *rays, size_t stride)
+{
+    size_t i;
+    int j;
+    FILE *f = fopen(fname, "wt");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return -1;
+    }
+
+    fprintf(f, "finished,pos0,pos1,pos2,pos3,dir0,dir1,dir2,dir3\n");
+    for (i = 0; i < rays->num_objects; i++)
+    {
+        fprintf(f, "%i", (int)rays->finished[i]);
+        for (j = 0; j < DIM; j++)
+            fprintf(f, ",%.17g", (double)rays->pos[RAY_INDEX(i, j, stride)]);
+        for (j = 0; j < DIM; j++)
+            fprintf(f, ",%.17g", (double)rays->dir[RAY_INDEX(i, j, stride)]);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    return 0;
+}
+
+static double value_error(double value, double reference)
+{
+    if (isnan(value) || isnan(reference))
+        return isnan(value) && isnan(reference) ? 0 : INFINITY;
+    return fabs(value - reference) / (1 + fabs(reference));
+}
+
+/**
+ * Compare rays with reference file. Rays which finished differently fail
+ * the check, values of other rays must be within tolerance
+ */
+static int check_reference(const char *fname, const struct input_rays_s *rays, size_t stride,
+                           double tolerance, struct reference_check_s *check)
+{
+    size_t i;
+    int j;
+    char line[1024];
+
+    memset(check, 0, sizeof(*check));
+    FILE *f = fopen(fname, "rt");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return -1;
+    }
+
+    if (fgets(line, sizeof(line), f) == NULL)
+    {
+        printf("Reference [%s] is empty\n", fname);
+        fclose(f);
+        return -1;
+    }
+
+    for (i = 0; i < rays->num_objects; i++)
+    {
+        int finished;
+        double pos[DIM], dir[DIM];
+        if (fscanf(f, "%i,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf", &finished,
+                   &pos[0], &pos[1], &pos[2], &pos[3], &dir[0], &dir[1], &dir[2], &dir[3]) != 1 + 2 * DIM)
+        {
+            printf("Reference [%s] has %zu rays, %zu expected\n", fname, i, rays->num_objects);
+            fclose(f);
+            return -1;
+        }
+
+        if (finished != rays->finished[i])
+        {
+            check->mismatched_finished++;
+            continue;
+        }
+        for (j = 0; j < DIM; j++)
+        {
+            check->max_error = fmax(check->max_error, value_error(rays->pos[RAY_INDEX(i, j, stride)], pos[j]));
+            check->max_error = fmax(check->max_error, value_error(rays->dir[RAY_INDEX(i, j, stride)], dir[j]));
+        }
+    }
+    fclose(f);
+
+    check->checked = true;
+    check->ok = check->mismatched_finished == 0 && check->max_error <= tolerance;
+    return 0;
+}
+
+/**
+ * Emit rays of scenario and integrate them with context
+ * @param ray_steps steps done by all workers
+ * @return time of calculation, s
+ */
+static double integrate_scenario(struct context_s *context, const struct calculation_params_s *params,
+                                 const struct scenario_s *s, bool soa, struct input_rays_s *rays, double *ray_steps)
+{
+    struct timespec start, end;
+    struct emitter_params_s emitter = {
+        .t = s->t0,
+        .r = s->r0,
+        .fov = s->fov * M_PI / 180,
+        .num = s->num_rays,
+    };
+    if (alloc_rays(rays, s->num_rays) != 0 ||
+        context_emit(context, params, &emitter, rays->pos, rays->dir, rays->finished) < 0)
+        exit(1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct dispatcher_s dispatcher;
+    dispatcher_init(&dispatcher, rays->pos, rays->dir, soa ? rays->num_objects : 0, rays->finished,
+                    NULL, rays->num_objects);
+    dispatcher.min_per_block = s->block;
+    context_calculate(context, params, &dispatcher);
+
+    int k;
+    *ray_steps = 0;
+    for (k = 0; k < dispatcher.num_workers; k++)
+        *ray_steps += dispatcher.workers[k].ray_steps;
+    dispatcher_release(&dispatcher);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return seconds_between(&start, &end);
+}
+
+/**
+ * Integrate scenario on backend, check final rays against reference and
+ * write JSON object of scenario
+ * @param first is it first object of array
+ * @return 1 if rays differ from reference, 0 otherwise
+ */
+static int run_scenario(FILE *json, bool first, struct bench_backend_s *backend, const struct scenario_s *s,
+                        const char *metrics_dir, int num_threads, bool soa, struct calculation_params_s *params,
+                        const char *reference_dir, bool update_reference, double tolerance)
+{
+    struct context_s *context = &backend->context;
+    struct timespec t0, t1, t2, t3, t4;
+    double build_time;
+    int failed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (backend->metric == NULL || strcmp(backend->metric, s->metric))
+    {
+        char metric_fname[4096];
+        if (backend->metric != NULL)
+            context_release(context);
+        snprintf(metric_fname, sizeof(metric_fname), "%s/%s.cl", metrics_dir, s->metric);
+        if (context_init(context, metric_fname, backend->use_cpu, num_threads, PARTITION_NONE,
+                         soa ? " -DSOA_LAYOUT" : "", params) != 0)
+            exit(1);
+        backend->metric = s->metric;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        build_time = seconds_between(&t0, &t1);
+    }
+    else
+    {
+        build_time = 0;
+        context_set_args(context, params);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    struct input_rays_s rays;
+    struct emitter_params_s emitter = {
+        .t = s->t0,
+        .r = s->r0,
+        .fov = s->fov * M_PI / 180,
+        .num = s->num_rays,
+    };
+    if (alloc_rays(&rays, s->num_rays) != 0 ||
+        context_emit(context, params, &emitter, rays.pos, rays.dir, rays.finished) < 0)
+        exit(1);
+    size_t stride = soa ? rays.num_objects : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    struct context_timeline_s before, after;
+    context_get_timeline(context, &before);
+
+    struct dispatcher_s dispatcher;
+    dispatcher_init(&dispatcher, rays.pos, rays.dir, stride, rays.finished, NULL, rays.num_objects);
+    dispatcher.min_per_block = s->block;
+    context_calculate(context, params, &dispatcher);
+    context_get_timeline(context, &after);
+
+    double ray_steps = 0;
+    int k;
+    for (k = 0; k < dispatcher.num_workers; k++)
+        ray_steps += dispatcher.workers[k].ray_steps;
+    dispatcher_release(&dispatcher);
+
+    clock_gettime(CLOCK_MONOTONIC, &t3);
+    char reference_fname[4096];
+    struct reference_check_s check = {0};
+    reference_name(reference_fname, sizeof(reference_fname), reference_dir, s);
+    if (update_reference)
+    {
+        if (save_reference(reference_fname, &rays, stride) != 0)
+            exit(1);
+    }
+    else if (check_reference(reference_fname, &rays, stride, tolerance, &check) != 0 || !check.ok)
+    {
+        failed = 1;
+    }
+    release_rays(&rays);
+    clock_gettime(CLOCK_MONOTONIC, &t4);
+
+    const char *name = backend->use_cpu ? "cpu" : "opencl";
+    int cores = context_num_cores(context);
+    double elapsed = seconds_between(&t2, &t3);
+    printf("\t%s: %.3le ray steps/s, %.3le per core on %i cores, %.3lf s",
+           name, ray_steps / elapsed, ray_steps / elapsed / cores, cores, elapsed);
+    if (check.checked)
+        printf(", max error %.3le, %zu mismatched finished: %s\n", check.max_error, check.mismatched_finished,
+               check.ok ? "ok" : "FAILED");
+    else
+        printf(update_reference ? ", reference updated\n" : ", reference is not checked\n");
+
+    fprintf(json, "%s\n    {\n", first ? "" : ",");
+    fprintf(json, "      \"metric\": \"%s\",\n      \"rays\": %zu,\n      \"T\": %g,\n      \"h\": %g,\n",
+            s->metric, s->num_rays, s->T, s->h);
+    fprintf(json, "      \"num_steps\": %i,\n      \"block\": %i,\n", s->num_steps, s->block);
+    fprintf(json, "      \"backend\": \"%s\",\n      \"cores\": %i,\n", name, cores);
+    fprintf(json, "      \"ray_steps\": %.0lf,\n      \"elapsed\": %.6lf,\n      \"ray_steps_per_s\": %.6le,\n",
+            ray_steps, elapsed, ray_steps / elapsed);
+    fprintf(json, "      \"ray_steps_per_s_per_core\": %.6le,\n", ray_steps / elapsed / cores);
+    fprintf(json, "      \"phases\": {\"build\": %.6lf, \"emit\": %.6lf, \"upload\": %.6lf, \"kernel\": %.6lf, "
+            "\"readback\": %.6lf, \"host_io\": %.6lf},\n",
+            build_time, seconds_between(&t1, &t2), after.upload - before.upload, after.kernel - before.kernel,
+            after.readback - before.readback, seconds_between(&t3, &t4));
+    fprintf(json, "      \"peak_rss_kb\": %ld,\n", peak_rss_kb());
+    if (check.checked)
+        fprintf(json, "      \"reference\": {\"file\": \"%s\", \"max_error\": %.6le, \"mismatched_finished\": %zu, \"ok\": %s}\n",
+                reference_fname, check.max_error, check.mismatched_finished, check.ok ? "true" : "false");
+    else
+        fprintf(json, "      \"reference\": {\"file\": \"%s\", \"ok\": %s}\n",
+                reference_fname, update_reference ? "true" : "false");
+    fprintf(json, "    }");
+    return failed;
+}
+
+/**
+ * Maximal error of rays which are running in both sets
+ * @param mismatched number of rays with different status
+ */
+static double rays_error(const struct input_rays_s *rays, const struct input_rays_s *reference, size_t stride,
+                         size_t *mismatched)
+{
+    double max_error = 0;
+    size_t r;
+    int k;
+
+    /* rays stopped by metric or failed stop at different points, only running rays are compared */
+    *mismatched = 0;
+    for (r = 0; r < rays->num_objects; r++)
+    {
+        if (rays->finished[r] != reference->finished[r])
+        {
+            (*mismatched)++;
+            continue;
+        }
+        if (rays->finished[r] != RAY_RUNNING)
+            continue;
+        for (k = 0; k < DIM; k++)
+        {
+            max_error = fmax(max_error, value_error(rays->pos[RAY_INDEX(r, k, stride)],
+                                                    reference->pos[RAY_INDEX(r, k, stride)]));
+            max_error = fmax(max_error, value_error(rays->dir[RAY_INDEX(r, k, stride)],
+                                                    reference->dir[RAY_INDEX(r, k, stride)]));
+        }
+    }
+    return max_error;
+}
+
+/**
+ * Integrate comparison scenario with every integrator and step and write
+ * error against adaptive reference together with time as JSON array
+ */
+static void compare_integrators(FILE *json, const char *metrics_dir, bool use_cpu, int num_threads,
+                                bool soa, struct calculation_params_s *params)
+{
+    const struct scenario_s *s = &integrator_scenario;
+    char metric_fname[4096];
+    struct context_s context;
+    struct input_rays_s reference, rays;
+    double ray_steps;
+    size_t i, j;
+
+    snprintf(metric_fname, sizeof(metric_fname), "%s/%s.cl", metrics_dir, s->metric);
+    params->args[0] = s->rs;
+    params->T = s->T;
+    params->num_steps = s->num_steps;
+
+    params->integrator = NULL;
+    params->adaptive = true;
+    params->atol = INTEGRATOR_REFERENCE_TOL;
+    params->rtol = INTEGRATOR_REFERENCE_TOL;
+    params->h = integrator_steps[NUM_INTEGRATOR_STEPS - 1];
+    if (context_init(&context, metric_fname, use_cpu, num_threads, PARTITION_NONE,
+                     soa ? " -DSOA_LAYOUT" : "", params) != 0)
+        exit(1);
+    integrate_scenario(&context, params, s, soa, &reference, &ray_steps);
+    context_release(&context);
+    params->adaptive = false;
+    size_t stride = soa ? reference.num_objects : 0;
+
+    fprintf(json, ",\n  \"integrators\": [");
+    for (i = 0; i < NUM_INTEGRATORS; i++)
+    {
+        params->integrator = integrators[i];
+        if (context_init(&context, metric_fname, use_cpu, num_threads, PARTITION_NONE,
+                         soa ? " -DSOA_LAYOUT" : "", params) != 0)
+            exit(1);
+
+        for (j = 0; j < NUM_INTEGRATOR_STEPS; j++)
+        {
+            params->h = integrator_steps[j];
+            double elapsed = integrate_scenario(&context, params, s, soa, &rays, &ray_steps);
+            size_t mismatched;
+            double max_error = rays_error(&rays, &reference, stride, &mismatched);
+            release_rays(&rays);
+
+            printf("Integrator %s, h %g: max error %.3le, %zu mismatched finished, %.3lf s\n",
+                   integrators[i], params->h, max_error, mismatched, elapsed);
+            fprintf(json, "%s\n    {\"integrator\": \"%s\", \"h\": %g, \"ray_steps\": %.0lf, \"elapsed\": %.6lf, "
+                    "\"max_error\": %.6le, \"mismatched_finished\": %zu}",
+                    i == 0 && j == 0 ? "" : ",", integrators[i], params->h, ray_steps, elapsed, max_error, mismatched);
+        }
+        context_release(&context);
+    }
+    fprintf(json, "\n  ]");
+    release_rays(&reference);
+    params->integrator = NULL;
+}
+
+/**
+ * Integrate first scenario of 256 rays of every metric in each precision
+ * and write throughput and error against double as JSON array
+ */
+static void compare_precisions(FILE *json, const char *metrics_dir, const char *filter, int num_threads,
+                               bool soa, struct calculation_params_s *params)
+{
+    struct input_rays_s reference, rays;
+    bool first = true;
+    size_t i, j, k;
+
+    fprintf(json, ",\n  \"precisions\": [");
+    for (i = 0; i < NUM_SCENARIOS; i++)
+    {
+        const struct scenario_s *s = &scenarios[i];
+        char metric_fname[4096];
+        bool seen = false;
+        if (s->num_rays != 256 || (filter != NULL && strcmp(filter, s->metric)))
+            continue;
+        for (k = 0; k < i; k++)
+            seen |= scenarios[k].num_rays == 256 && !strcmp(scenarios[k].metric, s->metric);
+        if (seen)
+            continue;
+
+        snprintf(metric_fname, sizeof(metric_fname), "%s/%s.cl", metrics_dir, s->metric);
+        params->args[0] = s->rs;
+        params->T = s->T;
+        params->h = s->h;
+        params->num_steps = s->num_steps;
+
+        for (j = 0; j < NUM_PRECISIONS; j++)
+        {
+            struct context_s context;
+            double ray_steps;
+            params->precision = precisions[j];
+            if (context_init(&context, metric_fname, false, num_threads, PARTITION_NONE,
+                             soa ? " -DSOA_LAYOUT" : "", params) != 0)
+                exit(1);
+            double elapsed = integrate_scenario(&context, params, s, soa, j == 0 ? &reference : &rays, &ray_steps);
+            context_release(&context);
+
+            size_t mismatched = 0;
+            double max_error = 0;
+            if (j > 0)
+            {
+                max_error = rays_error(&rays, &reference, soa ? rays.num_objects : 0, &mismatched);
+                release_rays(&rays);
+            }
+
+            printf("Precision %s, %s: %.3le ray steps/s, max error %.3le, %zu mismatched finished\n",
+                   precisions[j], s->metric, ray_steps / elapsed, max_error, mismatched);
+            fprintf(json, "%s\n    {\"metric\": \"%s\", \"precision\": \"%s\", \"ray_steps\": %.0lf, \"elapsed\": %.6lf, "
+                    "\"ray_steps_per_s\": %.6le, \"max_error\": %.6le, \"mismatched_finished\": %zu}",
+                    first ? "" : ",", s->metric, precisions[j], ray_steps, elapsed, ray_steps / elapsed,
+                    max_error, mismatched);
+            first = false;
+        }
+        release_rays(&reference);
+    }
+    fprintf(json, "\n  ]");
+    params->precision = NULL;
+}
+
+static void usage(void)
+{
+    printf("Usage: geodesic2_bench [options]\n");
+    printf("Options:\n");
+    printf("  --backend <opencl|cpu>     integrate with OpenCL devices or natively on CPU\n");
+    printf("  --threads <n>              number of threads of cpu backend\n");
+    printf("  --soa                      structure of arrays layout of rays in memory\n");
+    printf("  --metrics <dir>            directory of metric files, default %s/py/metrics/cl\n", SOURCEROOT);
+    printf("  --reference <dir>          directory of reference outputs, default %s/bench/reference\n", SOURCEROOT);
+    printf("  --update-reference         write reference outputs instead of checking them\n");
+    printf("  --tolerance <value>        allowed relative difference from reference, default 1e-6\n");
+    printf("  --output <file>            JSON report, default geodesic2_bench.json\n");
+    printf("  --filter <metric>          run scenarios of one metric only\n");
+    printf("  --integrators              also compare error and time of fixed step integrators\n");
+    printf("  --precisions               also compare throughput and error of float and mixed precision (OpenCL)\n");
+    printf("  --compare-backends         run every scenario on OpenCL and cpu backend side by side\n");
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+
+    static const struct option long_options[] = {
+        {"backend", required_argument, NULL, 'B'},
+        {"threads", required_argument, NULL, 'j'},
+        {"soa", no_argument, NULL, 'S'},
+        {"metrics", required_argument, NULL, 'M'},
+        {"reference", required_argument, NULL, 'R'},
+        {"update-reference", no_argument, NULL, 'U'},
+        {"tolerance", required_argument, NULL, 't'},
+        {"output", required_argument, NULL, 'o'},
+        {"filter", required_argument, NULL, 'f'},
+        {"integrators", no_argument, NULL, 'I'},
+        {"precisions", no_argument, NULL, 'P'},
+        {"compare-backends", no_argument, NULL, 'C'},
+        {"help", no_argument,       NULL, 'H'},
+        {NULL,   0,                 NULL, 0},
+    };
+
+    bool use_cpu = false;
+    bool soa = false;
+    bool update_reference = false;
+    bool with_integrators = false;
+    bool with_precisions = false;
+    bool compare_backends = false;
+    double tolerance = 1e-6;
+    const char *metrics_dir = SOURCEROOT "/py/metrics/cl";
+    const char *reference_dir = SOURCEROOT "/bench/reference";
+    const char *output_fname = "geodesic2_bench.json";
+    const char *filter = NULL;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'B':
+            if (!strcmp(optarg, "cpu"))
+            {
+                use_cpu = true;
+            }
+            else if (strcmp(optarg, "opencl"))
+            {
+                printf("Unknown backend [%s]\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1)
+                num_threads = 1;
+            break;
+        case 'S':
+            soa = true;
+            break;
+        case 'M':
+            metrics_dir = optarg;
+            break;
+        case 'R':
+            reference_dir = optarg;
+            break;
+        case 'U':
+            update_reference = true;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        case 'o':
+            output_fname = optarg;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'I':
+            with_integrators = true;
+            break;
+        case 'P':
+            with_precisions = true;
+            break;
+        case 'C':
+            compare_backends = true;
+            break;
+        case 'H':
+        default:
+            usage();
+            return opt == 'H' ? 0 : 1;
+        }
+    }
+
+    if (compare_backends && update_reference)
+    {
+        printf("Reference is written from one backend, --update-reference can not be used with --compare-backends\n");
+        return 1;
+    }
+
+    FILE *json = fopen(output_fname, "wt");
+    if (json == NULL)
+    {
+        printf("Can not open file [%s]\n", output_fname);
+        return 1;
+    }
+
+    /* scenarios run on selected backend, or on both one after another */
+    struct bench_backend_s backends[2] = {
+        {.use_cpu = compare_backends ? false : use_cpu},
+        {.use_cpu = true},
+    };
+    int num_backends = compare_backends ? 2 : 1;
+
+    fprintf(json, "{\n  \"backend\": \"%s\",\n  \"threads\": %i,\n  \"soa\": %s,\n  \"tolerance\": %g,\n  \"scenarios\": [",
+            compare_backends ? "opencl,cpu" : use_cpu ? "cpu" : "opencl",
+            use_cpu || compare_backends ? num_threads : 0, soa ? "true" : "false", tolerance);
+
+    real args[1];
+    struct calculation_params_s params = {
+        .soa = soa,
+        .adaptive = false,
+        .atol = 1e-9,
+        .rtol = 1e-9,
+        .table = {
+            .nr = 0,
+            .ntheta = 1,
+            .theta_min = M_PI / 2,
+            .theta_max = M_PI / 2,
+        },
+        .profiling = true,
+        .args = args,
+        .num_args = 1,
+    };
+
+    int failed = 0;
+    bool first = true;
+    int b;
+    for (i = 0; i < NUM_SCENARIOS; i++)
+    {
+        const struct scenario_s *s = &scenarios[i];
+        if (filter != NULL && strcmp(filter, s->metric))
+            continue;
+
+        printf("Scenario %zu: %s, %zu rays, num_steps %i, block %i\n", i, s->metric, s->num_rays, s->num_steps, s->block);
+        args[0] = s->rs;
+        params.T = s->T;
+        params.h = s->h;
+        params.num_steps = s->num_steps;
+
+        for (b = 0; b < num_backends; b++)
+        {
+            failed += run_scenario(json, first, &backends[b], s, metrics_dir, num_threads, soa, &params,
+                                   reference_dir, update_reference, tolerance);
+            first = false;
+        }
+    }
+
+    for (b = 0; b < num_backends; b++)
+    {
+        if (backends[b].metric != NULL)
+            context_release(&backends[b].context);
+    }
+
+    fprintf(json, "\n  ]");
+    if (with_integrators)
+        compare_integrators(json, metrics_dir, use_cpu, num_threads, soa, &params);
+    if (with_precisions && use_cpu)
+        printf("Precisions are compared on OpenCL backend only\n");
+    else if (with_precisions)
+        compare_precisions(json, metrics_dir, filter, num_threads, soa, &params);
+
+    fprintf(json, ",\n  \"failed\": %i\n}\n", failed);
+    fclose(json);
+
+    if (failed > 0)
+    {
+        printf("%i scenarios differ from reference\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -1,125 +1,896 @@
 #include <config.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <opencl.h>
 #include <calc.h>
+#include <numa_affinity.h>
 
-void perform_calculation(struct calculation_unit_s *unit,
-                         real T, real h,
-                         real *pos,
-                         real *dir,
-                         cl_int *finished,
-                         size_t num_objects,
-                         real *args,
-                         size_t num_args,
-                         FILE **output,
-                         cl_int num_steps)
+/* must match layout of table in geodesic.cl */
+#define TABLE_HEADER 6
+#define TABLE_NODE   (DIM*DIM*DIM)
+
+static const char *integrators[][2] = {
+    {"rk4", ""},
+    {"dp5", " -DINTEGRATOR_DP5"},
+    {"gl4", " -DINTEGRATOR_GL4"},
+    {"gl6", " -DINTEGRATOR_GL6"},
+};
+
+/**
+ * Build option which selects integrator of fixed step mode in geodesic.cl
+ * @param name rk4, dp5, gl4 or gl6, NULL for rk4
+ * @return NULL if integrator is unknown
+ */
+const char *integrator_build_option(const char *name)
 {
-    int err;
+    size_t i;
+    if (name == NULL)
+        return "";
+    for (i = 0; i < sizeof(integrators) / sizeof(integrators[0]); i++)
+    {
+        if (!strcmp(name, integrators[i][0]))
+            return integrators[i][1];
+    }
+    return NULL;
+}
+
+/* single precision constants keep float programs free of double arithmetic */
+static const char *precisions[][2] = {
+    {"double", ""},
+    {"float", " -DPRECISION_FLOAT -cl-single-precision-constant"},
+    {"mixed", " -DPRECISION_MIXED -cl-single-precision-constant"},
+};
+
+/**
+ * Build options which select precision of program, see space.cl
+ * @param name double, float or mixed, NULL for double
+ * @return NULL if precision is unknown
+ */
+const char *precision_build_option(const char *name)
+{
+    size_t i;
+    if (name == NULL)
+        return "";
+    for (i = 0; i < sizeof(precisions) / sizeof(precisions[0]); i++)
+    {
+        if (!strcmp(name, precisions[i][0]))
+            return precisions[i][1];
+    }
+    return NULL;
+}
+
+/**
+ * Set scalar argument of kernel in precision of device
+ * @param single device has float type for this argument
+ */
+static void set_real_arg(cl_kernel kernel, cl_uint index, bool single, real value)
+{
+    if (single)
+    {
+        cl_float v = value;
+        clSetKernelArg(kernel, index, sizeof(v), &v);
+    }
+    else
+    {
+        clSetKernelArg(kernel, index, sizeof(value), &value);
+    }
+}
+
+/**
+ * Create buffer of reals in precision of device
+ * @param values num reals, buffer of one real is created if num is 0
+ */
+static cl_mem create_real_buffer(struct calculation_unit_s *unit, const real *values, size_t num,
+                                 cl_mem_flags flags)
+{
+    size_t i;
+    size_t size = unit->real_size * (num > 0 ? num : 1);
+    cl_mem mem = clCreateBuffer(unit->context, flags, size, NULL, NULL);
+    if (num == 0)
+        return mem;
+
+    if (unit->real_size == sizeof(cl_float))
+    {
+        cl_float *v = malloc(size);
+        for (i = 0; i < num; i++)
+            v[i] = values[i];
+        clEnqueueWriteBuffer(unit->queue, mem, CL_TRUE, 0, size, v, 0, NULL, NULL);
+        free(v);
+    }
+    else
+    {
+        clEnqueueWriteBuffer(unit->queue, mem, CL_TRUE, 0, size, values, 0, NULL, NULL);
+    }
+    return mem;
+}
+
+/**
+ * @return number of parameters of metric of all scenes
+ */
+size_t scene_args_size(const struct calculation_params_s *params)
+{
+    return params->num_args * (params->num_scenes > 0 ? params->num_scenes : 1);
+}
+
+/**
+ * Create buffer of parameters of metric of all scenes in precision of device
+ */
+static cl_mem create_args_buffer(struct calculation_unit_s *unit, const struct calculation_params_s *params,
+                                 cl_mem_flags flags)
+{
+    return create_real_buffer(unit, params->args, scene_args_size(params), flags);
+}
+
+void init_cristofel_table(struct calculation_unit_s *unit,
+                          const struct calculation_params_s *params)
+{
+    const struct cristofel_table_params_s *tp = &params->table;
     int i;
+    int err;
+
+    if (tp->nr < 2 || tp->ntheta < 1)
+        return;
+
+    /* table is indexed by pos1 and pos2 only, it would be wrong for other metrics */
+    cl_kernel fill = clCreateKernel(unit->program, "kernel_cristofel_table", &err);
+    if (err != CL_SUCCESS)
+    {
+        printf("Cristofel symbol can not be tabulated, metric does not define METRIC_STATIC_SPHERICAL\n");
+        exit(1);
+    }
+
+    size_t num_nodes = (size_t)tp->nr * tp->ntheta;
+    size_t num_cells = (size_t)(tp->nr - 1) * (tp->ntheta > 1 ? tp->ntheta - 1 : 1);
+    size_t table_size = TABLE_HEADER + num_nodes * TABLE_NODE;
+
+    real header[TABLE_HEADER] = {
+        tp->r_min, tp->r_max, tp->nr,
+        tp->theta_min, tp->theta_max, tp->ntheta,
+    };
+    cl_float header_float[TABLE_HEADER];
+    for (i = 0; i < TABLE_HEADER; i++)
+        header_float[i] = header[i];
 
-    cl_mem pos_mem;
-    cl_mem dir_mem;
-    cl_mem finished_mem;
-
-    cl_mem args_mem;
-
-    pos_mem = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, sizeof(real) * num_objects * DIM, NULL, NULL);
-    dir_mem = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, sizeof(real) * num_objects * DIM, NULL, NULL);
-    finished_mem = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, sizeof(cl_int) * num_objects, NULL, NULL);
-    args_mem = clCreateBuffer(unit->context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, sizeof(real) * num_args, NULL, NULL);
- 
-    clEnqueueWriteBuffer(unit->queue, pos_mem, CL_TRUE, 0, sizeof(real) * num_objects * DIM, pos, 0, NULL, NULL);
-    clEnqueueWriteBuffer(unit->queue, dir_mem, CL_TRUE, 0, sizeof(real) * num_objects * DIM, dir, 0, NULL, NULL);
-    clEnqueueWriteBuffer(unit->queue, finished_mem, CL_TRUE, 0, sizeof(cl_int) * num_objects, finished, 0, NULL, NULL);
-    clEnqueueWriteBuffer(unit->queue, args_mem, CL_TRUE, 0, sizeof(real) * num_args, args, 0, NULL, NULL);
+    cl_mem table_mem = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, unit->real_size * table_size, NULL, &err);
+    if (err != CL_SUCCESS)
+    {
+        printf("Can not allocate cristofel table: %s\n", opencl_error(err));
+        clReleaseKernel(fill);
+        return;
+    }
+
+    cl_mem args_mem = create_args_buffer(unit, params, CL_MEM_READ_ONLY);
+    cl_mem error_mem = clCreateBuffer(unit->context, CL_MEM_WRITE_ONLY, unit->real_size * num_cells, NULL, NULL);
+
+    clEnqueueWriteBuffer(unit->queue, table_mem, CL_TRUE, 0, unit->real_size * TABLE_HEADER,
+                         unit->real_size == sizeof(cl_float) ? (void *)header_float : (void *)header, 0, NULL, NULL);
+
+    clSetKernelArg(fill, 0, sizeof(cl_mem), &table_mem);
+    clSetKernelArg(fill, 1, sizeof(cl_mem), &args_mem);
+    clEnqueueNDRangeKernel(unit->queue, fill, 1, NULL, &num_nodes, NULL, 0, NULL, NULL);
+
+    cl_kernel estimate = clCreateKernel(unit->program, "kernel_cristofel_table_error", &err);
+    clSetKernelArg(estimate, 0, sizeof(cl_mem), &table_mem);
+    clSetKernelArg(estimate, 1, sizeof(cl_mem), &args_mem);
+    clSetKernelArg(estimate, 2, sizeof(cl_mem), &error_mem);
+    clEnqueueNDRangeKernel(unit->queue, estimate, 1, NULL, &num_cells, NULL, 0, NULL, NULL);
+
+    real *error = malloc(sizeof(real) * num_cells);
+    clEnqueueReadBuffer(unit->queue, error_mem, CL_TRUE, 0, unit->real_size * num_cells, error, 0, NULL, NULL);
     clFinish(unit->queue);
+    /* float values are in the first half of array, converted from the end */
+    if (unit->real_size == sizeof(cl_float))
+    {
+        for (i = num_cells; i-- > 0;)
+            error[i] = ((cl_float *)error)[i];
+    }
+
+    real max_error = 0;
+    int max_cell = 0;
+    for (i = 0; i < num_cells; i++)
+    {
+        if (!(error[i] <= max_error))
+        {
+            max_error = error[i];
+            max_cell = i;
+        }
+    }
+    real max_r = tp->r_min + (tp->r_max - tp->r_min) * (max_cell % (tp->nr - 1) + 0.5) / (tp->nr - 1);
+    printf("Cristofel table: %i x %i nodes, max relative interpolation error %le at pos1 = %lf\n",
+           tp->nr, tp->ntheta, (double)max_error, (double)max_r);
 
-    clSetKernelArg(unit->kernel, 0, sizeof(cl_int), &num_steps);
-    clSetKernelArg(unit->kernel, 1, sizeof(cl_mem), &pos_mem);
-    clSetKernelArg(unit->kernel, 2, sizeof(cl_mem), &dir_mem);
-    clSetKernelArg(unit->kernel, 3, sizeof(cl_mem), &finished_mem);
-    clSetKernelArg(unit->kernel, 4, sizeof(real), &h);
-    clSetKernelArg(unit->kernel, 5, sizeof(cl_mem), &args_mem);
+    free(error);
+    clReleaseKernel(fill);
+    clReleaseKernel(estimate);
+    clReleaseMemObject(args_mem);
+    clReleaseMemObject(error_mem);
 
-    real t;
+    unit->cristofel_table = table_mem;
+}
 
-    if (output)
+/**
+ * Angle of emitted ray to direction to center
+ * @param i index of ray, less than emitter->num
+ */
+real emitter_angle(const struct emitter_params_s *emitter, size_t i)
+{
+    if (emitter->angles != NULL)
+        return emitter->angles[i];
+    return emitter->num > 1 ? emitter->fov / 2 * i / (emitter->num - 1) : 0;
+}
+
+/**
+ * Emit rays of observer on device of unit
+ * @param pos, dir, finished arrays of emitter->num rays in layout of params
+ * @return number of valid rays, -1 if metric can not emit rays
+ */
+int emit_rays(struct calculation_unit_s *unit,
+              const struct calculation_params_s *params,
+              const struct emitter_params_s *emitter,
+              real *pos, real *dir, cl_int *finished)
+{
+    size_t i;
+    int err;
+
+    cl_kernel emit = clCreateKernel(unit->program, "kernel_emit", &err);
+    if (err != CL_SUCCESS)
     {
-        for (i = 0; i < num_objects; i++)
+        printf("Metric can not emit rays, it does not define observer_position\n");
+        return -1;
+    }
+
+    size_t num = emitter->num;
+    cl_int num_arg = num;
+    cl_int stride = params->soa ? num : 0;
+    size_t state_size = unit->state_size;
+    cl_mem pos_mem = clCreateBuffer(unit->context, CL_MEM_WRITE_ONLY, state_size * num * DIM, NULL, NULL);
+    cl_mem dir_mem = clCreateBuffer(unit->context, CL_MEM_WRITE_ONLY, state_size * num * DIM, NULL, NULL);
+    cl_mem finished_mem = clCreateBuffer(unit->context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * num, NULL, NULL);
+    cl_mem args_mem = create_args_buffer(unit, params, CL_MEM_READ_ONLY);
+
+    real *angles = malloc(sizeof(real) * (num > 0 ? num : 1));
+    for (i = 0; i < num; i++)
+        angles[i] = emitter_angle(emitter, i);
+    cl_mem angles_mem = create_real_buffer(unit, angles, num, CL_MEM_READ_ONLY);
+    free(angles);
+
+    bool single = unit->real_size == sizeof(cl_float);
+    clSetKernelArg(emit, 0, sizeof(cl_int), &num_arg);
+    clSetKernelArg(emit, 1, sizeof(cl_int), &stride);
+    set_real_arg(emit, 2, single, emitter->t);
+    set_real_arg(emit, 3, single, emitter->r);
+    clSetKernelArg(emit, 4, sizeof(cl_mem), &angles_mem);
+    clSetKernelArg(emit, 5, sizeof(cl_mem), &pos_mem);
+    clSetKernelArg(emit, 6, sizeof(cl_mem), &dir_mem);
+    clSetKernelArg(emit, 7, sizeof(cl_mem), &finished_mem);
+    clSetKernelArg(emit, 8, sizeof(cl_mem), &args_mem);
+    clEnqueueNDRangeKernel(unit->queue, emit, 1, NULL, &num, NULL, 0, NULL, NULL);
+
+    clEnqueueReadBuffer(unit->queue, pos_mem, CL_FALSE, 0, state_size * num * DIM, pos, 0, NULL, NULL);
+    clEnqueueReadBuffer(unit->queue, dir_mem, CL_FALSE, 0, state_size * num * DIM, dir, 0, NULL, NULL);
+    clEnqueueReadBuffer(unit->queue, finished_mem, CL_FALSE, 0, sizeof(cl_int) * num, finished, 0, NULL, NULL);
+    clFinish(unit->queue);
+
+    /* float rays are read into the first half of arrays, converted from the end */
+    if (state_size == sizeof(cl_float))
+    {
+        for (i = num * DIM; i-- > 0;)
         {
-           if (finished[i])
-               fprintf(output[i], "true");
-           else
-               fprintf(output[i], "false");
-           fprintf(output[i], ", %0.12lf", 0.0);
-           int j;
-           for (j = 0; j < DIM; j++)
-               fprintf(output[i], ", %0.12lf", (double)pos[DIM * i + j]);
-           for (j = 0; j < DIM; j++)
-               fprintf(output[i], ", %0.12lf", (double)dir[DIM * i + j]);
-           fprintf(output[i], "\n");
+            pos[i] = ((cl_float *)pos)[i];
+            dir[i] = ((cl_float *)dir)[i];
         }
     }
 
-    for (t = 0; t < T; t += h * num_steps)
+    clReleaseKernel(emit);
+    clReleaseMemObject(pos_mem);
+    clReleaseMemObject(dir_mem);
+    clReleaseMemObject(finished_mem);
+    clReleaseMemObject(args_mem);
+    clReleaseMemObject(angles_mem);
+
+    int valid = 0;
+    for (i = 0; i < num; i++)
+        valid += finished[i] == 0;
+    return valid;
+}
+
+static cl_event *slot_event(struct calculation_slot_s *slot, enum event_kind_e kind)
+{
+    slot->event_kind[slot->num_events] = kind;
+    return &slot->events[slot->num_events++];
+}
+
+/**
+ * Enqueue copy of elements [offset, offset + num) of array of ray state
+ * (pos, dir, length, step) to or from device. Float state goes through
+ * `dev` array of the same layout, readback is converted to host in slot_wait
+ * @param dev staging array of device precision, NULL if device state is double
+ */
+static void enqueue_state(struct calculation_slot_s *slot, cl_mem mem, real *host, cl_float *dev,
+                          size_t offset, size_t num, bool write)
+{
+    size_t i;
+    if (num == 0)
+        return;
+
+    if (dev == NULL)
     {
-        err = clEnqueueNDRangeKernel(unit->queue, unit->kernel, 1, NULL, &num_objects, NULL, 0, NULL, NULL);
-        clFinish(unit->queue);
+        if (write)
+            clEnqueueWriteBuffer(slot->queue, mem, CL_FALSE, sizeof(real) * offset, sizeof(real) * num, host + offset, 0, NULL, slot_event(slot, EVENT_UPLOAD));
+        else
+            clEnqueueReadBuffer(slot->queue, mem, CL_FALSE, sizeof(real) * offset, sizeof(real) * num, host + offset, 0, NULL, slot_event(slot, EVENT_READBACK));
+        return;
+    }
+
+    if (write)
+    {
+        for (i = offset; i < offset + num; i++)
+            dev[i] = host[i];
+        clEnqueueWriteBuffer(slot->queue, mem, CL_FALSE, sizeof(cl_float) * offset, sizeof(cl_float) * num, dev + offset, 0, NULL, slot_event(slot, EVENT_UPLOAD));
+    }
+    else
+    {
+        struct slot_conversion_s *c = &slot->conversions[slot->num_conversions++];
+        clEnqueueReadBuffer(slot->queue, mem, CL_FALSE, sizeof(cl_float) * offset, sizeof(cl_float) * num, dev + offset, 0, NULL, slot_event(slot, EVENT_READBACK));
+        c->host = host + offset;
+        c->dev = dev + offset;
+        c->num = num;
+    }
+}
+
+/**
+ * Enqueue copy of rays [first, first + num) of pos or dir to or from device.
+ * Host array has the same layout as device buffer
+ */
+static void enqueue_rays(struct calculation_slot_s *slot, cl_mem mem, real *host, cl_float *dev,
+                         size_t first, size_t num, bool write)
+{
+    int j;
+    if (slot->stride == 0)
+    {
+        enqueue_state(slot, mem, host, dev, DIM * first, DIM * num, write);
+        return;
+    }
+    for (j = 0; j < DIM; j++)
+        enqueue_state(slot, mem, host, dev, j * slot->stride + first, num, write);
+}
+
+/**
+ * Enqueue copy of elements [first, first + num) of per-ray array
+ */
+static void enqueue_array(struct calculation_slot_s *slot, cl_mem mem, void *host, size_t size,
+                          size_t first, size_t num, bool write)
+{
+    if (num == 0)
+        return;
 
-        if (output)
+    if (write)
+        clEnqueueWriteBuffer(slot->queue, mem, CL_FALSE, size * first, size * num, (char *)host + size * first, 0, NULL, slot_event(slot, EVENT_UPLOAD));
+    else
+        clEnqueueReadBuffer(slot->queue, mem, CL_FALSE, size * first, size * num, (char *)host + size * first, 0, NULL, slot_event(slot, EVENT_READBACK));
+}
+
+/**
+ * Add command to device timeline of unit
+ */
+static void account_event(struct calculation_unit_s *unit, cl_event event, enum event_kind_e kind)
+{
+    cl_ulong start, end;
+    if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) != CL_SUCCESS ||
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) != CL_SUCCESS)
+        return;
+
+    telemetry_device_span(unit->telemetry, unit->worker,
+                          kind == EVENT_KERNEL ? TELEMETRY_KERNEL : kind == EVENT_UPLOAD ? TELEMETRY_UPLOAD : TELEMETRY_READBACK,
+                          start, end);
+    if (kind == EVENT_KERNEL)
+        unit->kernel_time += end - start;
+    else if (kind == EVENT_UPLOAD)
+        unit->upload_time += end - start;
+    else
+        unit->readback_time += end - start;
+
+    if (unit->first_start == 0 || start < unit->first_start)
+        unit->first_start = start;
+    if (end > unit->last_end)
+    {
+        unit->busy_time += end - (start > unit->last_end ? start : unit->last_end);
+        unit->last_end = end;
+    }
+}
+
+/**
+ * Wait for commands of current chunk of slot
+ */
+static void slot_wait(struct calculation_unit_s *unit, struct calculation_slot_s *slot)
+{
+    int i;
+    if (slot->num_events == 0)
+        return;
+
+    clWaitForEvents(slot->num_events, slot->events);
+    for (i = 0; i < slot->num_events; i++)
+    {
+        account_event(unit, slot->events[i], slot->event_kind[i]);
+        clReleaseEvent(slot->events[i]);
+    }
+    slot->num_events = 0;
+
+    /* float state which has been read back */
+    for (i = 0; i < slot->num_conversions; i++)
+    {
+        const struct slot_conversion_s *c = &slot->conversions[i];
+        size_t k;
+        for (k = 0; k < c->num; k++)
+            c->host[k] = c->dev[k];
+    }
+    slot->num_conversions = 0;
+}
+
+void init_calculation_unit(struct calculation_unit_s *unit,
+                           const struct calculation_params_s *params)
+{
+    int s, k;
+    int err;
+    size_t capacity = unit->max_parallel_points;
+
+    unit->args_mem = create_args_buffer(unit, params, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY);
+    size_t state_size = unit->state_size;
+    bool float_state = state_size == sizeof(cl_float);
+
+    for (s = 0; s < NUM_SLOTS; s++)
+    {
+        struct calculation_slot_s *slot = &unit->slots[s];
+        slot->queue = clCreateCommandQueue(unit->context, unit->device,
+                                           params->profiling ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+        if (err != CL_SUCCESS)
         {
-            err = clEnqueueReadBuffer(unit->queue, pos_mem, CL_TRUE, 0, sizeof(real) * DIM * num_objects, pos, 0, NULL, NULL);
-            err = clEnqueueReadBuffer(unit->queue, dir_mem, CL_TRUE, 0, sizeof(real) * DIM * num_objects, dir, 0, NULL, NULL);
+            printf("Can not create command queue: %s\n", opencl_error(err));
+            exit(1);
         }
-        err = clEnqueueReadBuffer(unit->queue, finished_mem, CL_TRUE, 0, sizeof(cl_int) * num_objects, finished, 0, NULL, NULL);
-        clFinish(unit->queue);
 
-        bool all_collided = true;
-        for (i = 0; i < num_objects; i++)
+        for (k = 0; k < 2; k++)
         {
-            if (finished[i] == 0)
-            {
-                all_collided = false;
-                break;
-            }
+            slot->pos_mem[k] = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, state_size * capacity * DIM, NULL, NULL);
+            slot->dir_mem[k] = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, state_size * capacity * DIM, NULL, NULL);
+            slot->finished_mem[k] = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, sizeof(cl_int) * capacity, NULL, NULL);
+            slot->length_mem[k] = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, state_size * capacity, NULL, NULL);
+            slot->step_mem[k] = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, state_size * capacity, NULL, NULL);
+            slot->ray_id_mem[k] = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, sizeof(cl_int) * capacity, NULL, NULL);
         }
+        slot->count_mem = clCreateBuffer(unit->context, CL_MEM_READ_WRITE, sizeof(cl_int) * 2, NULL, NULL);
+        slot->cur = 0;
 
-        if (output)
+        slot->stride = params->soa ? capacity : 0;
+        slot->pos = malloc(sizeof(real) * capacity * DIM);
+        slot->dir = malloc(sizeof(real) * capacity * DIM);
+        slot->finished = malloc(sizeof(cl_int) * capacity);
+        slot->length = malloc(sizeof(real) * capacity);
+        slot->step = malloc(sizeof(real) * capacity);
+        slot->ray_id = malloc(sizeof(cl_int) * capacity);
+
+        slot->dev_pos = float_state ? malloc(sizeof(cl_float) * capacity * DIM) : NULL;
+        slot->dev_dir = float_state ? malloc(sizeof(cl_float) * capacity * DIM) : NULL;
+        slot->dev_length = float_state ? malloc(sizeof(cl_float) * capacity) : NULL;
+        slot->dev_step = float_state ? malloc(sizeof(cl_float) * capacity) : NULL;
+        slot->num_conversions = 0;
+
+        slot->num_events = 0;
+        slot->num_objects = 0;
+        slot->active = false;
+    }
+
+    unit->profiling = params->profiling;
+    unit->telemetry = NULL;
+    unit->worker = 0;
+    unit->kernel_time = 0;
+    unit->upload_time = 0;
+    unit->readback_time = 0;
+    unit->busy_time = 0;
+    unit->first_start = 0;
+    unit->last_end = 0;
+}
+
+/**
+ * Upload new parameters of metric, tabulated cristofel symbol is rebuilt for them
+ */
+void update_calculation_args(struct calculation_unit_s *unit,
+                             const struct calculation_params_s *params)
+{
+    clReleaseMemObject(unit->args_mem);
+    unit->args_mem = create_args_buffer(unit, params, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY);
+
+    if (unit->cristofel_table != NULL)
+    {
+        clReleaseMemObject(unit->cristofel_table);
+        unit->cristofel_table = NULL;
+    }
+    init_cristofel_table(unit, params);
+}
+
+void release_calculation_unit(struct calculation_unit_s *unit)
+{
+    int s, k;
+    for (s = 0; s < NUM_SLOTS; s++)
+    {
+        struct calculation_slot_s *slot = &unit->slots[s];
+        for (k = 0; k < 2; k++)
         {
-            for (i = 0; i < num_objects; i++)
+            clReleaseMemObject(slot->pos_mem[k]);
+            clReleaseMemObject(slot->dir_mem[k]);
+            clReleaseMemObject(slot->finished_mem[k]);
+            clReleaseMemObject(slot->length_mem[k]);
+            clReleaseMemObject(slot->step_mem[k]);
+            clReleaseMemObject(slot->ray_id_mem[k]);
+        }
+        clReleaseMemObject(slot->count_mem);
+        clReleaseCommandQueue(slot->queue);
+        free(slot->pos);
+        free(slot->dir);
+        free(slot->finished);
+        free(slot->length);
+        free(slot->step);
+        free(slot->ray_id);
+        free(slot->dev_pos);
+        free(slot->dev_dir);
+        free(slot->dev_length);
+        free(slot->dev_step);
+    }
+    clReleaseMemObject(unit->args_mem);
+}
+
+void print_calculation_unit_stats(const struct calculation_unit_s *unit)
+{
+    char name[256] = "";
+    clGetDeviceInfo(unit->device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    if (!unit->profiling)
+    {
+        printf("Device %s: timeline is not measured, see --stats\n", name);
+        return;
+    }
+
+    double span = (unit->last_end - unit->first_start) * 1e-9;
+    double idle = span - unit->busy_time * 1e-9;
+    printf("Device %s: kernel %.3lf s, upload %.3lf s, readback %.3lf s, idle %.3lf s (%.1lf%%) of %.3lf s\n",
+           name, unit->kernel_time * 1e-9, unit->upload_time * 1e-9, unit->readback_time * 1e-9,
+           idle, span > 0 ? idle / span * 100 : 0.0, span);
+}
+
+/**
+ * Enqueue integration of one chunk of `num_steps`, compaction of rays
+ * and readback of results
+ * @param output read pos and dir of all rays for trajectories
+ */
+static void slot_enqueue_chunk(struct calculation_unit_s *unit,
+                               struct calculation_slot_s *slot,
+                               const struct calculation_params_s *params,
+                               bool output)
+{
+    cl_kernel kernel;
+    cl_int stride = slot->stride;
+    cl_int num = slot->num_objects;
+    int c = slot->cur;
+    int n = 1 - c;
+    cl_int scene_rays = params->scene_rays;
+    cl_int num_args = params->num_args;
+    bool single = unit->real_size == sizeof(cl_float);
+    bool single_state = unit->state_size == sizeof(cl_float);
+
+    if (params->adaptive)
+    {
+        kernel = unit->kernel_adaptive;
+        clSetKernelArg(kernel, 0, sizeof(cl_int), &params->num_steps);
+        clSetKernelArg(kernel, 1, sizeof(cl_int), &stride);
+        clSetKernelArg(kernel, 2, sizeof(cl_mem), &slot->pos_mem[c]);
+        clSetKernelArg(kernel, 3, sizeof(cl_mem), &slot->dir_mem[c]);
+        clSetKernelArg(kernel, 4, sizeof(cl_mem), &slot->finished_mem[c]);
+        clSetKernelArg(kernel, 5, sizeof(cl_mem), &slot->length_mem[c]);
+        clSetKernelArg(kernel, 6, sizeof(cl_mem), &slot->step_mem[c]);
+        set_real_arg(kernel, 7, single_state, params->T);
+        set_real_arg(kernel, 8, single, params->atol);
+        set_real_arg(kernel, 9, single, params->rtol);
+        clSetKernelArg(kernel, 10, sizeof(cl_mem), &unit->args_mem);
+        clSetKernelArg(kernel, 11, sizeof(cl_mem), &unit->cristofel_table);
+        clSetKernelArg(kernel, 12, sizeof(cl_mem), &slot->ray_id_mem[c]);
+        clSetKernelArg(kernel, 13, sizeof(cl_int), &scene_rays);
+        clSetKernelArg(kernel, 14, sizeof(cl_int), &num_args);
+    }
+    else
+    {
+        kernel = unit->kernel;
+        clSetKernelArg(kernel, 0, sizeof(cl_int), &params->num_steps);
+        clSetKernelArg(kernel, 1, sizeof(cl_int), &stride);
+        clSetKernelArg(kernel, 2, sizeof(cl_mem), &slot->pos_mem[c]);
+        clSetKernelArg(kernel, 3, sizeof(cl_mem), &slot->dir_mem[c]);
+        clSetKernelArg(kernel, 4, sizeof(cl_mem), &slot->finished_mem[c]);
+        clSetKernelArg(kernel, 5, sizeof(cl_mem), &slot->length_mem[c]);
+        set_real_arg(kernel, 6, single_state, params->h);
+        set_real_arg(kernel, 7, single_state, params->T);
+        clSetKernelArg(kernel, 8, sizeof(cl_mem), &unit->args_mem);
+        clSetKernelArg(kernel, 9, sizeof(cl_mem), &unit->cristofel_table);
+        clSetKernelArg(kernel, 10, sizeof(cl_mem), &slot->ray_id_mem[c]);
+        clSetKernelArg(kernel, 11, sizeof(cl_int), &scene_rays);
+        clSetKernelArg(kernel, 12, sizeof(cl_int), &num_args);
+    }
+    clEnqueueNDRangeKernel(slot->queue, kernel, 1, NULL, &slot->num_objects, NULL, 0, NULL, slot_event(slot, EVENT_KERNEL));
+
+    /* live rays to the beginning of other buffers */
+    static const cl_int zero = 0;
+    clEnqueueFillBuffer(slot->queue, slot->count_mem, &zero, sizeof(zero), 0, sizeof(cl_int) * 2, 0, NULL, slot_event(slot, EVENT_UPLOAD));
+
+    kernel = unit->kernel_compact;
+    clSetKernelArg(kernel, 0, sizeof(cl_int), &num);
+    clSetKernelArg(kernel, 1, sizeof(cl_int), &stride);
+    set_real_arg(kernel, 2, single_state, params->T);
+    clSetKernelArg(kernel, 3, sizeof(cl_mem), &slot->pos_mem[c]);
+    clSetKernelArg(kernel, 4, sizeof(cl_mem), &slot->dir_mem[c]);
+    clSetKernelArg(kernel, 5, sizeof(cl_mem), &slot->finished_mem[c]);
+    clSetKernelArg(kernel, 6, sizeof(cl_mem), &slot->length_mem[c]);
+    clSetKernelArg(kernel, 7, sizeof(cl_mem), &slot->step_mem[c]);
+    clSetKernelArg(kernel, 8, sizeof(cl_mem), &slot->ray_id_mem[c]);
+    clSetKernelArg(kernel, 9, sizeof(cl_mem), &slot->pos_mem[n]);
+    clSetKernelArg(kernel, 10, sizeof(cl_mem), &slot->dir_mem[n]);
+    clSetKernelArg(kernel, 11, sizeof(cl_mem), &slot->finished_mem[n]);
+    clSetKernelArg(kernel, 12, sizeof(cl_mem), &slot->length_mem[n]);
+    clSetKernelArg(kernel, 13, sizeof(cl_mem), &slot->step_mem[n]);
+    clSetKernelArg(kernel, 14, sizeof(cl_mem), &slot->ray_id_mem[n]);
+    clSetKernelArg(kernel, 15, sizeof(cl_mem), &slot->count_mem);
+    clEnqueueNDRangeKernel(slot->queue, kernel, 1, NULL, &slot->num_objects, NULL, 0, NULL, slot_event(slot, EVENT_KERNEL));
+    slot->cur = n;
+
+    clEnqueueReadBuffer(slot->queue, slot->count_mem, CL_FALSE, 0, sizeof(cl_int) * 2, slot->count, 0, NULL, slot_event(slot, EVENT_READBACK));
+    enqueue_array(slot, slot->finished_mem[n], slot->finished, sizeof(cl_int), 0, slot->num_objects, false);
+    enqueue_state(slot, slot->length_mem[n], slot->length, slot->dev_length, 0, slot->num_objects, false);
+    enqueue_array(slot, slot->ray_id_mem[n], slot->ray_id, sizeof(cl_int), 0, slot->num_objects, false);
+    if (output)
+    {
+        enqueue_rays(slot, slot->pos_mem[n], slot->pos, slot->dev_pos, 0, slot->num_objects, false);
+        enqueue_rays(slot, slot->dir_mem[n], slot->dir, slot->dev_dir, 0, slot->num_objects, false);
+    }
+    clFlush(slot->queue);
+}
+
+/**
+ * Write current point of rays [first, first + num) of slot to their trajectories
+ */
+static void slot_write_output(struct calculation_slot_s *slot, struct dispatcher_s *dispatcher,
+                              size_t first, size_t num)
+{
+    trajectory_write_rays(dispatcher->output, slot->ray_id + first, 0, num,
+                          &slot->pos[RAY_INDEX(first, 0, slot->stride)], &slot->dir[RAY_INDEX(first, 0, slot->stride)],
+                          slot->stride, slot->finished + first, slot->length + first, 0);
+}
+
+/**
+ * Fill free space of slot with new rays from dispatcher
+ */
+static void slot_refill(struct calculation_slot_s *slot,
+                        const struct calculation_params_s *params,
+                        struct dispatcher_s *dispatcher,
+                        int worker,
+                        size_t capacity)
+{
+    size_t i;
+    size_t live = slot->num_objects;
+    size_t num = dispatcher_fetch(dispatcher, worker, slot->ray_id + live,
+                                  &slot->pos[RAY_INDEX(live, 0, slot->stride)],
+                                  &slot->dir[RAY_INDEX(live, 0, slot->stride)],
+                                  slot->stride, slot->finished + live,
+                                  slot->length + live, slot->step + live, capacity - live);
+    if (num == 0)
+        return;
+
+    /* rays returned by other workers keep their step and are already in trajectories,
+     * rays resumed from checkpoint before their first save have no step yet */
+    bool fresh = slot->step[live] == 0;
+    for (i = live; i < live + num; i++)
+    {
+        if (slot->step[i] == 0)
+            slot->step[i] = params->h;
+    }
+    if (fresh && dispatcher->output != NULL)
+        slot_write_output(slot, dispatcher, live, num);
+
+    int c = slot->cur;
+    enqueue_rays(slot, slot->pos_mem[c], slot->pos, slot->dev_pos, live, num, true);
+    enqueue_rays(slot, slot->dir_mem[c], slot->dir, slot->dev_dir, live, num, true);
+    enqueue_array(slot, slot->finished_mem[c], slot->finished, sizeof(cl_int), live, num, true);
+    enqueue_state(slot, slot->length_mem[c], slot->length, slot->dev_length, live, num, true);
+    enqueue_state(slot, slot->step_mem[c], slot->step, slot->dev_step, live, num, true);
+    enqueue_array(slot, slot->ray_id_mem[c], slot->ray_id, sizeof(cl_int), live, num, true);
+
+    slot->num_objects += num;
+}
+
+/**
+ * Give half of live rays of slot to idle workers
+ */
+static void slot_share(struct calculation_unit_s *unit,
+                       struct calculation_slot_s *slot,
+                       struct dispatcher_s *dispatcher)
+{
+    size_t live = slot->num_objects;
+    size_t num = live / 2;
+    size_t first = live - num;
+    int c = slot->cur;
+
+    enqueue_rays(slot, slot->pos_mem[c], slot->pos, slot->dev_pos, first, num, false);
+    enqueue_rays(slot, slot->dir_mem[c], slot->dir, slot->dev_dir, first, num, false);
+    enqueue_state(slot, slot->step_mem[c], slot->step, slot->dev_step, first, num, false);
+    slot_wait(unit, slot);
+
+    dispatcher_return(dispatcher, slot->ray_id + first, num,
+                      &slot->pos[RAY_INDEX(first, 0, slot->stride)],
+                      &slot->dir[RAY_INDEX(first, 0, slot->stride)],
+                      slot->stride, slot->finished + first,
+                      slot->length + first, slot->step + first);
+    slot->num_objects = first;
+}
+
+/**
+ * Save state of live rays of slot for checkpoint
+ */
+static void slot_save(struct calculation_unit_s *unit,
+                      struct calculation_slot_s *slot,
+                      struct dispatcher_s *dispatcher)
+{
+    size_t live = slot->num_objects;
+    int c = slot->cur;
+
+    /* pos and dir of all rays are already read for trajectories */
+    if (dispatcher->output == NULL)
+    {
+        enqueue_rays(slot, slot->pos_mem[c], slot->pos, slot->dev_pos, 0, live, false);
+        enqueue_rays(slot, slot->dir_mem[c], slot->dir, slot->dev_dir, 0, live, false);
+    }
+    enqueue_state(slot, slot->step_mem[c], slot->step, slot->dev_step, 0, live, false);
+    slot_wait(unit, slot);
+
+    dispatcher_save(dispatcher, slot->ray_id, live, slot->pos, slot->dir, slot->stride,
+                    slot->finished, slot->length, slot->step);
+}
+
+/**
+ * Handle results of finished chunk: write output, return retired rays to
+ * dispatcher, share rays with idle workers and refill slot
+ * @return are there rays on device
+ */
+static bool slot_process(struct calculation_unit_s *unit,
+                         struct calculation_slot_s *slot,
+                         const struct calculation_params_s *params,
+                         struct dispatcher_s *dispatcher,
+                         int worker)
+{
+    size_t i;
+    size_t live = slot->count[0];
+    size_t retired = slot->num_objects - live;
+
+    dispatcher_report(dispatcher, worker, (double)slot->num_objects * params->num_steps);
+    telemetry_chunk(dispatcher->telemetry, worker, live, retired, (double)slot->num_objects * params->num_steps);
+
+    double output_start = telemetry_now(dispatcher->telemetry);
+    if (dispatcher->output != NULL)
+    {
+        slot_write_output(slot, dispatcher, 0, slot->num_objects);
+    }
+    else if (retired > 0)
+    {
+        enqueue_rays(slot, slot->pos_mem[slot->cur], slot->pos, slot->dev_pos, live, retired, false);
+        enqueue_rays(slot, slot->dir_mem[slot->cur], slot->dir, slot->dev_dir, live, retired, false);
+        slot_wait(unit, slot);
+        /* readback is part of device timeline */
+        output_start = telemetry_now(dispatcher->telemetry);
+    }
+
+    dispatcher_store(dispatcher, slot->ray_id + live, 0, retired,
+                     &slot->pos[RAY_INDEX(live, 0, slot->stride)],
+                     &slot->dir[RAY_INDEX(live, 0, slot->stride)],
+                     slot->stride, slot->finished + live, slot->length + live);
+    slot->num_objects = live;
+    telemetry_span(dispatcher->telemetry, worker, TELEMETRY_OUTPUT, output_start, telemetry_now(dispatcher->telemetry));
+
+    if (live >= 2 * dispatcher->min_per_block && dispatcher_wants_rays(dispatcher))
+    {
+        slot_share(unit, slot, dispatcher);
+        live = slot->num_objects;
+    }
+
+    if (live > 0 && checkpoint_due(dispatcher->checkpoint, &slot->saved))
+        slot_save(unit, slot, dispatcher);
+
+    /* integration position is the least integrated length of live geodesics */
+    if (dispatcher_progress_due(dispatcher))
+    {
+        real t = params->T;
+        for (i = 0; i < live; i++)
+        {
+            if (slot->length[i] < t)
+                t = slot->length[i];
+        }
+        printf("Worker %i: %lf / %lf, %i live rays\n", worker, t, params->T, (int)live);
+    }
+
+    /* refill when enough space is freed, so transfers stay large */
+    size_t capacity = unit->max_parallel_points;
+    if (live == 0 || capacity - live >= capacity / 4)
+        slot_refill(slot, params, dispatcher, worker, capacity);
+
+    return slot->num_objects > 0;
+}
+
+/**
+ * Integrate rays from dispatcher until it is empty. Each of NUM_SLOTS
+ * slots of unit is processed in turn: while host handles results of one
+ * slot, device computes another. When unit has nothing to do, it waits
+ * for rays given back by slower units
+ */
+void perform_calculation(struct calculation_unit_s *unit,
+                         const struct calculation_params_s *params,
+                         struct dispatcher_s *dispatcher,
+                         int worker)
+{
+    int s;
+
+    unit->telemetry = dispatcher->telemetry;
+    unit->worker = worker;
+
+    /* host buffers were only allocated, place them on node of this thread */
+    if (unit->numa_node >= 0)
+    {
+        size_t capacity = unit->max_parallel_points;
+        for (s = 0; s < NUM_SLOTS; s++)
+        {
+            struct calculation_slot_s *slot = &unit->slots[s];
+            numa_first_touch(slot->pos, sizeof(real) * capacity * DIM);
+            numa_first_touch(slot->dir, sizeof(real) * capacity * DIM);
+            numa_first_touch(slot->finished, sizeof(cl_int) * capacity);
+            numa_first_touch(slot->length, sizeof(real) * capacity);
+            numa_first_touch(slot->step, sizeof(real) * capacity);
+            numa_first_touch(slot->ray_id, sizeof(cl_int) * capacity);
+            if (slot->dev_pos != NULL)
             {
-                if (finished[i])
-                    fprintf(output[i], "true");
-                else
-                    fprintf(output[i], "false");
-                fprintf(output[i], ", %0.12lf", t);
-                int j;
-                for (j = 0; j < DIM; j++)
-                    fprintf(output[i], ", %0.12lf", (double)pos[DIM * i + j]);
-                for (j = 0; j < DIM; j++)
-                    fprintf(output[i], ", %0.12lf", (double)dir[DIM * i + j]);
-                fprintf(output[i], "\n");
-                fflush(output[i]);
+                numa_first_touch(slot->dev_pos, sizeof(cl_float) * capacity * DIM);
+                numa_first_touch(slot->dev_dir, sizeof(cl_float) * capacity * DIM);
+                numa_first_touch(slot->dev_length, sizeof(cl_float) * capacity);
+                numa_first_touch(slot->dev_step, sizeof(cl_float) * capacity);
             }
         }
+    }
 
-        printf("%lf / %lf\n", t, T);
+    for (s = 0; s < NUM_SLOTS; s++)
+        clock_gettime(CLOCK_MONOTONIC, &unit->slots[s].saved);
 
-        if (all_collided)
+    do
+    {
+        bool any = true;
+        for (s = 0; s < NUM_SLOTS; s++)
         {
-            printf("All rays collided\n");
-            break;
+            struct calculation_slot_s *slot = &unit->slots[s];
+            slot->num_objects = 0;
+            slot_refill(slot, params, dispatcher, worker, unit->max_parallel_points);
+            slot->active = slot->num_objects > 0;
+            if (slot->active)
+                slot_enqueue_chunk(unit, slot, params, dispatcher->output != NULL);
         }
-    }
 
-    err = clEnqueueReadBuffer(unit->queue, pos_mem, CL_TRUE, 0, sizeof(real) * num_objects * DIM, pos, 0, NULL, NULL);
-    err = clEnqueueReadBuffer(unit->queue, dir_mem, CL_TRUE, 0, sizeof(real) * num_objects * DIM, dir, 0, NULL, NULL);
-    err = clEnqueueReadBuffer(unit->queue, finished_mem, CL_TRUE, 0, sizeof(cl_int) * num_objects, finished, 0, NULL, NULL);
-    clFinish(unit->queue);
+        while (any)
+        {
+            any = false;
+            for (s = 0; s < NUM_SLOTS; s++)
+            {
+                struct calculation_slot_s *slot = &unit->slots[s];
+                if (!slot->active)
+                    continue;
 
-    clReleaseMemObject(pos_mem);
-    clReleaseMemObject(dir_mem);
-    clReleaseMemObject(finished_mem);
-    clReleaseMemObject(args_mem);
+                any = true;
+                slot_wait(unit, slot);
+                slot->active = slot_process(unit, slot, params, dispatcher, worker);
+                if (slot->active)
+                    slot_enqueue_chunk(unit, slot, params, dispatcher->output != NULL);
+            }
+        }
+    }
+    while (dispatcher_wait_for_rays(dispatcher, worker));
 }
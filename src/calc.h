@@ -1,15 +1,77 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <opencl.h>
+#include <dispatcher.h>
+
+struct cristofel_table_params_s {
+    int nr;             // nodes along pos1 (r), 0 disables table
+    real r_min;
+    real r_max;
+    int ntheta;         // nodes along pos2 (theta), 1 for equatorial plane only
+    real theta_min;
+    real theta_max;
+};
+
+struct calculation_params_s {
+    real T;             // integration length
+    real h;             // iteration step, initial step for adaptive mode
+    cl_int num_steps;   // steps between reading results back
+
+    bool soa;           // structure of arrays layout of pos and dir
+
+    const char *integrator;     // integrator of fixed step mode, NULL for rk4, see integrator_build_option
+    const char *precision;      // precision of OpenCL program, NULL for double, see precision_build_option
+
+    bool adaptive;      // use embedded Runge-Kutta with per-ray step
+    real atol;          // absolute tolerance of adaptive step
+    real rtol;          // relative tolerance of adaptive step
+
+    struct cristofel_table_params_s table;
+
+    bool profiling;     // measure timeline of devices
+
+    real *args;         // num_args parameters of metric for each scene, one scene after another
+    size_t num_args;
+    size_t num_scenes;  // sets of parameters, 0 is the same as 1
+    size_t scene_rays;  // ray i is traced in scene i / scene_rays, 0 for one scene
+};
+
+/**
+ * Rays emitted by observer instead of reading input, see kernel_emit
+ */
+struct emitter_params_s {
+    real t;             // schwarzschild time of observer
+    real r;             // schwarzschild radius of observer
+    real fov;           // field of view, rays have angles from 0 to fov / 2
+    size_t num;         // number of rays
+    const real *angles; // angle of each ray instead of uniform ones, NULL if not used
+};
+
+real emitter_angle(const struct emitter_params_s *emitter, size_t i);
+
+size_t scene_args_size(const struct calculation_params_s *params);
+
+int emit_rays(struct calculation_unit_s *unit,
+              const struct calculation_params_s *params,
+              const struct emitter_params_s *emitter,
+              real *pos, real *dir, cl_int *finished);
+
+const char *integrator_build_option(const char *name);
+const char *precision_build_option(const char *name);
+
+void init_cristofel_table(struct calculation_unit_s *unit,
+                          const struct calculation_params_s *params);
+
+void init_calculation_unit(struct calculation_unit_s *unit,
+                           const struct calculation_params_s *params);
+void update_calculation_args(struct calculation_unit_s *unit,
+                             const struct calculation_params_s *params);
+void release_calculation_unit(struct calculation_unit_s *unit);
+void print_calculation_unit_stats(const struct calculation_unit_s *unit);
 
 void perform_calculation(struct calculation_unit_s *unit,
-                         real T, real h,
-                         real *pos,
-                         real *dir,
-                         cl_int *finished,
-                         size_t num_objects,
-                         real *args,
-                         size_t num_args,
-                         FILE **output,
-                         cl_int num_steps);
+                         const struct calculation_params_s *params,
+                         struct dispatcher_s *dispatcher,
+                         int worker);
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <calc.h>
+#include <checkpoint.h>
+
+static const char *name_or_default(const char *name, const char *fallback)
+{
+    return name != NULL ? name : fallback;
+}
+
+static const char *metric_name(const char *metric_fname)
+{
+    const char *slash = strrchr(metric_fname, '/');
+    return slash != NULL ? slash + 1 : metric_fname;
+}
+
+static double seconds_between(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+/**
+ * Prepare checkpoints of calculation
+ * @param fname checkpoint file, written every interval
+ * @param params, metric_fname parameters of run, stored in checkpoint
+ * @param num_rays number of rays, state of all of them is stored
+ */
+int checkpoint_init(struct checkpoint_s *checkpoint, const char *fname, double interval,
+                    const struct calculation_params_s *params, const char *metric_fname, size_t num_rays)
+{
+    checkpoint->fname = fname;
+    checkpoint->interval = interval;
+    checkpoint->params = params;
+    checkpoint->metric_fname = metric_fname;
+    checkpoint->num_rays = num_rays;
+    checkpoint->cursor = 0;
+    checkpoint->length = calloc(num_rays + 1, sizeof(real));
+    checkpoint->step = calloc(num_rays + 1, sizeof(real));
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint->last);
+    if (checkpoint->length == NULL || checkpoint->step == NULL)
+    {
+        printf("Can not allocate checkpoint of %zu rays\n", num_rays);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @return first parameter of run which differs from checkpoint, NULL if they match
+ */
+static const char *checkpoint_mismatch(const struct checkpoint_header_s *header,
+                                       const struct calculation_params_s *params,
+                                       const char *metric_fname, bool extend)
+{
+    if (strncmp(header->metric, metric_name(metric_fname), sizeof(header->metric)))
+        return "metric";
+    if (header->adaptive != params->adaptive)
+        return "step mode";
+    if (!params->adaptive && header->h != params->h)
+        return "h";
+    if (params->adaptive && (header->atol != params->atol || header->rtol != params->rtol))
+        return "tolerance";
+    if (strncmp(header->integrator, name_or_default(params->integrator, "rk4"), sizeof(header->integrator)))
+        return "integrator";
+    if (strncmp(header->precision, name_or_default(params->precision, "double"), sizeof(header->precision)))
+        return "precision";
+    if (header->num_args != scene_args_size(params))
+        return "arguments";
+    /* finished run can be extended to larger T only */
+    if (extend ? params->T < header->T : params->T != header->T)
+        return "T";
+    return NULL;
+}
+
+static bool read_rays(FILE *f, real *v, size_t stride, size_t num)
+{
+    size_t i;
+    int j;
+    for (i = 0; i < num; i++)
+    {
+        real x[DIM];
+        if (fread(x, sizeof(real), DIM, f) != DIM)
+            return false;
+        for (j = 0; j < DIM; j++)
+            v[RAY_INDEX(i, j, stride)] = x[j];
+    }
+    return true;
+}
+
+static void write_rays(FILE *f, const real *v, size_t stride, size_t num)
+{
+    size_t i;
+    int j;
+    for (i = 0; i < num; i++)
+    {
+        real x[DIM];
+        for (j = 0; j < DIM; j++)
+            x[j] = v[RAY_INDEX(i, j, stride)];
+        fwrite(x, sizeof(real), DIM, f);
+    }
+}
+
+/**
+ * Load rays and their state from checkpoint file. Parameters of run must
+ * be the same as in checkpoint
+ * @param rays allocated and filled with rays in layout of soa
+ * @param extend T of run can be larger than T of checkpoint
+ */
+int checkpoint_load(struct checkpoint_s *checkpoint, struct input_rays_s *rays, bool soa, bool extend)
+{
+    struct checkpoint_header_s header;
+    const struct calculation_params_s *params = checkpoint->params;
+    size_t i;
+
+    FILE *f = fopen(checkpoint->fname, "rb");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", checkpoint->fname);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) ||
+        header.version != CHECKPOINT_VERSION || header.dim != DIM || header.real_size != sizeof(real) ||
+        header.cursor > header.num_rays)
+    {
+        printf("Invalid checkpoint [%s]\n", checkpoint->fname);
+        fclose(f);
+        return -1;
+    }
+
+    const char *mismatch = checkpoint_mismatch(&header, params, checkpoint->metric_fname, extend);
+    for (i = 0; mismatch == NULL && i < header.num_args; i++)
+    {
+        real arg;
+        if (fread(&arg, sizeof(real), 1, f) != 1 || arg != params->args[i])
+            mismatch = "arguments";
+    }
+    if (mismatch != NULL)
+    {
+        printf("Checkpoint [%s] was made with different %s\n", checkpoint->fname, mismatch);
+        fclose(f);
+        return -1;
+    }
+
+    size_t num = header.num_rays;
+    size_t stride = soa ? num : 0;
+    free(checkpoint->length);
+    free(checkpoint->step);
+    if (checkpoint_init(checkpoint, checkpoint->fname, checkpoint->interval, params,
+                        checkpoint->metric_fname, num) != 0 || alloc_rays(rays, num) != 0)
+    {
+        fclose(f);
+        return -1;
+    }
+
+    bool ok = read_rays(f, rays->pos, stride, num) && read_rays(f, rays->dir, stride, num) &&
+              fread(rays->finished, sizeof(cl_int), num, f) == num &&
+              fread(checkpoint->length, sizeof(real), num, f) == num &&
+              fread(checkpoint->step, sizeof(real), num, f) == num;
+    fclose(f);
+    if (!ok)
+    {
+        printf("Checkpoint [%s] is truncated\n", checkpoint->fname);
+        release_rays(rays);
+        return -1;
+    }
+
+    checkpoint->cursor = header.cursor;
+    return 0;
+}
+
+/**
+ * Is it time for next checkpoint
+ * @param last time of previous one, set to current time if checkpoint is due
+ * @return false if calculation is not checkpointed
+ */
+bool checkpoint_due(const struct checkpoint_s *checkpoint, struct timespec *last)
+{
+    struct timespec now;
+    if (checkpoint == NULL)
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (seconds_between(last, &now) < checkpoint->interval)
+        return false;
+    *last = now;
+    return true;
+}
+
+/**
+ * Write checkpoint to temporary file and rename it over previous one
+ * @param pos, dir, finished state of all rays, pos and dir in layout of stride
+ * @param cursor number of rays taken by dispatcher
+ */
+int checkpoint_write(struct checkpoint_s *checkpoint, const real *pos, const real *dir, size_t stride,
+                     const cl_int *finished, size_t cursor)
+{
+    const struct calculation_params_s *params = checkpoint->params;
+    struct checkpoint_header_s header;
+    char tmp_fname[4096];
+
+    snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", checkpoint->fname);
+    FILE *f = fopen(tmp_fname, "wb");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", tmp_fname);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.dim = DIM;
+    header.real_size = sizeof(real);
+    header.num_args = scene_args_size(params);
+    header.num_rays = checkpoint->num_rays;
+    header.cursor = cursor;
+    header.T = params->T;
+    header.h = params->h;
+    header.atol = params->atol;
+    header.rtol = params->rtol;
+    header.adaptive = params->adaptive;
+    header.num_steps = params->num_steps;
+    strncpy(header.integrator, name_or_default(params->integrator, "rk4"), sizeof(header.integrator) - 1);
+    strncpy(header.precision, name_or_default(params->precision, "double"), sizeof(header.precision) - 1);
+    strncpy(header.metric, metric_name(checkpoint->metric_fname), sizeof(header.metric) - 1);
+
+    size_t num = checkpoint->num_rays;
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(params->args, sizeof(real), header.num_args, f);
+    write_rays(f, pos, stride, num);
+    write_rays(f, dir, stride, num);
+    fwrite(finished, sizeof(cl_int), num, f);
+    fwrite(checkpoint->length, sizeof(real), num, f);
+    fwrite(checkpoint->step, sizeof(real), num, f);
+
+    /* previous checkpoint is replaced only by complete file */
+    bool ok = fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0;
+    ok &= fclose(f) == 0;
+    if (!ok || rename(tmp_fname, checkpoint->fname) != 0)
+    {
+        printf("Can not write file [%s]\n", checkpoint->fname);
+        remove(tmp_fname);
+        return -1;
+    }
+    return 0;
+}
+
+void checkpoint_release(struct checkpoint_s *checkpoint)
+{
+    free(checkpoint->length);
+    free(checkpoint->step);
+}
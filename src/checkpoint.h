@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <config.h>
+#include <input.h>
+
+struct calculation_params_s;
+
+/*
+ * Binary checkpoint of calculation. It is written to <file>.tmp and renamed,
+ * so file is always complete. Layout:
+ *
+ *   struct checkpoint_header_s
+ *   real * num_args                metric arguments of all scenes
+ *   real * num_rays * DIM          pos, AoS layout
+ *   real * num_rays * DIM          dir, AoS layout
+ *   cl_int * num_rays              finished
+ *   real * num_rays                integrated length
+ *   real * num_rays                current step, 0 if ray was not started
+ *
+ * Rays [0, cursor) were taken by dispatcher. Each has the last state saved
+ * by its worker, so rays which are running and have not reached T continue
+ * from it when calculation is resumed.
+ */
+
+#define CHECKPOINT_MAGIC "GEOCKPT"
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header_s {
+    char magic[8];
+    cl_uint version;
+    cl_uint dim;
+    cl_uint real_size;
+    cl_uint num_args;
+    cl_ulong num_rays;
+    cl_ulong cursor;
+    real T;
+    real h;
+    real atol;
+    real rtol;
+    cl_int adaptive;
+    cl_int num_steps;
+    char integrator[8];
+    char precision[8];
+    char metric[256];           // name of metric file without directory
+};
+
+/**
+ * State of rays which is not kept by dispatcher and parameters of run
+ */
+struct checkpoint_s {
+    const char *fname;
+    double interval;            // s between checkpoints
+    struct timespec last;       // time of last checkpoint
+    real *length;               // integrated length of each ray
+    real *step;                 // current step of each ray, 0 until it is started
+    size_t num_rays;
+    size_t cursor;              // rays taken by dispatcher in loaded checkpoint
+    const struct calculation_params_s *params;
+    const char *metric_fname;
+};
+
+int checkpoint_init(struct checkpoint_s *checkpoint, const char *fname, double interval,
+                    const struct calculation_params_s *params, const char *metric_fname, size_t num_rays);
+int checkpoint_load(struct checkpoint_s *checkpoint, struct input_rays_s *rays, bool soa, bool extend);
+bool checkpoint_due(const struct checkpoint_s *checkpoint, struct timespec *last);
+int checkpoint_write(struct checkpoint_s *checkpoint, const real *pos, const real *dir, size_t stride,
+                     const cl_int *finished, size_t cursor);
+void checkpoint_release(struct checkpoint_s *checkpoint);
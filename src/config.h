@@ -11,3 +11,18 @@
 #define MAX_DEVICES 20
 
 typedef cl_double real;
+
+/*
+ * Status of ray in finished arrays, same as in space.cl
+ */
+#define RAY_RUNNING 0       // integration goes on
+#define RAY_STOPPED 1       // left allowed area, step failed or ray is invalid
+#define RAY_ESCAPED 2       // final direction is known, see stop_condition
+#define RAY_CAPTURED 3      // ray falls into black hole, see stop_condition
+
+/*
+ * Index of j-th component of i-th ray in host arrays of pos and dir.
+ * stride is 0 for array of structures layout (pos0, pos1, ... of each ray together)
+ * and distance between components for structure of arrays layout (all pos0, then all pos1, ...)
+ */
+#define RAY_INDEX(i, j, stride) ((stride) ? (size_t)(j) * (stride) + (i) : (size_t)(i) * DIM + (j))
@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <config.h>
+#include <context.h>
+#include <numa_affinity.h>
+
+static char *load_source(const char *fname)
+{
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *source = malloc(fsize + 1);
+    fread(source, 1, fsize, f);
+    fclose(f);
+    source[fsize] = 0;
+
+    return source;
+}
+
+static void worker_function(struct opencl_state_s *opencl_state,
+                            struct dispatcher_s *dispatcher,
+                            int platform_id,
+                            int device_id,
+                            const struct calculation_params_s *params,
+                            int index)
+{
+    struct calculation_unit_s *unit = &opencl_state->units[platform_id][device_id];
+    if (unit->numa_node >= 0 && !numa_bind_thread(unit->numa_node))
+        printf("Can not bind worker %i to NUMA node %i\n", index, unit->numa_node);
+
+    perform_calculation(&opencl_state->units[platform_id][device_id],
+                        params, dispatcher, index);
+}
+
+/**
+ * Thread of cpu backend takes blocks of min_per_block rays of dispatcher,
+ * rounded up to whole batches
+ */
+static unsigned long cpu_worker_function(const struct cpu_backend_s *cpu,
+                                         struct dispatcher_s *dispatcher,
+                                         const struct calculation_params_s *params,
+                                         int index)
+{
+    unsigned long steps = 0;
+    size_t block = (dispatcher->min_per_block + CPU_BATCH - 1) / CPU_BATCH * CPU_BATCH;
+    if (block == 0)
+        block = CPU_BATCH;
+    real *bpos = malloc(sizeof(real) * block * DIM);
+    real *bdir = malloc(sizeof(real) * block * DIM);
+    real *blength = malloc(sizeof(real) * block);
+    real *bstep = malloc(sizeof(real) * block);
+    cl_int *bfinished = malloc(sizeof(cl_int) * block);
+    cl_int *bray_id = malloc(sizeof(cl_int) * block);
+    while (dispatcher_has_data(dispatcher))
+    {
+        size_t num_objects_in_block = dispatcher_fetch(dispatcher, index, bray_id, bpos, bdir, 0, bfinished,
+                                                       blength, bstep, block);
+        if (num_objects_in_block == 0)
+        {
+            break;
+        }
+
+        double start = telemetry_now(dispatcher->telemetry);
+        unsigned long block_steps = cpu_perform_calculation(cpu, params, bpos, bdir, 0, bfinished, blength, bstep,
+                                                            num_objects_in_block, bray_id, dispatcher->output);
+        double end = telemetry_now(dispatcher->telemetry);
+        telemetry_span(dispatcher->telemetry, index, TELEMETRY_KERNEL, start, end);
+        dispatcher_report(dispatcher, index, block_steps);
+        telemetry_chunk(dispatcher->telemetry, index, 0, num_objects_in_block, block_steps);
+        dispatcher_store(dispatcher, bray_id, 0, num_objects_in_block, bpos, bdir, 0, bfinished, blength);
+        telemetry_span(dispatcher->telemetry, index, TELEMETRY_OUTPUT, end, telemetry_now(dispatcher->telemetry));
+        steps += block_steps;
+    }
+    dispatcher_worker_done(dispatcher, index);
+    free(bpos);
+    free(bdir);
+    free(blength);
+    free(bstep);
+    free(bfinished);
+    free(bray_id);
+    return steps;
+}
+
+static void *worker_launcher(void *args)
+{
+    struct worker_s *worker = args;
+
+    if (worker->cpu != NULL)
+    {
+        if (worker->numa_node >= 0)
+            numa_bind_thread(worker->numa_node);
+        worker->steps = cpu_worker_function(worker->cpu,
+                                            worker->dispatcher,
+                                            worker->params,
+                                            worker->index);
+        return NULL;
+    }
+
+    worker_function(worker->opencl_state,
+                    worker->dispatcher,
+                    worker->platform_id,
+                    worker->device_id,
+                    worker->params,
+                    worker->index);
+    return NULL;
+}
+
+static int init_cpu(struct context_s *context, const char *metric_fname,
+                    int num_threads, int partition, const struct calculation_params_s *params)
+{
+    int i;
+
+    if (cpu_backend_load(&context->cpu, metric_fname, params->integrator))
+        return -1;
+
+    context->workers = calloc(num_threads, sizeof(struct worker_s));
+    context->threads = calloc(num_threads, sizeof(pthread_t));
+    for (i = 0; i < num_threads; i++)
+    {
+        struct worker_s *worker = &context->workers[context->num_workers];
+        worker->cpu = &context->cpu;
+        worker->index = context->num_workers;
+        worker->numa_node = partition == PARTITION_NUMA ? i % numa_num_nodes() : -1;
+        context->num_workers++;
+    }
+    return 0;
+}
+
+static int init_devices(struct context_s *context, const char *metric_fname, int partition,
+                        const char *build_options, const struct calculation_params_s *params)
+{
+    struct opencl_state_s *opencl_state = &context->opencl_state;
+    int i, j;
+
+    /* metric is placed between space description with special functions and integrator */
+    char *space = load_source(BINROOT "/space.cl");
+    char *special = load_source(BINROOT "/special.cl");
+    char *metric = load_source(metric_fname);
+    char *source = load_source(BINROOT "/geodesic.cl");
+    if (space == NULL || special == NULL || metric == NULL || source == NULL)
+    {
+        free(space);
+        free(special);
+        free(metric);
+        free(source);
+        return -1;
+    }
+
+    char *kernel_source = malloc(strlen(space) + strlen(special) + strlen(metric) + strlen(source) + 4);
+    strcpy(kernel_source, space);
+    strcat(kernel_source, "\n");
+    strcat(kernel_source, special);
+    strcat(kernel_source, "\n");
+    strcat(kernel_source, metric);
+    strcat(kernel_source, "\n");
+    strcat(kernel_source, source);
+
+    /* integrator and precision are chosen when program is built */
+    char options[1024];
+    snprintf(options, sizeof(options), "%s%s%s", build_options, integrator_build_option(params->integrator),
+             precision_build_option(params->precision));
+    bool single = params->precision != NULL && strcmp(params->precision, "double");
+    bool single_state = params->precision != NULL && !strcmp(params->precision, "float");
+
+    init_opencl(opencl_state, partition);
+    init_opencl_program(opencl_state, kernel_source, options);
+    free(space);
+    free(special);
+    free(metric);
+    free(source);
+    free(kernel_source);
+
+    for (i = 0; i < opencl_state->num_platforms; i++)
+    {
+        for (j = 0; j < opencl_state->num_devices[i]; j++)
+        {
+            opencl_state->units[i][j].real_size = single ? sizeof(cl_float) : sizeof(cl_double);
+            opencl_state->units[i][j].state_size = single_state ? sizeof(cl_float) : sizeof(cl_double);
+            init_cristofel_table(&opencl_state->units[i][j], params);
+            init_calculation_unit(&opencl_state->units[i][j], params);
+        }
+    }
+
+    context->platform_id = -1;
+    context->device_id = 0;
+    for (i = 0; i < opencl_state->num_platforms; i++)
+    {
+        if (opencl_state->num_devices[i] > 0)
+        {
+            context->platform_id = i;
+            context->device_id = 0;
+            break;
+        }
+    }
+
+    if (context->platform_id == -1)
+    {
+        printf("No platform\n");
+        return -1;
+    }
+
+    printf("Select platform %i, device %i\n", context->platform_id, context->device_id);
+
+    context->workers = calloc(MAX_DEVICES * MAX_PLATFORMS, sizeof(struct worker_s));
+    context->threads = calloc(MAX_DEVICES * MAX_PLATFORMS, sizeof(pthread_t));
+    for (i = 0; i < opencl_state->num_platforms; i++)
+    {
+        for (j = 0; j < opencl_state->num_devices[i]; j++)
+        {
+            struct worker_s *worker = &context->workers[context->num_workers];
+            worker->opencl_state = opencl_state;
+            worker->platform_id = i;
+            worker->device_id = j;
+            worker->index = context->num_workers;
+            context->num_workers++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Load native module of metric or build program for all OpenCL devices
+ * and prepare their buffers
+ * @param num_threads threads of cpu backend
+ * @param partition partition of OpenCL cpu devices, see init_opencl
+ * @param build_options options of OpenCL program
+ * @param params soa layout, integrator, table and args are used by devices
+ */
+int context_init(struct context_s *context, const char *metric_fname,
+                 bool use_cpu, int num_threads, int partition,
+                 const char *build_options, const struct calculation_params_s *params)
+{
+    memset(context, 0, sizeof(*context));
+    context->use_cpu = use_cpu;
+    if (integrator_build_option(params->integrator) == NULL)
+    {
+        printf("Unknown integrator [%s]\n", params->integrator);
+        return -1;
+    }
+    if (precision_build_option(params->precision) == NULL)
+    {
+        printf("Unknown precision [%s]\n", params->precision);
+        return -1;
+    }
+    printf("Fixed step integrator: %s\n", params->integrator != NULL ? params->integrator : "rk4");
+    printf("Precision: %s\n", params->precision != NULL ? params->precision : "double");
+    if (use_cpu)
+    {
+        /* native modules are compiled with host real */
+        if (params->precision != NULL && strcmp(params->precision, "double"))
+        {
+            printf("Precision [%s] is supported by OpenCL backend only\n", params->precision);
+            return -1;
+        }
+        return init_cpu(context, metric_fname, num_threads, partition, params);
+    }
+    return init_devices(context, metric_fname, partition, build_options, params);
+}
+
+/**
+ * Use new parameters of metric in following calculations
+ */
+void context_set_args(struct context_s *context, const struct calculation_params_s *params)
+{
+    int i;
+    if (context->use_cpu)
+        return;
+    for (i = 0; i < context->num_workers; i++)
+    {
+        struct worker_s *worker = &context->workers[i];
+        update_calculation_args(&context->opencl_state.units[worker->platform_id][worker->device_id], params);
+    }
+}
+
+/**
+ * Emit rays of observer, see emit_rays
+ * @return number of valid rays, -1 if metric can not emit rays
+ */
+int context_emit(struct context_s *context, const struct calculation_params_s *params,
+                 const struct emitter_params_s *emitter, real *pos, real *dir, cl_int *finished)
+{
+    if (context->use_cpu)
+        return cpu_emit_rays(&context->cpu, params, emitter, pos, dir, finished);
+    return emit_rays(&context->opencl_state.units[context->platform_id][context->device_id],
+                     params, emitter, pos, dir, finished);
+}
+
+/**
+ * Integrate all rays of dispatcher on all workers
+ */
+void context_calculate(struct context_s *context, const struct calculation_params_s *params,
+                       struct dispatcher_s *dispatcher)
+{
+    int i;
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    dispatcher_set_workers(dispatcher, context->num_workers);
+    for (i = 0; i < context->num_workers; i++)
+    {
+        struct worker_s *worker = &context->workers[i];
+        if (dispatcher->telemetry != NULL)
+        {
+            char name[128] = "";
+            if (context->use_cpu)
+                snprintf(name, sizeof(name), "cpu thread %i", i);
+            else
+                clGetDeviceInfo(context->opencl_state.units[worker->platform_id][worker->device_id].device,
+                                CL_DEVICE_NAME, sizeof(name), name, NULL);
+            telemetry_set_worker_name(dispatcher->telemetry, i, name);
+        }
+        worker->dispatcher = dispatcher;
+        worker->params = params;
+        worker->steps = 0;
+        pthread_create(&context->threads[i], NULL, worker_launcher, worker);
+    }
+
+    for (i = 0; i < context->num_workers; i++)
+        pthread_join(context->threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    context->elapsed = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+    if (context->use_cpu)
+        context->cpu_time += context->elapsed;
+}
+
+/**
+ * Print throughput of cpu backend or timeline of each device, devices
+ * accumulate it over all calculations
+ */
+void context_print_stats(const struct context_s *context)
+{
+    int i;
+    if (context->use_cpu)
+    {
+        unsigned long steps = 0;
+        for (i = 0; i < context->num_workers; i++)
+            steps += context->workers[i].steps;
+        printf("Native CPU backend: %lu ray steps in %.3lf s, %.3le steps/s/core on %i threads\n",
+               steps, context->elapsed, steps / context->elapsed / context->num_workers, (int)context->num_workers);
+        return;
+    }
+
+    for (i = 0; i < context->num_workers; i++)
+    {
+        const struct worker_s *worker = &context->workers[i];
+        print_calculation_unit_stats(&context->opencl_state.units[worker->platform_id][worker->device_id]);
+    }
+}
+
+/**
+ * Sum timelines of all devices. Cpu backend has no transfers, whole
+ * calculation is counted as kernel time
+ */
+void context_get_timeline(const struct context_s *context, struct context_timeline_s *timeline)
+{
+    int i;
+    memset(timeline, 0, sizeof(*timeline));
+    if (context->use_cpu)
+    {
+        timeline->kernel = context->cpu_time;
+        return;
+    }
+
+    for (i = 0; i < context->num_workers; i++)
+    {
+        const struct worker_s *worker = &context->workers[i];
+        const struct calculation_unit_s *unit = &context->opencl_state.units[worker->platform_id][worker->device_id];
+        timeline->kernel += unit->kernel_time * 1e-9;
+        timeline->upload += unit->upload_time * 1e-9;
+        timeline->readback += unit->readback_time * 1e-9;
+    }
+}
+
+/**
+ * Cores which integrate rays: threads of cpu backend or compute units of
+ * all devices
+ */
+int context_num_cores(const struct context_s *context)
+{
+    int i, cores = 0;
+    if (context->use_cpu)
+        return context->num_workers;
+
+    for (i = 0; i < context->num_workers; i++)
+    {
+        const struct worker_s *worker = &context->workers[i];
+        cl_uint compute_units = 1;
+        clGetDeviceInfo(context->opencl_state.units[worker->platform_id][worker->device_id].device,
+                        CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+        cores += compute_units;
+    }
+    return cores;
+}
+
+void context_release(struct context_s *context)
+{
+    int i;
+    if (context->use_cpu)
+    {
+        cpu_backend_release(&context->cpu);
+    }
+    else if (context->workers != NULL)
+    {
+        for (i = 0; i < context->num_workers; i++)
+        {
+            struct worker_s *worker = &context->workers[i];
+            release_calculation_unit(&context->opencl_state.units[worker->platform_id][worker->device_id]);
+        }
+        release_opencl(&context->opencl_state);
+    }
+    free(context->workers);
+    free(context->threads);
+    context->workers = NULL;
+    context->threads = NULL;
+}
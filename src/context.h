@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <config.h>
+#include <opencl.h>
+#include <calc.h>
+#include <cpu.h>
+#include <dispatcher.h>
+
+struct worker_s
+{
+    struct opencl_state_s *opencl_state;
+    const struct cpu_backend_s *cpu;
+    struct dispatcher_s *dispatcher;
+    int platform_id;
+    int device_id;
+    const struct calculation_params_s *params;
+    int index;                  // index of worker in dispatcher
+    int numa_node;              // node of cpu backend thread, -1 if not bound
+    unsigned long steps;
+};
+
+/**
+ * Backend with built program, device buffers or loaded native module and
+ * its workers. It is kept between calculations, so repeated calculations
+ * with the same metric pay for setup once.
+ */
+struct context_s {
+    bool use_cpu;
+    struct cpu_backend_s cpu;
+    struct opencl_state_s opencl_state;
+    int platform_id;            // device which emits rays
+    int device_id;
+
+    struct worker_s *workers;
+    pthread_t *threads;
+    size_t num_workers;
+
+    double elapsed;             // time of last calculation
+    double cpu_time;            // time of all calculations on cpu backend
+};
+
+/**
+ * Time spent by backend in all calculations so far, s
+ */
+struct context_timeline_s {
+    double kernel;
+    double upload;
+    double readback;
+};
+
+int context_init(struct context_s *context, const char *metric_fname,
+                 bool use_cpu, int num_threads, int partition,
+                 const char *build_options, const struct calculation_params_s *params);
+void context_set_args(struct context_s *context, const struct calculation_params_s *params);
+int context_emit(struct context_s *context, const struct calculation_params_s *params,
+                 const struct emitter_params_s *emitter, real *pos, real *dir, cl_int *finished);
+void context_calculate(struct context_s *context, const struct calculation_params_s *params,
+                       struct dispatcher_s *dispatcher);
+void context_print_stats(const struct context_s *context);
+void context_get_timeline(const struct context_s *context, struct context_timeline_s *timeline);
+int context_num_cores(const struct context_s *context);
+void context_release(struct context_s *context);
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include <config.h>
+#include <cpu.h>
+
+/**
+ * Load native form of metric. For `path/name.cl` it is `path/name.so`
+ * if it exists, otherwise module built together with geodesic2.
+ * Integrator other than rk4 is compiled into its own module `name_<integrator>.so`
+ * @param integrator integrator of fixed step mode, NULL for rk4
+ */
+int cpu_backend_load(struct cpu_backend_s *cpu, const char *metric_fname, const char *integrator)
+{
+    char fname[4096];
+    char suffix[64] = "";
+    if (integrator != NULL && strcmp(integrator, "rk4"))
+        snprintf(suffix, sizeof(suffix), "_%s", integrator);
+    const char *base = strrchr(metric_fname, '/');
+    base = base ? base + 1 : metric_fname;
+    size_t len = strlen(metric_fname);
+    if (len > 3 && strcmp(metric_fname + len - 3, ".cl") == 0)
+        len -= 3;
+
+    snprintf(fname, sizeof(fname), "%.*s%s.so", (int)len, metric_fname, suffix);
+    cpu->handle = dlopen(fname, RTLD_NOW | RTLD_LOCAL);
+    if (cpu->handle == NULL)
+    {
+        size_t base_len = strlen(base);
+        if (base_len > 3 && strcmp(base + base_len - 3, ".cl") == 0)
+            base_len -= 3;
+        snprintf(fname, sizeof(fname), "%s/libcpu_%.*s%s.so", BINROOT, (int)base_len, base, suffix);
+        cpu->handle = dlopen(fname, RTLD_NOW | RTLD_LOCAL);
+    }
+
+    if (cpu->handle == NULL)
+    {
+        printf("Can not load native form of metric [%s]: %s\n", metric_fname, dlerror());
+        return -1;
+    }
+
+    cpu->metric = dlsym(cpu->handle, CPU_METRIC_SYMBOL);
+    if (cpu->metric == NULL)
+    {
+        printf("Invalid metric module [%s]\n", fname);
+        dlclose(cpu->handle);
+        cpu->handle = NULL;
+        return -1;
+    }
+
+    printf("Native metric: %s\n", fname);
+    return 0;
+}
+
+void cpu_backend_release(struct cpu_backend_s *cpu)
+{
+    if (cpu->handle != NULL)
+        dlclose(cpu->handle);
+    cpu->handle = NULL;
+    cpu->metric = NULL;
+}
+
+/**
+ * Emit rays of observer natively, same as emit_rays of OpenCL backend
+ * @return number of valid rays, -1 if metric can not emit rays
+ */
+int cpu_emit_rays(const struct cpu_backend_s *cpu,
+                  const struct calculation_params_s *params,
+                  const struct emitter_params_s *emitter,
+                  real *pos, real *dir, cl_int *finished)
+{
+    size_t i;
+    int j;
+
+    if (cpu->metric->emit == NULL)
+    {
+        printf("Metric can not emit rays, it does not define observer_position\n");
+        return -1;
+    }
+
+    size_t num = emitter->num;
+    size_t stride = params->soa ? num : 0;
+    int valid = 0;
+    for (i = 0; i < num; i++)
+    {
+        real cpos[DIM], cdir[DIM];
+        real alpha = emitter_angle(emitter, i);
+        bool ok = cpu->metric->emit(emitter->t, emitter->r, alpha, cpos, cdir, params->args);
+        for (j = 0; j < DIM; j++)
+        {
+            pos[RAY_INDEX(i, j, stride)] = ok ? cpos[j] : 0;
+            dir[RAY_INDEX(i, j, stride)] = ok ? cdir[j] : 0;
+        }
+        finished[i] = ok ? 0 : 1;
+        valid += ok;
+    }
+    return valid;
+}
+
+static void load_batch(struct cpu_batch_s *batch, const real *pos, const real *dir, size_t stride,
+                       const cl_int *finished, const real *length, const real *step, size_t num, real h)
+{
+    int b, i;
+    batch->num = num;
+    for (b = 0; b < CPU_BATCH; b++)
+    {
+        size_t id = b < num ? b : 0;
+        for (i = 0; i < DIM; i++)
+        {
+            batch->pos[i][b] = pos[RAY_INDEX(id, i, stride)];
+            batch->dir[i][b] = dir[RAY_INDEX(id, i, stride)];
+        }
+        batch->finished[b] = b < num ? finished[id] : 1;
+        batch->length[b] = length ? length[id] : 0;
+        batch->step[b] = step && step[id] > 0 ? step[id] : h;
+    }
+}
+
+static void store_batch(const struct cpu_batch_s *batch, real *pos, real *dir, size_t stride, cl_int *finished,
+                        real *length, real *step)
+{
+    int b, i;
+    for (b = 0; b < batch->num; b++)
+    {
+        for (i = 0; i < DIM; i++)
+        {
+            pos[RAY_INDEX(b, i, stride)] = batch->pos[i][b];
+            dir[RAY_INDEX(b, i, stride)] = batch->dir[i][b];
+        }
+        finished[b] = batch->finished[b];
+        if (length)
+            length[b] = batch->length[b];
+        if (step)
+            step[b] = batch->step[b];
+    }
+}
+
+/**
+ * Scene of ray, see calculation_params_s
+ */
+static size_t ray_scene(const struct calculation_params_s *params, cl_int ray_id)
+{
+    return params->scene_rays > 0 ? ray_id / params->scene_rays : 0;
+}
+
+/**
+ * Integrate block of rays on CPU, batch after batch. Rays of batch are
+ * from the same scene, so they share parameters of metric
+ * @param length, step state of integration, 0 for new rays, can be NULL
+ * @return number of done ray steps
+ */
+unsigned long cpu_perform_calculation(const struct cpu_backend_s *cpu,
+                                      const struct calculation_params_s *params,
+                                      real *pos,
+                                      real *dir,
+                                      size_t stride,
+                                      cl_int *finished,
+                                      real *length,
+                                      real *step,
+                                      size_t num_objects,
+                                      const cl_int *ray_id,
+                                      struct trajectory_s *output)
+{
+    struct cpu_batch_s batch;
+    unsigned long steps = 0;
+    size_t start, num;
+    int b;
+
+    for (start = 0; start < num_objects; start += num)
+    {
+        size_t scene = ray_scene(params, ray_id[start]);
+        num = 1;
+        while (num < CPU_BATCH && start + num < num_objects && ray_scene(params, ray_id[start + num]) == scene)
+            num++;
+        const real *args = params->args + scene * params->num_args;
+
+        real *bpos = pos + RAY_INDEX(start, 0, stride);
+        real *bdir = dir + RAY_INDEX(start, 0, stride);
+        cl_int *bfinished = finished + start;
+        real *blength = length ? length + start : NULL;
+        real *bstep = step ? step + start : NULL;
+
+        load_batch(&batch, bpos, bdir, stride, bfinished, blength, bstep, num, params->h);
+        batch.steps = 0;
+
+        if (output)
+            trajectory_write_rays(output, ray_id + start, 0, num, bpos, bdir, stride, bfinished, batch.length, 0);
+
+        while (true)
+        {
+            /* length of each ray is accumulated step by step as in kernels, so
+             * number of steps does not depend on num_steps */
+            if (params->adaptive)
+            {
+                cpu->metric->geodesic_adaptive(&batch, params->num_steps, params->T,
+                                               params->atol, params->rtol, args);
+            }
+            else
+            {
+                cpu->metric->geodesic(&batch, params->num_steps, params->h, params->T, args);
+            }
+
+            store_batch(&batch, bpos, bdir, stride, bfinished, blength, bstep);
+            if (output)
+                trajectory_write_rays(output, ray_id + start, 0, num, bpos, bdir, stride, bfinished, batch.length, 0);
+
+            bool all_done = true;
+            for (b = 0; b < num; b++)
+            {
+                if (batch.finished[b] == 0 && batch.length[b] < params->T)
+                    all_done = false;
+            }
+
+            if (all_done)
+                break;
+        }
+
+        steps += batch.steps;
+    }
+
+    return steps;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdio.h>
+#include <config.h>
+#include <calc.h>
+#include <cpu_metric.h>
+
+struct cpu_backend_s {
+    void *handle;                       // loaded metric module
+    const struct cpu_metric_s *metric;
+};
+
+int cpu_backend_load(struct cpu_backend_s *cpu, const char *metric_fname, const char *integrator);
+void cpu_backend_release(struct cpu_backend_s *cpu);
+
+int cpu_emit_rays(const struct cpu_backend_s *cpu,
+                  const struct calculation_params_s *params,
+                  const struct emitter_params_s *emitter,
+                  real *pos, real *dir, cl_int *finished);
+
+unsigned long cpu_perform_calculation(const struct cpu_backend_s *cpu,
+                                      const struct calculation_params_s *params,
+                                      real *pos,
+                                      real *dir,
+                                      size_t stride,
+                                      cl_int *finished,
+                                      real *length,
+                                      real *step,
+                                      size_t num_objects,
+                                      const cl_int *ray_id,
+                                      struct trajectory_s *output);
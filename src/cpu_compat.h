@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+ * Definitions for compiling device code (space.cl, special.cl, metric, geodesic.cl) as C
+ * for native CPU backend
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define kernel
+#define __kernel
+#define __global
+#define __constant static const
+
+#define powr pow
+
+#define get_global_id(dim) 0
+#define atomic_inc(p) ((*(p))++)
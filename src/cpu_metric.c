@@ -0,0 +1,602 @@
+/*
+ * Metric module of native CPU backend. Device code of space, special
+ * functions, metric and integrator is compiled as C. Rays are integrated
+ * in batches of CPU_BATCH in structure of arrays layout, so contraction of
+ * cristofel symbol and Runge-Kutta stages vectorize across rays.
+ *
+ * METRIC_SOURCE is path to metric file.
+ */
+
+#include <cpu_compat.h>
+
+#include "space.cl"
+#include "special.cl"
+#include METRIC_SOURCE
+#include "geodesic.cl"
+
+#include <cpu_metric.h>
+
+typedef real lanes_t[DIM][CPU_BATCH];
+
+static void load_lane(const lanes_t v, int b, struct tensor_1 *t)
+{
+    int i;
+    t->covar[0] = false;
+    for (i = 0; i < DIM; i++)
+        t->x[i] = v[i][b];
+}
+
+static void store_lane(lanes_t v, int b, const struct tensor_1 *t)
+{
+    int i;
+    for (i = 0; i < DIM; i++)
+        v[i][b] = t->x[i];
+}
+
+/**
+ * Change of direction for all active rays of batch
+ * @param pos positions
+ * @param dir directions
+ * @param active rays to calculate, others get zero
+ * @param ddir change of direction
+ * @param args parameters of metric
+ */
+static void batch_diff(const lanes_t pos, const lanes_t dir, const bool *active,
+                       lanes_t ddir, const real *args)
+{
+    real G[DIM][DIM][DIM][CPU_BATCH];
+    int b, i, j, k;
+
+    for (b = 0; b < CPU_BATCH; b++)
+    {
+        if (!active[b])
+        {
+            for (k = 0; k < DIM; k++)
+            for (i = 0; i < DIM; i++)
+            for (j = 0; j < DIM; j++)
+                G[k][i][j][b] = 0;
+            continue;
+        }
+
+        struct tensor_1 p;
+        load_lane(pos, b, &p);
+        struct tensor_3 Gb = cristofel_symbol(&p, args);
+
+        for (k = 0; k < DIM; k++)
+        for (i = 0; i < DIM; i++)
+        for (j = 0; j < DIM; j++)
+            G[k][i][j][b] = Gb.x[k][i][j];
+    }
+
+    for (k = 0; k < DIM; k++)
+    {
+        #pragma omp simd
+        for (b = 0; b < CPU_BATCH; b++)
+            ddir[k][b] = 0;
+
+        for (i = 0; i < DIM; i++)
+        for (j = 0; j < DIM; j++)
+        {
+            #pragma omp simd
+            for (b = 0; b < CPU_BATCH; b++)
+                ddir[k][b] -= G[k][i][j][b] * dir[i][b] * dir[j][b];
+        }
+    }
+}
+
+/**
+ * Check area and limit direction before step, as kernels do
+ * @return can ray make a step
+ */
+static bool prepare_lane(struct cpu_batch_s *batch, int b,
+                         const lanes_t pos0, const lanes_t dir0, const real *args)
+{
+    struct tensor_1 p, d;
+    load_lane(batch->pos, b, &p);
+    if (!allowed_area(&p, args))
+    {
+        /* kernels do not store position of bad ray */
+        int i;
+        batch->finished[b] = RAY_STOPPED;
+        for (i = 0; i < DIM; i++)
+        {
+            batch->pos[i][b] = pos0[i][b];
+            batch->dir[i][b] = dir0[i][b];
+        }
+        return false;
+    }
+
+    load_lane(batch->dir, b, &d);
+    limit_dir(&d);
+    store_lane(batch->dir, b, &d);
+    return true;
+}
+
+/**
+ * Try to apply delta to ray
+ * @return is delta allowed
+ */
+static bool apply_lane(struct cpu_batch_s *batch, int b,
+                       const lanes_t dpos, const lanes_t ddir, const real *args)
+{
+    int i;
+    struct tensor_1 p, d, dp, dd;
+    load_lane(batch->pos, b, &p);
+    load_lane(batch->dir, b, &d);
+    load_lane(dpos, b, &dp);
+    load_lane(ddir, b, &dd);
+
+    if (!allowed_delta(&p, &d, &dp, &dd, args))
+        return false;
+
+    for (i = 0; i < DIM; i++)
+    {
+        batch->pos[i][b] += dpos[i][b];
+        batch->dir[i][b] += ddir[i][b];
+    }
+    return true;
+}
+
+/**
+ * Check stop condition of metric after successful step, as kernels do
+ * @return status of ray
+ */
+static int stop_lane(struct cpu_batch_s *batch, int b, const real *args)
+{
+    struct tensor_1 p, d;
+    load_lane(batch->pos, b, &p);
+    load_lane(batch->dir, b, &d);
+    int status = ray_stop_status(&p, &d, args);
+    if (status != RAY_RUNNING)
+    {
+        store_lane(batch->pos, b, &p);
+        store_lane(batch->dir, b, &d);
+    }
+    return status;
+}
+
+#ifndef INTEGRATOR_TABLEAU
+/**
+ * Delta of active rays in one step of classic Runge-Kutta,
+ * pos_k of stage is dir of stage
+ */
+static void batch_delta(struct cpu_batch_s *batch, const bool *active, real h,
+                        lanes_t delta_pos, lanes_t delta_dir, const real *args)
+{
+    lanes_t pos_s, dir_s;
+    lanes_t dir_k[4];
+    int b, i, s;
+
+    static const real stage_c[4] = {0, 0.5, 0.5, 1};
+    static const real stage_b[4] = {1.0/6, 2.0/6, 2.0/6, 1.0/6};
+    for (i = 0; i < DIM; i++)
+    for (b = 0; b < CPU_BATCH; b++)
+    {
+        delta_pos[i][b] = 0;
+        delta_dir[i][b] = 0;
+    }
+
+    for (s = 0; s < 4; s++)
+    {
+        for (i = 0; i < DIM; i++)
+        {
+            #pragma omp simd
+            for (b = 0; b < CPU_BATCH; b++)
+            {
+                if (s == 0)
+                {
+                    pos_s[i][b] = batch->pos[i][b];
+                    dir_s[i][b] = batch->dir[i][b];
+                }
+                else
+                {
+                    pos_s[i][b] = batch->pos[i][b] + h * stage_c[s] * dir_s[i][b];
+                    dir_s[i][b] = batch->dir[i][b] + h * stage_c[s] * dir_k[s-1][i][b];
+                }
+            }
+        }
+
+        batch_diff(pos_s, dir_s, active, dir_k[s], args);
+
+        for (i = 0; i < DIM; i++)
+        {
+            #pragma omp simd
+            for (b = 0; b < CPU_BATCH; b++)
+            {
+                delta_pos[i][b] += h * stage_b[s] * dir_s[i][b];
+                delta_dir[i][b] += h * stage_b[s] * dir_k[s][i][b];
+            }
+        }
+    }
+}
+#else
+/**
+ * Delta of active rays in one step of Runge-Kutta method given by
+ * integrator_a, integrator_b. Delta of lane where fixed point iteration
+ * of implicit stages does not converge is NaN.
+ */
+static void batch_delta(struct cpu_batch_s *batch, const bool *active, real h,
+                        lanes_t delta_pos, lanes_t delta_dir, const real *args)
+{
+    lanes_t pos_s, dir_s;
+    lanes_t pos_k[INTEGRATOR_STAGES];
+    lanes_t dir_k[INTEGRATOR_STAGES];
+    int b, i, j, s;
+
+#ifdef INTEGRATOR_IMPLICIT
+    /* initial guess: all stages at the start of step */
+    real change[CPU_BATCH];
+    bool iterate[CPU_BATCH];
+    batch_diff(batch->pos, batch->dir, active, dir_k[0], args);
+    for (s = 0; s < INTEGRATOR_STAGES; s++)
+    for (i = 0; i < DIM; i++)
+    for (b = 0; b < CPU_BATCH; b++)
+    {
+        pos_k[s][i][b] = batch->dir[i][b];
+        dir_k[s][i][b] = dir_k[0][i][b];
+    }
+    for (b = 0; b < CPU_BATCH; b++)
+        iterate[b] = active[b];
+
+    int iteration;
+    for (iteration = 0; iteration < implicit_max_iterations; iteration++)
+    {
+        for (b = 0; b < CPU_BATCH; b++)
+            change[b] = 0;
+
+        for (s = 0; s < INTEGRATOR_STAGES; s++)
+        {
+            lanes_t k;
+            for (i = 0; i < DIM; i++)
+            {
+                #pragma omp simd
+                for (b = 0; b < CPU_BATCH; b++)
+                {
+                    pos_s[i][b] = batch->pos[i][b];
+                    dir_s[i][b] = batch->dir[i][b];
+                }
+                for (j = 0; j < INTEGRATOR_STAGES; j++)
+                {
+                    #pragma omp simd
+                    for (b = 0; b < CPU_BATCH; b++)
+                    {
+                        pos_s[i][b] += h * integrator_a[s][j] * pos_k[j][i][b];
+                        dir_s[i][b] += h * integrator_a[s][j] * dir_k[j][i][b];
+                    }
+                }
+            }
+
+            batch_diff(pos_s, dir_s, iterate, k, args);
+
+            for (i = 0; i < DIM; i++)
+            for (b = 0; b < CPU_BATCH; b++)
+            {
+                if (!iterate[b])
+                    continue;
+                change[b] = fmax(change[b], fabs(dir_s[i][b] - pos_k[s][i][b]) / (1 + fabs(dir_s[i][b])));
+                change[b] = fmax(change[b], fabs(h * (k[i][b] - dir_k[s][i][b])) / (1 + fabs(dir_s[i][b])));
+                pos_k[s][i][b] = dir_s[i][b];
+                dir_k[s][i][b] = k[i][b];
+            }
+        }
+
+        bool any = false;
+        for (b = 0; b < CPU_BATCH; b++)
+        {
+            if (iterate[b] && change[b] <= implicit_tol)
+                iterate[b] = false;
+            any |= iterate[b];
+        }
+        if (!any)
+            break;
+    }
+#else
+    for (s = 0; s < INTEGRATOR_STAGES; s++)
+    {
+        for (i = 0; i < DIM; i++)
+        {
+            #pragma omp simd
+            for (b = 0; b < CPU_BATCH; b++)
+            {
+                pos_s[i][b] = batch->pos[i][b];
+                dir_s[i][b] = batch->dir[i][b];
+            }
+            for (j = 0; j < s; j++)
+            {
+                #pragma omp simd
+                for (b = 0; b < CPU_BATCH; b++)
+                {
+                    pos_s[i][b] += h * integrator_a[s][j] * pos_k[j][i][b];
+                    dir_s[i][b] += h * integrator_a[s][j] * dir_k[j][i][b];
+                }
+            }
+            #pragma omp simd
+            for (b = 0; b < CPU_BATCH; b++)
+                pos_k[s][i][b] = dir_s[i][b];
+        }
+
+        batch_diff(pos_s, dir_s, active, dir_k[s], args);
+    }
+#endif
+
+    for (i = 0; i < DIM; i++)
+    {
+        #pragma omp simd
+        for (b = 0; b < CPU_BATCH; b++)
+        {
+            delta_pos[i][b] = 0;
+            delta_dir[i][b] = 0;
+        }
+        for (s = 0; s < INTEGRATOR_STAGES; s++)
+        {
+            #pragma omp simd
+            for (b = 0; b < CPU_BATCH; b++)
+            {
+                delta_pos[i][b] += integrator_b[s] * pos_k[s][i][b];
+                delta_dir[i][b] += integrator_b[s] * dir_k[s][i][b];
+            }
+        }
+        #pragma omp simd
+        for (b = 0; b < CPU_BATCH; b++)
+        {
+            delta_pos[i][b] *= h;
+            delta_dir[i][b] *= h;
+        }
+    }
+
+#ifdef INTEGRATOR_IMPLICIT
+    for (b = 0; b < CPU_BATCH; b++)
+    {
+        if (iterate[b])
+            delta_pos[0][b] = NAN;
+    }
+#endif
+}
+#endif
+
+static void batch_geodesic(struct cpu_batch_s *batch, int num, real h, real T, const real *args)
+{
+    lanes_t pos0, dir0;
+    lanes_t delta_pos, delta_dir;
+    bool active[CPU_BATCH];
+    int b, i, n;
+
+    for (b = 0; b < CPU_BATCH; b++)
+        active[b] = b < batch->num && batch->finished[b] == 0 && batch->length[b] < T;
+
+    for (i = 0; i < DIM; i++)
+    for (b = 0; b < CPU_BATCH; b++)
+    {
+        pos0[i][b] = batch->pos[i][b];
+        dir0[i][b] = batch->dir[i][b];
+    }
+
+    for (n = 0; n < num; n++)
+    {
+        bool any = false;
+        for (b = 0; b < CPU_BATCH; b++)
+        {
+            if (active[b])
+                active[b] = prepare_lane(batch, b, pos0, dir0, args);
+            any |= active[b];
+        }
+
+        if (!any)
+            break;
+
+        batch_delta(batch, active, h, delta_pos, delta_dir, args);
+
+        for (b = 0; b < CPU_BATCH; b++)
+        {
+            if (!active[b])
+                continue;
+
+            bool bad = false;
+            for (i = 0; i < DIM; i++)
+            {
+                if (isnan(delta_pos[i][b]) || isinf(delta_pos[i][b]) ||
+                    isnan(delta_dir[i][b]) || isinf(delta_dir[i][b]))
+                    bad = true;
+            }
+
+            if (bad || !apply_lane(batch, b, delta_pos, delta_dir, args))
+            {
+                batch->finished[b] = RAY_STOPPED;
+                active[b] = false;
+                continue;
+            }
+            batch->steps++;
+            batch->length[b] += h;
+            if (batch->length[b] >= T)
+                active[b] = false;
+
+            int status = stop_lane(batch, b, args);
+            if (status != RAY_RUNNING)
+            {
+                batch->finished[b] = status;
+                active[b] = false;
+            }
+        }
+    }
+}
+
+static void batch_geodesic_adaptive(struct cpu_batch_s *batch, int num,
+                                    real T, real atol, real rtol, const real *args)
+{
+    lanes_t pos0, dir0;
+    lanes_t pos_k[7], dir_k[7];
+    lanes_t pos_s, dir_s;
+    lanes_t delta_pos, delta_dir;
+    bool active[CPU_BATCH];
+    bool new_step[CPU_BATCH];
+    int accepted[CPU_BATCH];
+    real hc[CPU_BATCH];
+    real err[CPU_BATCH];
+    int b, i, j, s;
+
+    for (b = 0; b < CPU_BATCH; b++)
+    {
+        active[b] = b < batch->num && batch->finished[b] == 0 && batch->length[b] < T;
+        new_step[b] = true;
+        accepted[b] = 0;
+        hc[b] = 0;
+    }
+
+    for (i = 0; i < DIM; i++)
+    for (b = 0; b < CPU_BATCH; b++)
+    {
+        pos0[i][b] = batch->pos[i][b];
+        dir0[i][b] = batch->dir[i][b];
+    }
+
+    while (true)
+    {
+        bool any = false;
+        for (b = 0; b < CPU_BATCH; b++)
+        {
+            if (active[b] && new_step[b])
+            {
+                active[b] = prepare_lane(batch, b, pos0, dir0, args);
+                hc[b] = fmin(batch->step[b], T - batch->length[b]);
+                new_step[b] = false;
+            }
+            any |= active[b];
+        }
+
+        if (!any)
+            break;
+
+        /* Dormand-Prince stages, each ray with own step */
+        for (s = 0; s < 7; s++)
+        {
+            for (i = 0; i < DIM; i++)
+            {
+                #pragma omp simd
+                for (b = 0; b < CPU_BATCH; b++)
+                {
+                    pos_s[i][b] = batch->pos[i][b];
+                    dir_s[i][b] = batch->dir[i][b];
+                }
+                for (j = 0; j < s; j++)
+                {
+                    #pragma omp simd
+                    for (b = 0; b < CPU_BATCH; b++)
+                    {
+                        pos_s[i][b] += hc[b] * dp_a[s][j] * pos_k[j][i][b];
+                        dir_s[i][b] += hc[b] * dp_a[s][j] * dir_k[j][i][b];
+                    }
+                }
+                #pragma omp simd
+                for (b = 0; b < CPU_BATCH; b++)
+                    pos_k[s][i][b] = dir_s[i][b];
+            }
+            batch_diff(pos_s, dir_s, active, dir_k[s], args);
+        }
+
+        /* pos_s, dir_s now contain 5th order solution */
+        #pragma omp simd
+        for (b = 0; b < CPU_BATCH; b++)
+            err[b] = 0;
+
+        for (i = 0; i < DIM; i++)
+        {
+            #pragma omp simd
+            for (b = 0; b < CPU_BATCH; b++)
+            {
+                real epos = 0, edir = 0;
+                for (s = 0; s < 7; s++)
+                {
+                    epos += dp_e[s] * pos_k[s][i][b];
+                    edir += dp_e[s] * dir_k[s][i][b];
+                }
+                epos = fabs(hc[b] * epos) / (atol + rtol * fmax(fabs(batch->pos[i][b]), fabs(pos_s[i][b])));
+                edir = fabs(hc[b] * edir) / (atol + rtol * fmax(fabs(batch->dir[i][b]), fabs(dir_s[i][b])));
+                err[b] = fmax(err[b], fmax(epos, edir));
+                delta_pos[i][b] = pos_s[i][b] - batch->pos[i][b];
+                delta_dir[i][b] = dir_s[i][b] - batch->dir[i][b];
+            }
+        }
+
+        for (b = 0; b < CPU_BATCH; b++)
+        {
+            if (!active[b])
+                continue;
+
+            if (isnan(err[b]) || isinf(err[b]))
+            {
+                hc[b] *= adaptive_min_scale;
+            }
+            else if (err[b] > 1)
+            {
+                hc[b] *= fmax(adaptive_min_scale, adaptive_safety * pow(err[b], -0.2));
+            }
+            else
+            {
+                if (!apply_lane(batch, b, delta_pos, delta_dir, args))
+                {
+                    batch->finished[b] = RAY_STOPPED;
+                    active[b] = false;
+                    continue;
+                }
+
+                real done = hc[b];
+                if (err[b] > 0)
+                    hc[b] = done * fmin(adaptive_max_scale, fmax(adaptive_min_scale, adaptive_safety * pow(err[b], -0.2)));
+                else
+                    hc[b] = done * adaptive_max_scale;
+
+                batch->length[b] += done;
+                /* do not let the final clamped step shrink the step of the geodesic */
+                if (batch->length[b] < T)
+                    batch->step[b] = hc[b];
+                else
+                    batch->step[b] = fmax(batch->step[b], hc[b]);
+
+                batch->steps++;
+                accepted[b]++;
+                new_step[b] = true;
+                if (accepted[b] >= num || batch->length[b] >= T)
+                    active[b] = false;
+
+                int status = stop_lane(batch, b, args);
+                if (status != RAY_RUNNING)
+                {
+                    batch->finished[b] = status;
+                    active[b] = false;
+                }
+                continue;
+            }
+
+            if (hc[b] < adaptive_min_step)
+            {
+                batch->finished[b] = RAY_STOPPED;
+                active[b] = false;
+            }
+        }
+    }
+}
+
+#ifdef METRIC_OBSERVER_POSITION
+static bool cpu_emit(real t, real r, real alpha, real *pos, real *dir, const real *args)
+{
+    struct tensor_1 p, d;
+    if (!emit_ray(t, r, alpha, &p, &d, args))
+        return false;
+
+    int i;
+    for (i = 0; i < DIM; i++)
+    {
+        pos[i] = p.x[i];
+        dir[i] = d.x[i];
+    }
+    return true;
+}
+#endif
+
+const struct cpu_metric_s cpu_metric = {
+    .geodesic = batch_geodesic,
+    .geodesic_adaptive = batch_geodesic_adaptive,
+#ifdef METRIC_OBSERVER_POSITION
+    .emit = cpu_emit,
+#endif
+};
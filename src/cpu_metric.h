@@ -0,0 +1,34 @@
+#pragma once
+
+/*
+ * Interface of metric module of native CPU backend.
+ * `real` has to be defined before including this file.
+ */
+
+#define CPU_BATCH 8         // rays integrated together
+#define CPU_METRIC_SYMBOL "cpu_metric"
+
+/**
+ * Batch of rays in structure of arrays layout
+ */
+struct cpu_batch_s {
+    int num;                        // number of rays in batch
+    real pos[DIM][CPU_BATCH];
+    real dir[DIM][CPU_BATCH];
+    int finished[CPU_BATCH];
+    real length[CPU_BATCH];         // integrated length of each ray
+    real step[CPU_BATCH];           // current step of each ray, adaptive mode
+    unsigned long steps;            // number of done ray steps
+};
+
+struct cpu_metric_s {
+    /* same as kernel_geodesic, for all rays of batch */
+    void (*geodesic)(struct cpu_batch_s *batch, int num, real h, real T, const real *args);
+
+    /* same as kernel_geodesic_adaptive, for all rays of batch */
+    void (*geodesic_adaptive)(struct cpu_batch_s *batch, int num,
+                              real T, real atol, real rtol, const real *args);
+
+    /* same as emit_ray, NULL if metric has no observer_position */
+    bool (*emit)(real t, real r, real alpha, real *pos, real *dir, const real *args);
+};
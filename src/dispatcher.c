@@ -1,59 +1,487 @@
+#include <stdlib.h>
+
 #include <dispatcher.h>
 
 #define min(a,b) ((a)<(b)?(a):(b))
 
-void dispatcher_init(struct dispatcher_s *dispatcher, real *pos, real *dir, cl_int *finished, FILE **output, size_t num_objects)
+#define PROGRESS_INTERVAL 1     // s between progress lines of run without telemetry
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+void dispatcher_init(struct dispatcher_s *dispatcher, real *pos, real *dir, size_t stride, cl_int *finished, struct trajectory_s *output, size_t num_objects)
 {
+    dispatcher->stride = stride;
     dispatcher->output = output;
     dispatcher->finished = finished;
     dispatcher->pos = pos;
     dispatcher->dir = dir;
     dispatcher->num_completed = 0;
     dispatcher->num_objects = num_objects;
-    dispatcher->max_per_block = 256;
+    dispatcher->min_per_block = 64;
+    dispatcher->workers = NULL;
+    dispatcher->num_workers = 0;
+    dispatcher->num_idle = 0;
+    dispatcher->returned = NULL;
+    dispatcher->num_returned = 0;
+    dispatcher->returned_capacity = 0;
+    dispatcher->stream = NULL;
+    dispatcher->stream_has_data = false;
+    dispatcher->result = NULL;
+    dispatcher->telemetry = NULL;
+    dispatcher->checkpoint = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &dispatcher->progress);
     pthread_mutex_init(&dispatcher->mutex, NULL);
+    pthread_cond_init(&dispatcher->cond, NULL);
+    pthread_mutex_init(&dispatcher->stream_mutex, NULL);
+    pthread_mutex_init(&dispatcher->result_mutex, NULL);
+}
+
+void dispatcher_init_stream(struct dispatcher_s *dispatcher, struct ray_stream_s *stream, FILE *result, struct trajectory_s *output)
+{
+    dispatcher_init(dispatcher, NULL, NULL, 0, NULL, output, 0);
+    dispatcher->stream = stream;
+    dispatcher->stream_has_data = ray_stream_has_data(stream);
+    dispatcher->result = result;
+}
+
+/**
+ * Set number of workers, call right before they start
+ */
+void dispatcher_set_workers(struct dispatcher_s *dispatcher, int num_workers)
+{
+    int i;
+    dispatcher->workers = calloc(num_workers, sizeof(struct dispatcher_worker_s));
+    dispatcher->num_workers = num_workers;
+    for (i = 0; i < num_workers; i++)
+        clock_gettime(CLOCK_MONOTONIC, &dispatcher->workers[i].start);
+    telemetry_set_workers(dispatcher->telemetry, num_workers);
 }
 
 void dispatcher_release(struct dispatcher_s *dispatcher)
 {
+    free(dispatcher->workers);
+    free(dispatcher->returned);
     pthread_mutex_destroy(&dispatcher->mutex);
+    pthread_cond_destroy(&dispatcher->cond);
+    pthread_mutex_destroy(&dispatcher->stream_mutex);
+    pthread_mutex_destroy(&dispatcher->result_mutex);
+}
+
+static bool input_has_data(const struct dispatcher_s *dispatcher)
+{
+    if (dispatcher->stream != NULL)
+        return dispatcher->stream_has_data;
+    return (dispatcher->num_objects > dispatcher->num_completed);
 }
 
-size_t dispatcher_get_next_block(struct dispatcher_s *dispatcher,
-                                 real **pos,
-                                 real **dir,
-                                 cl_int **finished,
-                                 FILE ***output,
-                                 int amount)
+/**
+ * Size of block for worker: its share of remaining rays by throughput,
+ * halved so that the tail is distributed in smaller and smaller blocks
+ */
+static size_t guided_amount(const struct dispatcher_s *dispatcher, int worker, size_t amount)
 {
+    int i;
+    if (dispatcher->stream != NULL || dispatcher->num_workers <= 1)
+        return amount;
+
+    double total = 0;
+    bool measured = true;
+    for (i = 0; i < dispatcher->num_workers; i++)
+    {
+        if (dispatcher->workers[i].rate <= 0)
+            measured = false;
+        total += dispatcher->workers[i].rate;
+    }
+
+    double share = measured ? dispatcher->workers[worker].rate / total : 1.0 / dispatcher->num_workers;
+    size_t guided = (dispatcher->num_objects - dispatcher->num_completed) * share / 2;
+    if (guided < dispatcher->min_per_block)
+        guided = dispatcher->min_per_block;
+    return min(amount, guided);
+}
+
+/**
+ * Take next rays. Rays returned by other workers are taken first
+ * @param worker index of worker
+ * @param ray_id index of each taken ray
+ * @param pos, dir, finished where to copy rays, pos and dir in layout of stride
+ * @param length, step state of integration, 0 for new rays, can be NULL
+ * @return number of taken rays, 0 if there are no more rays
+ */
+size_t dispatcher_fetch(struct dispatcher_s *dispatcher,
+                        int worker,
+                        cl_int *ray_id,
+                        real *pos,
+                        real *dir,
+                        size_t stride,
+                        cl_int *finished,
+                        real *length,
+                        real *step,
+                        int amount)
+{
+    size_t i, num = 0;
+    size_t first = 0;
+    int j;
+
     if (amount <= 0)
     {
-        amount = dispatcher->max_per_block;
+        amount = 256;
     }
 
     pthread_mutex_lock(&dispatcher->mutex);
-    size_t num = min(dispatcher->num_objects - dispatcher->num_completed, amount);
+    while (num < amount && dispatcher->num_returned > 0)
+    {
+        const struct returned_ray_s *r = &dispatcher->returned[--dispatcher->num_returned];
+        for (j = 0; j < DIM; j++)
+        {
+            pos[RAY_INDEX(num, j, stride)] = r->pos[j];
+            dir[RAY_INDEX(num, j, stride)] = r->dir[j];
+        }
+        ray_id[num] = r->id;
+        finished[num] = r->finished;
+        if (length)
+            length[num] = r->length;
+        if (step)
+            step[num] = r->step;
+        num++;
+    }
+
     if (num > 0)
     {
-        *pos = &(dispatcher->pos[dispatcher->num_completed*DIM]);
-        *dir = &(dispatcher->dir[dispatcher->num_completed*DIM]);
-        if (dispatcher->output != NULL)
+        pthread_mutex_unlock(&dispatcher->mutex);
+        return num;
+    }
+
+    if (dispatcher->stream != NULL)
+    {
+        /* reading may block on input, other workers keep returning and taking rays meanwhile */
+        pthread_mutex_unlock(&dispatcher->mutex);
+        pthread_mutex_lock(&dispatcher->stream_mutex);
+        num = read_ray_stream(dispatcher->stream, pos, dir, stride, amount);
+        for (i = 0; i < num; i++)
+            finished[i] = 0;
+
+        pthread_mutex_lock(&dispatcher->mutex);
+        first = dispatcher->num_completed;
+        dispatcher->num_completed += num;
+        dispatcher->stream_has_data = ray_stream_has_data(dispatcher->stream);
+        pthread_mutex_unlock(&dispatcher->mutex);
+        pthread_mutex_unlock(&dispatcher->stream_mutex);
+    }
+    else
+    {
+        first = dispatcher->num_completed;
+        amount = guided_amount(dispatcher, worker, amount);
+        num = min(dispatcher->num_objects - dispatcher->num_completed, amount);
+        dispatcher->num_completed += num;
+        pthread_mutex_unlock(&dispatcher->mutex);
+    }
+
+    for (i = 0; i < num; i++)
+    {
+        size_t src = first + i;
+        ray_id[i] = src;
+        if (length)
+            length[i] = 0;
+        if (step)
+            step[i] = 0;
+        if (dispatcher->stream != NULL)
+            continue;
+
+        for (j = 0; j < DIM; j++)
+        {
+            pos[RAY_INDEX(i, j, stride)] = dispatcher->pos[RAY_INDEX(src, j, dispatcher->stride)];
+            dir[RAY_INDEX(i, j, stride)] = dispatcher->dir[RAY_INDEX(src, j, dispatcher->stride)];
+        }
+        finished[i] = dispatcher->finished[src];
+    }
+    return num;
+}
+
+/**
+ * Is it time for progress line of some worker. Instrumented run reports
+ * progress by telemetry, so it has no progress lines
+ */
+bool dispatcher_progress_due(struct dispatcher_s *dispatcher)
+{
+    if (dispatcher->telemetry != NULL)
+        return false;
+
+    pthread_mutex_lock(&dispatcher->mutex);
+    bool due = seconds_since(&dispatcher->progress) >= PROGRESS_INTERVAL;
+    if (due)
+        clock_gettime(CLOCK_MONOTONIC, &dispatcher->progress);
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return due;
+}
+
+/**
+ * Account work of worker
+ * @param ray_steps number of ray steps done since previous report
+ */
+void dispatcher_report(struct dispatcher_s *dispatcher, int worker, double ray_steps)
+{
+    struct dispatcher_worker_s *w = &dispatcher->workers[worker];
+    pthread_mutex_lock(&dispatcher->mutex);
+    w->ray_steps += ray_steps;
+    double elapsed = seconds_since(&w->start);
+    if (elapsed > 0)
+        w->rate = w->ray_steps / elapsed;
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+/**
+ * Is there idle worker with nothing to take
+ */
+bool dispatcher_wants_rays(struct dispatcher_s *dispatcher)
+{
+    pthread_mutex_lock(&dispatcher->mutex);
+    bool wants = dispatcher->num_idle > 0 && dispatcher->num_returned == 0 && !input_has_data(dispatcher);
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return wants;
+}
+
+/**
+ * Give unfinished rays back to be taken by idle worker
+ */
+void dispatcher_return(struct dispatcher_s *dispatcher, const cl_int *ray_id, size_t num,
+                       const real *pos, const real *dir, size_t stride, const cl_int *finished,
+                       const real *length, const real *step)
+{
+    size_t i;
+    int j;
+
+    pthread_mutex_lock(&dispatcher->mutex);
+    if (dispatcher->num_returned + num > dispatcher->returned_capacity)
+    {
+        dispatcher->returned_capacity = 2 * (dispatcher->num_returned + num);
+        dispatcher->returned = realloc(dispatcher->returned, sizeof(struct returned_ray_s) * dispatcher->returned_capacity);
+    }
+
+    for (i = 0; i < num; i++)
+    {
+        struct returned_ray_s *r = &dispatcher->returned[dispatcher->num_returned++];
+        for (j = 0; j < DIM; j++)
         {
-            *output = &(dispatcher->output[dispatcher->num_completed]);
+            r->pos[j] = pos[RAY_INDEX(i, j, stride)];
+            r->dir[j] = dir[RAY_INDEX(i, j, stride)];
         }
-        else
+        r->id = ray_id[i];
+        r->finished = finished[i];
+        r->length = length[i];
+        r->step = step[i];
+    }
+    pthread_cond_broadcast(&dispatcher->cond);
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+/**
+ * Wait until some rays are returned by other workers
+ * @return are there rays to take, false when all workers are idle
+ */
+bool dispatcher_wait_for_rays(struct dispatcher_s *dispatcher, int worker)
+{
+    double wait_start = telemetry_now(dispatcher->telemetry);
+    pthread_mutex_lock(&dispatcher->mutex);
+    dispatcher->workers[worker].finish_time = seconds_since(&dispatcher->workers[worker].start);
+    dispatcher->num_idle++;
+    pthread_cond_broadcast(&dispatcher->cond);
+    while (dispatcher->num_returned == 0 && !input_has_data(dispatcher) &&
+           dispatcher->num_idle < dispatcher->num_workers)
+        pthread_cond_wait(&dispatcher->cond, &dispatcher->mutex);
+
+    bool got = dispatcher->num_returned > 0 || input_has_data(dispatcher);
+    if (got)
+        dispatcher->num_idle--;
+    pthread_mutex_unlock(&dispatcher->mutex);
+    telemetry_span(dispatcher->telemetry, worker, TELEMETRY_WAIT, wait_start, telemetry_now(dispatcher->telemetry));
+    return got;
+}
+
+/**
+ * Worker stops and will not return rays
+ */
+void dispatcher_worker_done(struct dispatcher_s *dispatcher, int worker)
+{
+    pthread_mutex_lock(&dispatcher->mutex);
+    dispatcher->workers[worker].finish_time = seconds_since(&dispatcher->workers[worker].start);
+    dispatcher->num_idle++;
+    pthread_cond_broadcast(&dispatcher->cond);
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+void dispatcher_print_stats(const struct dispatcher_s *dispatcher)
+{
+    int i;
+    for (i = 0; i < dispatcher->num_workers; i++)
+    {
+        const struct dispatcher_worker_s *w = &dispatcher->workers[i];
+        printf("Worker %i: %.3le ray steps, %.3le steps/s, finished at %.3lf s\n",
+               i, w->ray_steps, w->rate, w->finish_time);
+    }
+}
+
+/**
+ * Copy state of rays to arrays of dispatcher and checkpoint
+ * @param length, step state of integration, not copied if NULL
+ */
+static void copy_rays(struct dispatcher_s *dispatcher, const cl_int *ray_id, size_t first, size_t num,
+                      const real *pos, const real *dir, size_t stride, const cl_int *finished,
+                      const real *length, const real *step)
+{
+    struct checkpoint_s *checkpoint = dispatcher->checkpoint;
+    size_t i;
+    int j;
+
+    for (i = 0; i < num; i++)
+    {
+        size_t dst = ray_id ? (size_t)ray_id[i] : first + i;
+        for (j = 0; j < DIM; j++)
         {
-            *output = NULL;
+            dispatcher->pos[RAY_INDEX(dst, j, dispatcher->stride)] = pos[RAY_INDEX(i, j, stride)];
+            dispatcher->dir[RAY_INDEX(dst, j, dispatcher->stride)] = dir[RAY_INDEX(i, j, stride)];
         }
-    
-        *finished = &(dispatcher->finished[dispatcher->num_completed]);
-        dispatcher->num_completed += num;
+        dispatcher->finished[dst] = finished[i];
+        if (checkpoint != NULL && length != NULL)
+            checkpoint->length[dst] = length[i];
+        if (checkpoint != NULL && step != NULL)
+            checkpoint->step[dst] = step[i];
+    }
+}
+
+/**
+ * Write checkpoint if it is due, called with mutex locked
+ */
+static void checkpoint_if_due(struct dispatcher_s *dispatcher)
+{
+    if (!checkpoint_due(dispatcher->checkpoint, &dispatcher->checkpoint->last))
+        return;
+    if (checkpoint_write(dispatcher->checkpoint, dispatcher->pos, dispatcher->dir, dispatcher->stride,
+                         dispatcher->finished, dispatcher->num_completed) == 0)
+        printf("Checkpoint [%s]: %u rays taken\n", dispatcher->checkpoint->fname, dispatcher->num_completed);
+}
+
+/**
+ * Return calculated rays
+ * @param ray_id index of each ray, NULL if rays are first, first + 1, ...
+ * @param length integrated length of each ray, kept by checkpoint, can be NULL
+ */
+void dispatcher_store(struct dispatcher_s *dispatcher, const cl_int *ray_id, size_t first, size_t num,
+                      const real *pos, const real *dir, size_t stride, const cl_int *finished,
+                      const real *length)
+{
+    size_t i;
+    int j;
+
+    if (dispatcher->stream != NULL)
+    {
+        pthread_mutex_lock(&dispatcher->result_mutex);
+        for (i = 0; i < num; i++)
+        {
+            fprintf(dispatcher->result, "%zu,%s,%i", ray_id ? (size_t)ray_id[i] : first + i,
+                    finished[i] ? "true" : "false", (int)finished[i]);
+            for (j = 0; j < DIM; j++)
+                fprintf(dispatcher->result, ",%lf", (double)pos[RAY_INDEX(i, j, stride)]);
+            for (j = 0; j < DIM; j++)
+                fprintf(dispatcher->result, ",%lf", (double)dir[RAY_INDEX(i, j, stride)]);
+            fprintf(dispatcher->result, "\n");
+        }
+        fflush(dispatcher->result);
+        pthread_mutex_unlock(&dispatcher->result_mutex);
+        return;
     }
+
+    /* rays are stored to their own places, lock is needed only for checkpoint */
+    if (dispatcher->checkpoint == NULL)
+    {
+        copy_rays(dispatcher, ray_id, first, num, pos, dir, stride, finished, NULL, NULL);
+        return;
+    }
+
+    pthread_mutex_lock(&dispatcher->mutex);
+    copy_rays(dispatcher, ray_id, first, num, pos, dir, stride, finished, length, NULL);
+    checkpoint_if_due(dispatcher);
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+/**
+ * Save state of rays which are still integrated, so calculation can be
+ * resumed from it. Checkpoint is written if it is due
+ * @param length, step state of integration of each ray
+ */
+void dispatcher_save(struct dispatcher_s *dispatcher, const cl_int *ray_id, size_t num,
+                     const real *pos, const real *dir, size_t stride, const cl_int *finished,
+                     const real *length, const real *step)
+{
+    if (dispatcher->checkpoint == NULL)
+        return;
+
+    pthread_mutex_lock(&dispatcher->mutex);
+    copy_rays(dispatcher, ray_id, 0, num, pos, dir, stride, finished, length, step);
+    checkpoint_if_due(dispatcher);
     pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+/**
+ * Continue calculation from loaded checkpoint. Rays taken before it was
+ * written, which are running and have not reached T, are given back with
+ * their length and step, other rays are taken as usual
+ * @param T end of integration, can be larger than in checkpoint
+ * @return number of continued rays
+ */
+size_t dispatcher_resume(struct dispatcher_s *dispatcher, real T)
+{
+    const struct checkpoint_s *checkpoint = dispatcher->checkpoint;
+    size_t i, num = 0;
+
+    for (i = 0; i < checkpoint->cursor; i++)
+    {
+        cl_int id = i;
+        if (dispatcher->finished[i] != RAY_RUNNING || checkpoint->length[i] >= T)
+            continue;
+        dispatcher_return(dispatcher, &id, 1, &dispatcher->pos[RAY_INDEX(i, 0, dispatcher->stride)],
+                          &dispatcher->dir[RAY_INDEX(i, 0, dispatcher->stride)], dispatcher->stride,
+                          &dispatcher->finished[i], &checkpoint->length[i], &checkpoint->step[i]);
+        num++;
+    }
+    dispatcher->num_completed = checkpoint->cursor;
     return num;
 }
 
-bool dispatcher_has_data(const struct dispatcher_s *dispatcher)
+/**
+ * Write checkpoint now, e.g. when calculation is done
+ */
+int dispatcher_checkpoint(struct dispatcher_s *dispatcher)
 {
-    return (dispatcher->num_objects > dispatcher->num_completed);
+    pthread_mutex_lock(&dispatcher->mutex);
+    int ret = checkpoint_write(dispatcher->checkpoint, dispatcher->pos, dispatcher->dir, dispatcher->stride,
+                               dispatcher->finished, dispatcher->num_completed);
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return ret;
+}
+
+void write_result_header(FILE *result, bool with_id)
+{
+    int i;
+    if (with_id)
+        fprintf(result, "id,");
+    fprintf(result, "finished,status");
+    for (i = 0; i < DIM; i++)
+        fprintf(result, ",pos%i", i);
+    for (i = 0; i < DIM; i++)
+        fprintf(result, ",dir%i", i);
+    fprintf(result, "\n");
+}
+
+bool dispatcher_has_data(struct dispatcher_s *dispatcher)
+{
+    pthread_mutex_lock(&dispatcher->mutex);
+    bool has_data = dispatcher->num_returned > 0 || input_has_data(dispatcher);
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return has_data;
 }
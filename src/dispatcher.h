@@ -3,21 +3,101 @@
 #include <config.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include <pthread.h>
 
+#include <trajectory.h>
+#include <input.h>
+#include <telemetry.h>
+#include <checkpoint.h>
+
+/**
+ * Throughput of worker, used to size blocks
+ */
+struct dispatcher_worker_s {
+    struct timespec start;
+    double ray_steps;           // done by worker so far
+    double rate;                // ray steps per second
+    double finish_time;         // seconds since start when worker stopped
+};
+
+/**
+ * Unfinished ray given back by busy worker, to be taken by idle one
+ */
+struct returned_ray_s {
+    cl_int id;
+    cl_int finished;
+    real length;
+    real step;
+    real pos[DIM];
+    real dir[DIM];
+};
+
+/**
+ * Queue of rays for workers. Rays are taken from arrays of all rays, or
+ * read from input stream in streaming mode. Results are stored back to
+ * arrays, or written to result file at once in streaming mode.
+ *
+ * Blocks are sized by throughput of workers and shrink towards the end
+ * of input (guided scheduling). Idle workers wait for rays returned by
+ * busy ones.
+ */
 struct dispatcher_s {
     real *pos;
     real *dir;
     cl_int *finished;
-    FILE **output;
+    struct trajectory_s *output;    // NULL if trajectories are not stored
+    size_t stride;              // layout of pos and dir, see RAY_INDEX
     cl_uint num_objects;
     cl_uint num_completed;
-    cl_uint max_per_block;
+    cl_uint min_per_block;
     pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    struct dispatcher_worker_s *workers;
+    int num_workers;
+    int num_idle;
+
+    struct returned_ray_s *returned;
+    size_t num_returned;
+    size_t returned_capacity;
+
+    /* streaming mode */
+    struct ray_stream_s *stream;    // NULL if all rays are in arrays
+    pthread_mutex_t stream_mutex;   // reads of stream, taken before mutex
+    bool stream_has_data;           // state of stream after last read, under mutex
+    FILE *result;                   // results tagged with ray id
+    pthread_mutex_t result_mutex;
+
+    struct telemetry_s *telemetry;  // NULL if run is not instrumented
+    struct checkpoint_s *checkpoint;    // NULL if run is not checkpointed
+    struct timespec progress;       // last progress line of run without telemetry
 };
 
-void dispatcher_init(struct dispatcher_s *dispatcher, real *pos, real *dir, cl_int *finished, FILE **output, size_t num_objects);
-bool dispatcher_has_data(const struct dispatcher_s *dispatcher);
-size_t dispatcher_get_next_block(struct dispatcher_s *dispatcher, real **pos, real **dir, cl_int **finished, FILE ***output, int amount);
+void dispatcher_init(struct dispatcher_s *dispatcher, real *pos, real *dir, size_t stride, cl_int *finished, struct trajectory_s *output, size_t num_objects);
+void dispatcher_init_stream(struct dispatcher_s *dispatcher, struct ray_stream_s *stream, FILE *result, struct trajectory_s *output);
+void dispatcher_set_workers(struct dispatcher_s *dispatcher, int num_workers);
+bool dispatcher_has_data(struct dispatcher_s *dispatcher);
+size_t dispatcher_fetch(struct dispatcher_s *dispatcher, int worker, cl_int *ray_id,
+                        real *pos, real *dir, size_t stride, cl_int *finished,
+                        real *length, real *step, int amount);
+void dispatcher_store(struct dispatcher_s *dispatcher, const cl_int *ray_id, size_t first, size_t num,
+                      const real *pos, const real *dir, size_t stride, const cl_int *finished,
+                      const real *length);
+void dispatcher_save(struct dispatcher_s *dispatcher, const cl_int *ray_id, size_t num,
+                     const real *pos, const real *dir, size_t stride, const cl_int *finished,
+                     const real *length, const real *step);
+size_t dispatcher_resume(struct dispatcher_s *dispatcher, real T);
+int dispatcher_checkpoint(struct dispatcher_s *dispatcher);
+void dispatcher_report(struct dispatcher_s *dispatcher, int worker, double ray_steps);
+bool dispatcher_progress_due(struct dispatcher_s *dispatcher);
+bool dispatcher_wants_rays(struct dispatcher_s *dispatcher);
+void dispatcher_return(struct dispatcher_s *dispatcher, const cl_int *ray_id, size_t num,
+                       const real *pos, const real *dir, size_t stride, const cl_int *finished,
+                       const real *length, const real *step);
+bool dispatcher_wait_for_rays(struct dispatcher_s *dispatcher, int worker);
+void dispatcher_worker_done(struct dispatcher_s *dispatcher, int worker);
+void dispatcher_print_stats(const struct dispatcher_s *dispatcher);
+void write_result_header(FILE *result, bool with_id);
 void dispatcher_release(struct dispatcher_s *dispatcher);
@@ -3,150 +3,358 @@
 #include <math.h>
 #include <stdbool.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <config.h>
 #include <dispatcher.h>
-#include <opencl.h>
-#include <calc.h>
+#include <context.h>
+#include <input.h>
 
 #define SQR(x) ((x) * (x))
 
-const char *load_source(const char *fname)
+/**
+ * Print result of emission and save emitted rays
+ * @param valid number of valid rays, -1 if rays are not emitted
+ */
+static int report_emitted(int valid, const char *fname, const struct input_rays_s *rays, bool soa)
 {
-    FILE *f = fopen(fname, "rb");
-    if (f == NULL)
-    {
-        printf("Can not open file [%s]. Exiting.\n", fname);
-        exit(1);
-    }
-
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    if (valid < 0)
+        return -1;
 
-    char *source = malloc(fsize + 1);
-    fread(source, 1, fsize, f);
-    fclose(f);
-    source[fsize] = 0;
-
-    return source;
+    printf("Emitted %zu rays, %i valid\n", rays->num_objects, valid);
+    if (strcmp(fname, "-") != 0)
+        return save_rays(fname, rays, soa);
+    return 0;
 }
 
-int file_lines(FILE *f)
+/**
+ * Copy rays [0, num) of src to [first, first + num) of dst
+ */
+static void copy_rays(struct input_rays_s *dst, size_t first, const struct input_rays_s *src, size_t num, bool soa)
 {
-    int num_lines = 0;
-    fseek(f, 0, SEEK_SET);
-    while (!feof(f))
+    size_t src_stride = soa ? src->num_objects : 0;
+    size_t dst_stride = soa ? dst->num_objects : 0;
+    size_t i;
+    int j;
+    for (i = 0; i < num; i++)
     {
-        char c = fgetc(f);
-        if (c == '\n')
-            num_lines++;
+        for (j = 0; j < DIM; j++)
+        {
+            dst->pos[RAY_INDEX(first + i, j, dst_stride)] = src->pos[RAY_INDEX(i, j, src_stride)];
+            dst->dir[RAY_INDEX(first + i, j, dst_stride)] = src->dir[RAY_INDEX(i, j, src_stride)];
+        }
+        dst->finished[first + i] = src->finished[i];
     }
-    return num_lines;
 }
 
-size_t load_rays(const char *input_fname, real **pos, real **dir, cl_int **finished)
+/**
+ * Repeat rays for each scene, scene after scene
+ */
+static int repeat_rays(struct input_rays_s *rays, size_t num_scenes, bool soa)
 {
-    int i;
-    char line[1024];
-    FILE *input = fopen(input_fname, "rt");
-    int num_objects = file_lines(input) - 1;
-
-    *pos = malloc(sizeof(real) * DIM * num_objects);
-    *dir = malloc(sizeof(real) * DIM * num_objects);
-    *finished = malloc(sizeof(cl_int) * num_objects);
+    struct input_rays_s all;
+    size_t num = rays->num_objects;
+    size_t s;
+    if (alloc_rays(&all, num * num_scenes) != 0)
+        return -1;
+
+    for (s = 0; s < num_scenes; s++)
+        copy_rays(&all, s * num, rays, num, soa);
+    release_rays(rays);
+    *rays = all;
+    return 0;
+}
 
-    fseek(input, 0, SEEK_SET);
-    fgets(line, 1024, input);
-    for (i = 0; i < num_objects; i++)
+/**
+ * Emit rays of observer in each scene with its parameters of metric
+ * @param rays emitter->num rays for each scene, scene after scene
+ * @return number of valid rays, -1 if metric can not emit rays
+ */
+static int emit_scenes(struct context_s *context, const struct calculation_params_s *params,
+                       const struct emitter_params_s *emitter, struct input_rays_s *rays)
+{
+    struct calculation_params_s scene = *params;
+    struct input_rays_s scene_rays;
+    size_t s;
+    int valid = 0;
+
+    if (params->num_scenes <= 1)
+        return context_emit(context, params, emitter, rays->pos, rays->dir, rays->finished);
+
+    if (alloc_rays(&scene_rays, emitter->num) != 0)
+        return -1;
+    scene.num_scenes = 1;
+    scene.scene_rays = 0;
+    for (s = 0; s < params->num_scenes; s++)
     {
-        fgets(line, 1024, input);
-        double cpos[DIM];
-        double cdir[DIM];
-        sscanf(line, "%lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf", &cpos[0], &cpos[1], &cpos[2], &cpos[3], &cdir[0], &cdir[1], &cdir[2], &cdir[3]);
-        int j;
-        for (j = 0; j < DIM; j++)
+        scene.args = params->args + s * params->num_args;
+        int scene_valid = context_emit(context, &scene, emitter, scene_rays.pos, scene_rays.dir, scene_rays.finished);
+        if (scene_valid < 0)
         {
-            (*pos)[i * DIM + j] = cpos[j];
-            (*dir)[i * DIM + j] = cdir[j];
+            valid = -1;
+            break;
         }
+        valid += scene_valid;
+        copy_rays(rays, s * emitter->num, &scene_rays, emitter->num, params->soa);
     }
-    fclose(input);
-    for (i = 0; i < num_objects; i++)
-        (*finished)[i] = 0;
+    release_rays(&scene_rays);
+    return valid;
 }
 
-void worker_function(struct opencl_state_s *opencl_state,
-                     struct dispatcher_s *dispatcher,
-                     int platform_id,
-                     int device_id,
-                     real T, real h,
-                     real *args,
-                     size_t num_args,
-                     int num_steps)
+static void usage(void)
 {
-    while (dispatcher_has_data(dispatcher))
-    {
-        real *bpos, *bdir;
-        cl_int *bfinished;
-        FILE **boutput;
-
-        int amount = opencl_state->units[platform_id][device_id].max_parallel_points;
+    printf("Usage: geodesic2 [options] input.csv output.csv metric.cl args.csv <T> <h> <num steps> [trajectory.bin]\n");
+    printf("Options:\n");
+    printf("  --atol <value>    absolute tolerance, enables adaptive step\n");
+    printf("  --rtol <value>    relative tolerance, enables adaptive step\n");
+    printf("  --integrator <rk4|dp5|gl4|gl6>  integrator of fixed step mode: classic Runge-Kutta (default), 5th order\n");
+    printf("                             Dormand-Prince, implicit Gauss-Legendre of 4th or 6th order\n");
+    printf("  --precision <double|float|mixed>  precision of OpenCL program, mixed keeps rays in double\n");
+    printf("                             and evaluates metric in float\n");
+    printf("  --backend <opencl|cpu>     integrate with OpenCL devices or natively on CPU\n");
+    printf("  --threads <n>              number of threads of cpu backend\n");
+    printf("  --partition <numa|n>       split OpenCL cpu devices by NUMA node or into sub-devices of n compute units\n");
+    printf("  --soa                      structure of arrays layout of rays in memory\n");
+    printf("  --stream                   read rays in batches (input.csv can be - for stdin) and write results with ray id as they are ready\n");
+    printf("  --emit <t0,r0,fov,n>       emit n rays of observer at schwarzschild t0, r0 with fov in degrees instead of reading input.csv,\n");
+    printf("                             emitted rays are saved to input.csv unless it is -\n");
+    printf("  --stats <file>             write counters of workers every --stats-interval and at the end, csv or JSON lines (.json)\n");
+    printf("  --stats-interval <s>       interval of --stats records, 1 s by default\n");
+    printf("  --trace <file>             write kernels, transfers and host work of workers as Chrome trace\n");
+    printf("  --checkpoint <file>        write state of calculation to file every --checkpoint-interval and at the end\n");
+    printf("  --checkpoint-interval <s>  interval of checkpoints, 60 s by default\n");
+    printf("  --resume                   continue calculation from --checkpoint instead of reading input.csv\n");
+    printf("  --extend                   same as --resume, T can be larger than T of checkpoint\n");
+    printf("  --numeric-derivative       differentiate metric numerically even if it is written in dual numbers\n");
+    printf("  --table-r <min,max,n>      tabulate cristofel symbol over pos1\n");
+    printf("  --table-theta <min,max,n>  tabulate cristofel symbol over pos2, equatorial plane by default\n");
+}
 
-        size_t num_objects_in_block = dispatcher_get_next_block(dispatcher, &bpos, &bdir, &bfinished, &boutput, amount);
-        if (num_objects_in_block == 0)
+int main(int argc, char **argv)
+{
+    int i;
+    int ret = 0;
+
+    static const struct option long_options[] = {
+        {"atol", required_argument, NULL, 'a'},
+        {"rtol", required_argument, NULL, 'r'},
+        {"integrator", required_argument, NULL, 'i'},
+        {"precision", required_argument, NULL, 'p'},
+        {"table-r", required_argument, NULL, 'R'},
+        {"table-theta", required_argument, NULL, 'Q'},
+        {"backend", required_argument, NULL, 'B'},
+        {"threads", required_argument, NULL, 'j'},
+        {"numeric-derivative", no_argument, NULL, 'N'},
+        {"soa", no_argument, NULL, 'S'},
+        {"stream", no_argument, NULL, 's'},
+        {"partition", required_argument, NULL, 'P'},
+        {"emit", required_argument, NULL, 'E'},
+        {"stats", required_argument, NULL, 'T'},
+        {"stats-interval", required_argument, NULL, 'I'},
+        {"trace", required_argument, NULL, 'C'},
+        {"checkpoint", required_argument, NULL, 'K'},
+        {"checkpoint-interval", required_argument, NULL, 'k'},
+        {"resume", no_argument, NULL, 'U'},
+        {"extend", no_argument, NULL, 'X'},
+        {"help", no_argument,       NULL, 'H'},
+        {NULL,   0,                 NULL, 0},
+    };
+
+    struct calculation_params_s params = {
+        .soa = false,
+        .adaptive = false,
+        .atol = 1e-9,
+        .rtol = 1e-9,
+        .table = {
+            .nr = 0,
+            .ntheta = 1,
+            .theta_min = M_PI / 2,
+            .theta_max = M_PI / 2,
+        },
+    };
+
+    char build_options[1024] = "";
+    bool use_cpu = false;
+    bool stream = false;
+    bool emit = false;
+    struct emitter_params_s emitter;
+    int partition = PARTITION_NONE;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *stats_fname = NULL;
+    const char *trace_fname = NULL;
+    double stats_interval = 1;
+    const char *checkpoint_fname = NULL;
+    double checkpoint_interval = 60;
+    bool resume = false;
+    bool extend = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            params.atol = atof(optarg);
+            params.adaptive = true;
+            break;
+        case 'r':
+            params.rtol = atof(optarg);
+            params.adaptive = true;
+            break;
+        case 'i':
+            if (integrator_build_option(optarg) == NULL)
+            {
+                printf("Unknown integrator [%s]\n", optarg);
+                return 1;
+            }
+            params.integrator = optarg;
+            break;
+        case 'p':
+            if (precision_build_option(optarg) == NULL)
+            {
+                printf("Unknown precision [%s]\n", optarg);
+                return 1;
+            }
+            params.precision = optarg;
+            break;
+        case 'B':
+            if (!strcmp(optarg, "cpu"))
+            {
+                use_cpu = true;
+            }
+            else if (strcmp(optarg, "opencl"))
+            {
+                printf("Unknown backend [%s]\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1)
+                num_threads = 1;
+            break;
+        case 'N':
+            strcat(build_options, " -DNUMERIC_DERIVATIVE");
+            break;
+        case 's':
+            stream = true;
+            break;
+        case 'P':
+            if (!strcmp(optarg, "numa"))
+                partition = PARTITION_NUMA;
+            else if ((partition = atoi(optarg)) < 1)
+            {
+                printf("Invalid partition [%s]\n", optarg);
+                return 1;
+            }
+            break;
+        case 'E':
         {
+            double t0, r0, fov;
+            long n;
+            if (sscanf(optarg, "%lf,%lf,%lf,%li", &t0, &r0, &fov, &n) != 4 || n < 1)
+            {
+                printf("Invalid emitter [%s]\n", optarg);
+                return 1;
+            }
+            emitter.t = t0;
+            emitter.r = r0;
+            emitter.fov = fov * M_PI / 180;
+            emitter.num = n;
+            emitter.angles = NULL;
+            emit = true;
             break;
         }
+        case 'T':
+            stats_fname = optarg;
+            break;
+        case 'I':
+            stats_interval = atof(optarg);
+            break;
+        case 'C':
+            trace_fname = optarg;
+            break;
+        case 'K':
+            checkpoint_fname = optarg;
+            break;
+        case 'k':
+            checkpoint_interval = atof(optarg);
+            break;
+        case 'X':
+            extend = true;
+            /* fall through */
+        case 'U':
+            resume = true;
+            break;
+        case 'S':
+            params.soa = true;
+            strcat(build_options, " -DSOA_LAYOUT");
+            break;
+        case 'R':
+        case 'Q':
+        {
+            double vmin, vmax;
+            int n;
+            if (sscanf(optarg, "%lf,%lf,%i", &vmin, &vmax, &n) != 3 || n < (opt == 'R' ? 2 : 1))
+            {
+                printf("Invalid table range [%s]\n", optarg);
+                return 1;
+            }
+            if (opt == 'R')
+            {
+                params.table.r_min = vmin;
+                params.table.r_max = vmax;
+                params.table.nr = n;
+            }
+            else
+            {
+                params.table.theta_min = vmin;
+                params.table.theta_max = vmax;
+                params.table.ntheta = n;
+            }
+            break;
+        }
+        default:
+            usage();
+            return 1;
+        }
+    }
 
-        perform_calculation(&opencl_state->units[platform_id][device_id],
-                            T, h, bpos, bdir, bfinished, num_objects_in_block,
-                            args, num_args, boutput, num_steps);
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (emit && stream)
+    {
+        printf("Emitted rays can not be streamed\n");
+        return 1;
     }
-}
 
-struct worker_s
-{
-    struct opencl_state_s *opencl_state;
-    struct dispatcher_s *dispatcher;
-    int platform_id;
-    int device_id;
-    real T;
-    real h;
-    real *args;
-    size_t num_args;
-    int num_steps;
-};
+    if (use_cpu && params.table.nr > 0)
+    {
+        printf("Tabulated cristofel symbol is not supported by cpu backend\n");
+        return 1;
+    }
 
-void *worker_launcher(void *args)
-{
-    struct worker_s *worker = args;
-
-    worker_function(worker->opencl_state,
-                    worker->dispatcher,
-                    worker->platform_id,
-                    worker->device_id,
-                    worker->T,
-                    worker->h,
-                    worker->args,
-                    worker->num_args,
-                    worker->num_steps);
-    return NULL;
-}
+    if (resume && checkpoint_fname == NULL)
+    {
+        printf("Checkpoint file is required to resume calculation\n");
+        return 1;
+    }
 
-int main(int argc, const char **argv)
-{
-    int i;
+    if (checkpoint_fname != NULL && stream)
+    {
+        printf("Streamed rays can not be checkpointed\n");
+        return 1;
+    }
 
     if (argc < 8)
     {
-        printf("Usage: geodesic2 input.csv output.csv metric.cl args.csv <T> <h> <num steps>\n");
+        usage();
         return 1;
     }
 
-    char line[1024];
-    struct opencl_state_s opencl_state;
-
     // Simulation
     double T;
     double h;
@@ -164,145 +372,220 @@ int main(int argc, const char **argv)
     const char *metric_fname = argv[3];
     const char *args_fname = argv[4];
 
-    const char *out_dirname = NULL;
+    const char *trajectory_fname = NULL;
     if (argc >= 9)
     {
-        out_dirname = argv[8];
+        trajectory_fname = argv[8];
     }
 
-    /* Read arguments */
-    FILE *af = fopen(args_fname, "rt");
-    int num_args = file_lines(af) - 1;
+    if (resume && trajectory_fname != NULL)
+    {
+        printf("Trajectories can not be continued from checkpoint\n");
+        return 1;
+    }
 
-    real *args = malloc(sizeof(real) * num_args);
+    struct timespec load_start, load_end;
+    clock_gettime(CLOCK_MONOTONIC, &load_start);
 
-    fseek(af, 0, SEEK_SET);
-    fgets(line, 1024, af);
-    for (i = 0; i < num_args; i++)
+    /* Read arguments */
+    real *args;
+    size_t num_args;
+    size_t num_scenes;
+    if (load_args(args_fname, &args, &num_args, &num_scenes) != 0)
+        exit(1);
+
+    if (num_scenes > 1 && stream)
     {
-        double v;
-        fgets(line, 1024, af);
-        sscanf(line, "%lf", &v);
-        args[i] = v;
+        printf("Streamed rays can not be traced in several scenes\n");
+        return 1;
     }
-    fclose(af);
 
-    /* Read initial state */
-    real *pos, *dir;
-    cl_int *finished;
-    cl_int num_objects = load_rays(input_fname, &pos, &dir, &finished);
-    printf("Loaded %i objects\n", num_objects);
+    if (num_scenes > 1 && params.table.nr > 0)
+    {
+        printf("Cristofel symbol can not be tabulated for several scenes\n");
+        return 1;
+    }
 
-    /* Open output files */
-    FILE **output_rays = NULL;
-    if (out_dirname != NULL)
+    params.T = T;
+    params.h = h;
+    params.num_steps = num_steps;
+    params.args = args;
+    params.num_args = num_args;
+    params.num_scenes = num_scenes;
+
+    /* Read initial state, in streaming mode rays are read by dispatcher */
+    struct input_rays_s rays = {
+        .num_objects = 0,
+    };
+    struct ray_stream_s ray_stream;
+    struct checkpoint_s checkpoint;
+    FILE *result = NULL;
+    if (stream)
     {
-        output_rays = malloc(sizeof(FILE*)*num_objects);
-        for (i = 0; i < num_objects; i++)
+        if (open_ray_stream(input_fname, &ray_stream) != 0)
+            exit(1);
+        result = fopen(output_fname, "wt");
+        if (result == NULL)
         {
-            char fname[4096];
-            snprintf(fname, 4096, "%s/%05i.csv", out_dirname, i);
-            output_rays[i] = fopen(fname, "wt");
+            printf("Can not open file [%s]\n", output_fname);
+            exit(1);
         }
+        write_result_header(result, true);
+    }
+    else if (resume)
+    {
+        /* rays and their state are taken from checkpoint, they are not emitted again */
+        if (checkpoint_init(&checkpoint, checkpoint_fname, checkpoint_interval, &params, metric_fname, 0) != 0 ||
+            checkpoint_load(&checkpoint, &rays, params.soa, extend) != 0)
+            exit(1);
+        emit = false;
+        printf("Loaded %zu objects from checkpoint [%s]\n", rays.num_objects, checkpoint_fname);
+    }
+    else if (emit)
+    {
+        /* filled by backend before calculation */
+        if (alloc_rays(&rays, emitter.num * num_scenes) != 0)
+            exit(1);
     }
+    else
+    {
+        if (load_rays(input_fname, &rays, params.soa) != 0)
+            exit(1);
 
-    /* Init opencl platforms */
-    size_t global;
-    size_t local;
+        clock_gettime(CLOCK_MONOTONIC, &load_end);
+        printf("Loaded %i objects%s in %.3lf s\n", (int)rays.num_objects, rays.map ? " (mapped)" : "",
+               (load_end.tv_sec - load_start.tv_sec) + (load_end.tv_nsec - load_start.tv_nsec) * 1e-9);
 
-    const char *source_fname = BINROOT "/geodesic.cl";
-    const char *source = load_source(source_fname);
-    const char *metric = load_source(metric_fname);
-    char *kernel_source = malloc(strlen(source) + strlen(metric) + 3);
-    strcpy(kernel_source, source);
-    strcat(kernel_source, metric);
+        if (num_scenes > 1 && repeat_rays(&rays, num_scenes, params.soa) != 0)
+            exit(1);
+    }
 
-    init_opencl(&opencl_state);
-    init_opencl_program(&opencl_state, kernel_source);
+    /* rays of all scenes are in one calculation, each scene has the same rays */
+    if (num_scenes > 1)
+    {
+        params.scene_rays = rays.num_objects / num_scenes;
+        printf("%zu scenes of %zu rays\n", num_scenes, params.scene_rays);
+    }
 
-    int platform_id = -1;
-    int device_id = 0;
+    real *pos = rays.pos;
+    real *dir = rays.dir;
+    cl_int *finished = rays.finished;
+    cl_int num_objects = rays.num_objects;
+    size_t stride = params.soa ? num_objects : 0;
 
-    for (i = 0; i < opencl_state.num_platforms; i++)
+    if (checkpoint_fname != NULL && !resume &&
+        checkpoint_init(&checkpoint, checkpoint_fname, checkpoint_interval, &params, metric_fname, num_objects) != 0)
+        exit(1);
+
+    /* Open trajectory file */
+    struct trajectory_s trajectory;
+    struct trajectory_s *output_rays = NULL;
+    if (trajectory_fname != NULL)
+    {
+        if (trajectory_open(&trajectory, trajectory_fname, num_objects) != 0)
+            exit(1);
+        output_rays = &trajectory;
+    }
+
+    struct dispatcher_s dispatcher;
+    if (stream)
+        dispatcher_init_stream(&dispatcher, &ray_stream, result, output_rays);
+    else
+        dispatcher_init(&dispatcher, pos, dir, stride, finished, output_rays, num_objects);
+
+    if (checkpoint_fname != NULL)
     {
-        if (opencl_state.num_devices[i] > 0)
+        dispatcher.checkpoint = &checkpoint;
+        if (resume)
         {
-            platform_id = i;
-            device_id = 0;
-            break;
+            size_t continued = dispatcher_resume(&dispatcher, params.T);
+            printf("Continue %zu rays, %zu of %i rays were not started\n", continued,
+                   num_objects - checkpoint.cursor, (int)num_objects);
         }
     }
 
-    if (platform_id == -1)
+    /* instrumentation is opt-in, device timeline is measured only with it */
+    struct telemetry_s telemetry;
+    if (stats_fname != NULL || trace_fname != NULL)
     {
-        printf("No platform\n");
-        exit(0);
+        if (telemetry_open(&telemetry, stats_fname, trace_fname, stats_interval) != 0)
+            exit(1);
+        dispatcher.telemetry = &telemetry;
+        params.profiling = true;
     }
 
-    printf("Select platform %i, device %i\n", platform_id, device_id);
+    struct context_s context;
+    if (context_init(&context, metric_fname, use_cpu, num_threads, partition, build_options, &params) != 0)
+        return 1;
 
-    struct dispatcher_s dispatcher;
-    dispatcher_init(&dispatcher, pos, dir, finished, output_rays, num_objects);
+    if (emit && report_emitted(emit_scenes(&context, &params, &emitter, &rays),
+                               input_fname, &rays, params.soa) != 0)
+        return 1;
 
-    struct worker_s workers[MAX_DEVICES * MAX_PLATFORMS];
-    pthread_t threads[MAX_DEVICES * MAX_PLATFORMS];
-    size_t num_workers = 0;
+    context_calculate(&context, &params, &dispatcher);
+    /* finished run can be extended from final checkpoint */
+    if (dispatcher.checkpoint != NULL && dispatcher_checkpoint(&dispatcher) != 0)
+        return 1;
+    dispatcher_print_stats(&dispatcher);
+    context_print_stats(&context);
+    telemetry_summary(dispatcher.telemetry);
+    context_release(&context);
 
-    for (i = 0; i < opencl_state.num_platforms; i++)
+    if (stream)
     {
-        int j;
-        for (j = 0; j < opencl_state.num_devices[i]; j++)
+        printf("Streamed %lu objects\n", (unsigned long)dispatcher.num_completed);
+        if (ray_stream.failed)
         {
-            struct worker_s *worker = &workers[num_workers];
-            worker->opencl_state = &opencl_state;
-            worker->dispatcher = &dispatcher;
-            worker->platform_id = i;
-            worker->device_id = j;
-            worker->T = T;
-            worker->h = h;
-            worker->args = args;
-            worker->num_args = num_args;
-            worker->num_steps = num_steps;
-            num_workers++;
+            printf("Streaming was stopped by error in input\n");
+            ret = 1;
         }
+        close_ray_stream(&ray_stream);
+        fclose(result);
     }
-
-    for (i = 0; i < num_workers; i++)
-        pthread_create(&threads[i], NULL, worker_launcher, &workers[i]);
-    
-    for (i = 0; i < num_workers; i++)
-        pthread_join(threads[i], NULL);
-
-    release_opencl(&opencl_state);
-
-    FILE *output = fopen(output_fname, "wt");
-    fprintf(output, "finished");
-    for (i = 0; i < DIM; i++)
-        fprintf(output, ",pos%i", i);
-    for (i = 0; i < DIM; i++)
-        fprintf(output, ",dir%i", i);
-    fprintf(output, "\n");
-
-    for (i = 0; i < num_objects; i++)
+    else
     {
-        if (finished[i])
-            fprintf(output, "true");
+        FILE *output = fopen(output_fname, "wt");
+        if (output == NULL)
+        {
+            printf("Can not open file [%s]\n", output_fname);
+            ret = 1;
+        }
         else
-            fprintf(output, "false");
-        int j;
-        for (j = 0; j < DIM; j++)
-            fprintf(output, ",%lf", (double)pos[DIM * i + j]);
-        for (j = 0; j < DIM; j++)
-            fprintf(output, ",%lf", (double)dir[DIM * i + j]);
-        fprintf(output, "\n");
+        {
+            /* results are grouped by scene */
+            if (num_scenes > 1)
+                fprintf(output, "scene,");
+            write_result_header(output, false);
+        }
+
+        for (i = 0; output != NULL && i < num_objects; i++)
+        {
+            if (num_scenes > 1)
+                fprintf(output, "%zu,", i / params.scene_rays);
+            if (finished[i])
+                fprintf(output, "true");
+            else
+                fprintf(output, "false");
+            fprintf(output, ",%i", (int)finished[i]);
+            int j;
+            for (j = 0; j < DIM; j++)
+                fprintf(output, ",%lf", (double)pos[RAY_INDEX(i, j, stride)]);
+            for (j = 0; j < DIM; j++)
+                fprintf(output, ",%lf", (double)dir[RAY_INDEX(i, j, stride)]);
+            fprintf(output, "\n");
+        }
+        if (output != NULL)
+            fclose(output);
+        release_rays(&rays);
     }
 
     if (output_rays != NULL)
-    {
-        for (i = 0; i < num_objects; i++)
-            fclose(output_rays[i]);
-    }
-    fclose(output);
+        trajectory_close(output_rays);
+    if (dispatcher.telemetry != NULL)
+        telemetry_close(dispatcher.telemetry);
+    if (dispatcher.checkpoint != NULL)
+        checkpoint_release(dispatcher.checkpoint);
     dispatcher_release(&dispatcher);
-    return 0;
+    free(args);
+    return ret;
 }
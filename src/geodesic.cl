@@ -1,41 +1,102 @@
-#define DIM 4
+/* step of numeric derivative and tolerance of implicit stages depend on precision of real */
+#if defined(PRECISION_FLOAT) || defined(PRECISION_MIXED)
+#define diff_h 1e-3
+#define implicit_tol 1e-6
+#else
+#define diff_h 1e-6
+#define implicit_tol 1e-14
+#endif
 
-#define SQR(x) ((x)*(x))
+#define adaptive_safety   0.9
+#define adaptive_min_scale 0.2
+#define adaptive_max_scale 5.0
+#define adaptive_min_step 1e-12
 
-typedef double real;
+/*
+ * Integrator of fixed step mode is chosen when program is built:
+ * INTEGRATOR_DP5 - 5th order Dormand-Prince, 6 stages,
+ * INTEGRATOR_GL4, INTEGRATOR_GL6 - implicit Gauss-Legendre of 4th and 6th order,
+ * 2 and 3 stages, stages are found by fixed point iteration.
+ * Classic 4th order Runge-Kutta is used otherwise.
+ */
+#if defined(INTEGRATOR_DP5)
+#define INTEGRATOR_TABLEAU
+#define INTEGRATOR_STAGES 6
+#define integrator_a dp_a
+#define integrator_b dp_a[6]
+#elif defined(INTEGRATOR_GL4)
+#define INTEGRATOR_TABLEAU
+#define INTEGRATOR_IMPLICIT
+#define INTEGRATOR_STAGES 2
+__constant real integrator_a[2][2] = {
+    {0.25, 0.25 - 0.28867513459481288225},
+    {0.25 + 0.28867513459481288225, 0.25},
+};
+__constant real integrator_b[2] = {0.5, 0.5};
+#elif defined(INTEGRATOR_GL6)
+#define INTEGRATOR_TABLEAU
+#define INTEGRATOR_IMPLICIT
+#define INTEGRATOR_STAGES 3
+__constant real integrator_a[3][3] = {
+    {5.0/36, 2.0/9 - 0.25819888974716112568, 5.0/36 - 0.12909944487358056284},
+    {5.0/36 + 0.16137430609197570355, 2.0/9, 5.0/36 - 0.16137430609197570355},
+    {5.0/36 + 0.12909944487358056284, 2.0/9 + 0.25819888974716112568, 5.0/36},
+};
+__constant real integrator_b[3] = {5.0/18, 4.0/9, 5.0/18};
+#endif
 
-#define diff_h 1e-6
+/* fixed point iteration of implicit stages stops when relative change is below implicit_tol */
+#define implicit_max_iterations 50
 
-struct tensor_1
-{
-    bool covar[1];
-    real x[DIM];
-};
+/* index of i-th component of ray `id` in buffers of pos and dir, `stride` is argument of kernel */
+#ifdef SOA_LAYOUT
+#define RAY(id, i) ((i) * stride + (id))
+#else
+#define RAY(id, i) (DIM * (id) + (i))
+#endif
 
-struct tensor_2
+/* position or direction of ray between steps, in precision of buffers */
+struct state_1
 {
-    bool covar[2];
-    real x[DIM][DIM];
+    state_real x[DIM];
 };
 
-struct tensor_3
+/**
+ * Value of state for evaluation of metric and integrator stages
+ */
+void state_load(const struct state_1 *s, struct tensor_1 *t)
 {
-    bool covar[3];
-    real x[DIM][DIM][DIM];
-};
+    int i;
+    for (i = 0; i < DIM; i++)
+        t->x[i] = s->x[i];
+}
 
 /**
- * This functions must be added to code
+ * Take components which were changed in place, e.g. by limit_dir or stop_condition.
+ * Other components keep precision of state
  */
-struct tensor_2 metric_tensor(const struct tensor_1 *pos, __global const real *args);
-struct tensor_2 contravariant_metric_tensor(const struct tensor_2 *g);
+void state_sync(struct state_1 *s, const struct tensor_1 *t)
+{
+    int i;
+    for (i = 0; i < DIM; i++)
+    {
+        if (t->x[i] != (real)s->x[i])
+            s->x[i] = t->x[i];
+    }
+}
 
-bool allowed_area(const struct tensor_1 *pos, __global const real *args);
-bool allowed_delta(const struct tensor_1 *pos,
-                   const struct tensor_1 *dir,
-                   const struct tensor_1 *dpos,
-                   const struct tensor_1 *ddir,
-                   __global const real *args);
+/**
+ * Add delta of step to state in its precision and refresh value for evaluation
+ */
+void state_apply(struct state_1 *s, struct tensor_1 *t, const struct tensor_1 *delta)
+{
+    int i;
+    for (i = 0; i < DIM; i++)
+    {
+        s->x[i] += delta->x[i];
+        t->x[i] = s->x[i];
+    }
+}
 
 void limit_dir(struct tensor_1 *dir)
 {
@@ -58,26 +119,6 @@ void limit_dir(struct tensor_1 *dir)
     }
 }
 
-/**
- * Find contravariant metric tensor for diagonal case
- * It is just inverted matrix `g`
- * @param g metric tensor in covariant form
- * @return metric tensor in contravariant form
- */
-struct tensor_2 contravariant_metric_tensor_diagonal(const struct tensor_2 *g)
-{
-	struct tensor_2 ig = {
-        .covar = {false, false}
-    };
-
-    int i;
-
-    for (i = 0; i < DIM; i++)
-        ig.x[i][i] = 1/g->x[i][i];
-    
-    return ig;
-}
-
 /**
  * Find derivative of metric tensor
  * @param pos position
@@ -113,8 +154,73 @@ struct tensor_3 metric_derivative_num(const struct tensor_1 *pos, __global const
 	return dg;
 }
 
+#ifdef METRIC_TENSOR_DUAL
+
 /**
- * Numerically calculate cristofel symbol
+ * Evaluate metric written in dual numbers together with its derivative
+ * @param pos position
+ * @param args parameters of metric
+ * @param g metric tensor
+ * @param dg metric derivative
+ */
+void metric_derivative_dual(const struct tensor_1 *pos, __global const real *args,
+                            struct tensor_2 *g, struct tensor_3 *dg)
+{
+    int i, j, k;
+    struct dual_tensor_1 dpos = {
+        .covar = {false}
+    };
+
+    for (i = 0; i < DIM; i++)
+        dpos.x[i] = dual_var(pos->x[i], i);
+
+    struct dual_tensor_2 dualg = metric_tensor_dual(&dpos, args);
+
+    g->covar[0] = true;
+    g->covar[1] = true;
+    dg->covar[0] = true;
+    dg->covar[1] = true;
+    dg->covar[2] = true;
+    for (j = 0; j < DIM; j++)
+    for (k = 0; k < DIM; k++)
+    {
+        g->x[j][k] = dualg.x[j][k].v;
+        for (i = 0; i < DIM; i++)
+            dg->x[i][j][k] = dualg.x[j][k].d[i];
+    }
+}
+
+/**
+ * Metric tensor for metric written in dual numbers
+ * @param pos position
+ * @param args parameters of metric
+ * @return metric tensor
+ */
+struct tensor_2 metric_tensor(const struct tensor_1 *pos, __global const real *args)
+{
+    int i, j;
+    struct dual_tensor_1 dpos = {
+        .covar = {false}
+    };
+
+    for (i = 0; i < DIM; i++)
+        dpos.x[i] = dual_const(pos->x[i]);
+
+    struct dual_tensor_2 dualg = metric_tensor_dual(&dpos, args);
+    struct tensor_2 g = {
+        .covar = {true, true}
+    };
+    for (i = 0; i < DIM; i++)
+    for (j = 0; j < DIM; j++)
+        g.x[i][j] = dualg.x[i][j].v;
+    return g;
+}
+
+#endif
+
+/**
+ * Calculate cristofel symbol. Metric derivative is found exactly for metrics
+ * written in dual numbers and numerically otherwise
  * @param pos position
  * @param args parameters of metric
  * @return cristofel symbol
@@ -123,9 +229,15 @@ struct tensor_3 cristofel_symbol(const struct tensor_1 *pos, __global const real
 {
 	int i, m, k, l;
 
+#if defined(METRIC_TENSOR_DUAL) && !defined(NUMERIC_DERIVATIVE)
+	struct tensor_2 metric;
+	struct tensor_3 metric_derivative;
+	metric_derivative_dual(pos, args, &metric, &metric_derivative);
+#else
 	struct tensor_2 metric = metric_tensor(pos, args);
-	struct tensor_2 metric_contra = contravariant_metric_tensor(&metric);
 	struct tensor_3 metric_derivative = metric_derivative_num(pos, args);
+#endif
+	struct tensor_2 metric_contra = contravariant_metric_tensor(&metric);
 
 	struct tensor_3 G = {
         .covar = {false, true, true}
@@ -143,6 +255,172 @@ struct tensor_3 cristofel_symbol(const struct tensor_1 *pos, __global const real
 	return G;
 }
 
+/**
+ * Layout of tabulated cristofel symbol. Table starts with header,
+ * values of symbol at nodes follow it, `r` index changes fastest.
+ * Table is indexed by pos1 (`r`) and pos2 (`theta`), so it is suitable
+ * only for static spherically symmetric metrics. Such metric defines
+ * METRIC_STATIC_SPHERICAL, table kernels exist only for it
+ */
+#define TABLE_R_MIN     0
+#define TABLE_R_MAX     1
+#define TABLE_NR        2
+#define TABLE_THETA_MIN 3
+#define TABLE_THETA_MAX 4
+#define TABLE_NTHETA    5
+#define TABLE_HEADER    6
+#define TABLE_NODE      (DIM*DIM*DIM)
+
+/* allowed distance from the plane of table with single theta node */
+#define table_theta_eps 1e-6
+
+/**
+ * Find position of coordinate in table grid
+ * @param x coordinate
+ * @param xmin first node
+ * @param xmax last node
+ * @param n number of nodes
+ * @param index found cell
+ * @param w weight of the right node of cell
+ * @return is coordinate inside table
+ */
+bool cristofel_table_cell(real x, real xmin, real xmax, int n, int *index, real *w)
+{
+    if (n == 1)
+    {
+        *index = 0;
+        *w = 0;
+        return fabs(x - xmin) < table_theta_eps;
+    }
+
+    real f = (x - xmin) / (xmax - xmin) * (n - 1);
+    if (!(f >= 0 && f <= n - 1))
+        return false;
+
+    int i = (int)f;
+    if (i > n - 2)
+        i = n - 2;
+    *index = i;
+    *w = f - i;
+    return true;
+}
+
+/**
+ * Interpolate cristofel symbol from table
+ * @param pos position
+ * @param table tabulated symbol, can be NULL
+ * @param G interpolated symbol
+ * @return is position inside table
+ */
+bool cristofel_symbol_table(const struct tensor_1 *pos, __global const real *table, struct tensor_3 *G)
+{
+    if (!table)
+        return false;
+
+    int nr = (int)table[TABLE_NR];
+    int ntheta = (int)table[TABLE_NTHETA];
+
+    int ir, itheta;
+    real wr, wtheta;
+    if (!cristofel_table_cell(pos->x[1], table[TABLE_R_MIN], table[TABLE_R_MAX], nr, &ir, &wr))
+        return false;
+    if (!cristofel_table_cell(pos->x[2], table[TABLE_THETA_MIN], table[TABLE_THETA_MAX], ntheta, &itheta, &wtheta))
+        return false;
+
+    int dtheta = ntheta > 1 ? nr : 0;
+    __global const real *n00 = table + TABLE_HEADER + (itheta * nr + ir) * TABLE_NODE;
+    __global const real *n01 = n00 + TABLE_NODE;
+    __global const real *n10 = n00 + dtheta * TABLE_NODE;
+    __global const real *n11 = n10 + TABLE_NODE;
+
+    real w00 = (1 - wr) * (1 - wtheta);
+    real w01 = wr * (1 - wtheta);
+    real w10 = (1 - wr) * wtheta;
+    real w11 = wr * wtheta;
+
+    int i;
+    G->covar[0] = false;
+    G->covar[1] = true;
+    G->covar[2] = true;
+    for (i = 0; i < TABLE_NODE; i++)
+        (&G->x[0][0][0])[i] = w00 * n00[i] + w01 * n01[i] + w10 * n10[i] + w11 * n11[i];
+
+    return true;
+}
+
+#ifdef METRIC_STATIC_SPHERICAL
+
+/**
+ * Fill table of cristofel symbol. One work item per node.
+ * Header of table must be filled by host
+ * @param table table to fill
+ * @param args parameters of metric
+ */
+kernel void kernel_cristofel_table(__global real *table, __global const real *args)
+{
+    int id = get_global_id(0);
+    int nr = (int)table[TABLE_NR];
+    int ntheta = (int)table[TABLE_NTHETA];
+    int ir = id % nr;
+    int itheta = id / nr;
+
+    struct tensor_1 pos = {
+        .covar = {false},
+        .x = {0, 0, 0, 0},
+    };
+    pos.x[1] = table[TABLE_R_MIN] + (table[TABLE_R_MAX] - table[TABLE_R_MIN]) * ir / (nr - 1);
+    pos.x[2] = table[TABLE_THETA_MIN];
+    if (ntheta > 1)
+        pos.x[2] += (table[TABLE_THETA_MAX] - table[TABLE_THETA_MIN]) * itheta / (ntheta - 1);
+
+    struct tensor_3 G = cristofel_symbol(&pos, args);
+
+    int i;
+    __global real *node = table + TABLE_HEADER + id * TABLE_NODE;
+    for (i = 0; i < TABLE_NODE; i++)
+        node[i] = (&G.x[0][0][0])[i];
+}
+
+/**
+ * Estimate interpolation error of table in the middle of each cell.
+ * One work item per cell.
+ * @param table filled table
+ * @param args parameters of metric
+ * @param error error relative to the largest component of symbol
+ */
+kernel void kernel_cristofel_table_error(__global const real *table, __global const real *args, __global real *error)
+{
+    int id = get_global_id(0);
+    int nr = (int)table[TABLE_NR];
+    int ntheta = (int)table[TABLE_NTHETA];
+    int ir = id % (nr - 1);
+    int itheta = id / (nr - 1);
+
+    struct tensor_1 pos = {
+        .covar = {false},
+        .x = {0, 0, 0, 0},
+    };
+    pos.x[1] = table[TABLE_R_MIN] + (table[TABLE_R_MAX] - table[TABLE_R_MIN]) * (ir + 0.5) / (nr - 1);
+    pos.x[2] = table[TABLE_THETA_MIN];
+    if (ntheta > 1)
+        pos.x[2] += (table[TABLE_THETA_MAX] - table[TABLE_THETA_MIN]) * (itheta + 0.5) / (ntheta - 1);
+
+    struct tensor_3 G = cristofel_symbol(&pos, args);
+    struct tensor_3 Gt;
+    cristofel_symbol_table(&pos, table, &Gt);
+
+    int i;
+    real diff = 0, norm = 0;
+    for (i = 0; i < TABLE_NODE; i++)
+    {
+        diff = fmax(diff, fabs((&G.x[0][0][0])[i] - (&Gt.x[0][0][0])[i]));
+        norm = fmax(norm, fabs((&G.x[0][0][0])[i]));
+    }
+    error[id] = norm > 0 ? diff / norm : diff;
+}
+
+#endif
+
 /* End of space description */
 
 /**
@@ -175,29 +453,39 @@ struct tensor_1 geodesic_diff_G(const struct tensor_3* G, const struct tensor_1
  * @param pos current position
  * @param dir current direction
  * @param args parameters of metric
+ * @param table tabulated cristofel symbol, can be NULL
  * @return change of direction after moving along d
  */
-struct tensor_1 geodesic_diff(const struct tensor_1 *pos, const struct tensor_1 *dir, __global const real *args)
+struct tensor_1 geodesic_diff(const struct tensor_1 *pos, const struct tensor_1 *dir,
+                              __global const real *args, __global const real *table)
 {
-    struct tensor_3 G = cristofel_symbol(pos, args);
+    struct tensor_3 G;
+    if (!cristofel_symbol_table(pos, table, &G))
+        G = cristofel_symbol(pos, args);
     struct tensor_1 d = geodesic_diff_G(&G, dir);
     return d;
 }
 
+#ifndef INTEGRATOR_TABLEAU
 /**
- * Iteration step. New values of `p` and `d` will be stored in place.
+ * Iteration step. Change of `pos` and `dir` is stored to `delta_pos` and
+ * `delta_dir`, kernel adds it in precision of state.
  * Runge-Kutta method is used.
  *
  * @param pos current position
  * @param dir current direction
  * @param h iteration step
  * @param args parameters of metric
+ * @param table tabulated cristofel symbol, can be NULL
+ * @param delta_pos, delta_dir change of position and direction
  * @return can we continue this geodesic
  */
-bool geodesic_calculation_step(struct tensor_1 *pos, struct tensor_1 *dir, real h, __global const real *args)
+bool geodesic_calculation_step(const struct tensor_1 *pos, const struct tensor_1 *dir, real h,
+                               __global const real *args, __global const real *table,
+                               struct tensor_1 *delta_pos, struct tensor_1 *delta_dir)
 {
     int i;
-    struct tensor_1 dir_k1 = geodesic_diff(pos, dir, args);
+    struct tensor_1 dir_k1 = geodesic_diff(pos, dir, args, table);
     struct tensor_1 pos_k1 = *dir;
 
     struct tensor_1 pos_2 = *pos;
@@ -208,7 +496,7 @@ bool geodesic_calculation_step(struct tensor_1 *pos, struct tensor_1 *dir, real
         dir_2.x[i] += dir_k1.x[i] * h/2;
     }
 
-    struct tensor_1 dir_k2 = geodesic_diff(&pos_2, &dir_2, args);
+    struct tensor_1 dir_k2 = geodesic_diff(&pos_2, &dir_2, args, table);
     struct tensor_1 pos_k2 = dir_2;
 
     struct tensor_1 pos_3 = *pos;
@@ -219,7 +507,7 @@ bool geodesic_calculation_step(struct tensor_1 *pos, struct tensor_1 *dir, real
         dir_3.x[i] += dir_k2.x[i] * h/2;
     }
 
-    struct tensor_1 dir_k3 = geodesic_diff(&pos_3, &dir_3, args);
+    struct tensor_1 dir_k3 = geodesic_diff(&pos_3, &dir_3, args, table);
     struct tensor_1 pos_k3 = dir_3;
     
     struct tensor_1 pos_4 = *pos;
@@ -230,50 +518,277 @@ bool geodesic_calculation_step(struct tensor_1 *pos, struct tensor_1 *dir, real
         dir_4.x[i] += dir_k3.x[i] * h;
     }
 
-    struct tensor_1 dir_k4 = geodesic_diff(&pos_4, &dir_4, args);
+    struct tensor_1 dir_k4 = geodesic_diff(&pos_4, &dir_4, args, table);
     struct tensor_1 pos_k4 = dir_4;
 
-    struct tensor_1 delta_pos;
-    struct tensor_1 delta_dir;
+    for (i = 0; i < DIM; i++)
+    {
+        delta_pos->x[i] = (pos_k1.x[i] + pos_k2.x[i]*2 + pos_k3.x[i]*2 + pos_k4.x[i]) * h/6;
+        delta_dir->x[i] = (dir_k1.x[i] + dir_k2.x[i]*2 + dir_k3.x[i]*2 + dir_k4.x[i]) * h/6;
+        if (isnan(delta_pos->x[i]) || isinf(delta_pos->x[i]) || isnan(delta_dir->x[i]) || isinf(delta_dir->x[i]))
+            return false;
+    }
 
-    bool bad = false;
+    return allowed_delta(pos, dir, delta_pos, delta_dir, args);
+}
+#endif
 
-    for (i = 0; i < DIM; i++)
+/**
+ * Dormand-Prince 5(4) tableau. Row `s` holds coefficients of stage `s`,
+ * the last row is also the 5th order solution (FSAL property).
+ */
+__constant real dp_a[7][6] = {
+    {0, 0, 0, 0, 0, 0},
+    {1.0/5, 0, 0, 0, 0, 0},
+    {3.0/40, 9.0/40, 0, 0, 0, 0},
+    {44.0/45, -56.0/15, 32.0/9, 0, 0, 0},
+    {19372.0/6561, -25360.0/2187, 64448.0/6561, -212.0/729, 0, 0},
+    {9017.0/3168, -355.0/33, 46732.0/5247, 49.0/176, -5103.0/18656, 0},
+    {35.0/384, 0, 500.0/1113, 125.0/192, -2187.0/6784, 11.0/84},
+};
+
+/**
+ * Difference between 5th and 4th order solutions
+ */
+__constant real dp_e[7] = {
+    71.0/57600, 0, -71.0/16695, 71.0/1920, -17253.0/339200, 22.0/525, -1.0/40
+};
+
+/**
+ * Adaptive iteration step. Change of `pos` and `dir` is stored to `delta_pos`
+ * and `delta_dir`, kernel adds it in precision of state.
+ * Embedded Dormand-Prince 5(4) method is used, step is rejected and
+ * decreased until local error fits into tolerances.
+ *
+ * @param pos current position
+ * @param dir current direction
+ * @param h step to try, replaced by proposed next step
+ * @param done accepted step
+ * @param atol absolute tolerance
+ * @param rtol relative tolerance
+ * @param args parameters of metric
+ * @param table tabulated cristofel symbol, can be NULL
+ * @param delta_pos, delta_dir change of position and direction in accepted step
+ * @return can we continue this geodesic
+ */
+bool geodesic_adaptive_step(const struct tensor_1 *pos, const struct tensor_1 *dir,
+                            real *h, real *done,
+                            real atol, real rtol,
+                            __global const real *args, __global const real *table,
+                            struct tensor_1 *delta_pos, struct tensor_1 *delta_dir)
+{
+    int i, j, s;
+    struct tensor_1 pos_k[7];
+    struct tensor_1 dir_k[7];
+    real hc = *h;
+
+    while (true)
     {
-        delta_pos.x[i] = (pos_k1.x[i] + pos_k2.x[i]*2 + pos_k3.x[i]*2 + pos_k4.x[i]) * h/6;
-        delta_dir.x[i] = (dir_k1.x[i] + dir_k2.x[i]*2 + dir_k3.x[i]*2 + dir_k4.x[i]) * h/6;
-        if (isnan(delta_pos.x[i]) || isinf(delta_pos.x[i]) || isnan(delta_dir.x[i]) || isinf(delta_dir.x[i]))
+        struct tensor_1 pos_s, dir_s;
+        for (s = 0; s < 7; s++)
+        {
+            pos_s = *pos;
+            dir_s = *dir;
+            for (j = 0; j < s; j++)
+            for (i = 0; i < DIM; i++)
+            {
+                pos_s.x[i] += hc * dp_a[s][j] * pos_k[j].x[i];
+                dir_s.x[i] += hc * dp_a[s][j] * dir_k[j].x[i];
+            }
+            pos_k[s] = dir_s;
+            dir_k[s] = geodesic_diff(&pos_s, &dir_s, args, table);
+        }
+
+        /* pos_s, dir_s now contain 5th order solution */
+        real err = 0;
+        for (i = 0; i < DIM; i++)
+        {
+            real epos = 0, edir = 0;
+            for (s = 0; s < 7; s++)
+            {
+                epos += dp_e[s] * pos_k[s].x[i];
+                edir += dp_e[s] * dir_k[s].x[i];
+            }
+            epos = fabs(hc * epos) / (atol + rtol * fmax(fabs(pos->x[i]), fabs(pos_s.x[i])));
+            edir = fabs(hc * edir) / (atol + rtol * fmax(fabs(dir->x[i]), fabs(dir_s.x[i])));
+            err = fmax(err, fmax(epos, edir));
+        }
+
+        if (isnan(err) || isinf(err))
+        {
+            hc *= adaptive_min_scale;
+        }
+        else if (err > 1)
+        {
+            hc *= fmax(adaptive_min_scale, adaptive_safety * pow(err, -0.2));
+        }
+        else
+        {
+            /* 5th order solution as sum of stages, so it is not rounded to precision of pos */
+            for (i = 0; i < DIM; i++)
+            {
+                delta_pos->x[i] = 0;
+                delta_dir->x[i] = 0;
+                for (j = 0; j < 6; j++)
+                {
+                    delta_pos->x[i] += hc * dp_a[6][j] * pos_k[j].x[i];
+                    delta_dir->x[i] += hc * dp_a[6][j] * dir_k[j].x[i];
+                }
+            }
+
+            if (!allowed_delta(pos, dir, delta_pos, delta_dir, args))
+                return false;
+
+            *done = hc;
+            if (err > 0)
+                *h = hc * fmin(adaptive_max_scale, fmax(adaptive_min_scale, adaptive_safety * pow(err, -0.2)));
+            else
+                *h = hc * adaptive_max_scale;
+            return true;
+        }
+
+        if (hc < adaptive_min_step)
             return false;
     }
+}
 
-    if (!allowed_delta(pos, dir, &delta_pos, &delta_dir, args))
-        return false;
+#ifdef INTEGRATOR_TABLEAU
+/**
+ * Iteration step. Change of `pos` and `dir` is stored to `delta_pos` and
+ * `delta_dir`, kernel adds it in precision of state.
+ * Runge-Kutta method given by integrator_a, integrator_b is used,
+ * stages of implicit method are solved by fixed point iteration.
+ *
+ * @param pos current position
+ * @param dir current direction
+ * @param h iteration step
+ * @param args parameters of metric
+ * @param table tabulated cristofel symbol, can be NULL
+ * @param delta_pos, delta_dir change of position and direction
+ * @return can we continue this geodesic
+ */
+bool geodesic_calculation_step(const struct tensor_1 *pos, const struct tensor_1 *dir, real h,
+                               __global const real *args, __global const real *table,
+                               struct tensor_1 *delta_pos, struct tensor_1 *delta_dir)
+{
+    int i, j, s;
+    struct tensor_1 pos_k[INTEGRATOR_STAGES];
+    struct tensor_1 dir_k[INTEGRATOR_STAGES];
+
+#ifdef INTEGRATOR_IMPLICIT
+    /* initial guess: all stages at the start of step */
+    dir_k[0] = geodesic_diff(pos, dir, args, table);
+    for (s = 0; s < INTEGRATOR_STAGES; s++)
+    {
+        pos_k[s] = *dir;
+        dir_k[s] = dir_k[0];
+    }
+
+    int iteration;
+    for (iteration = 0; ; iteration++)
+    {
+        real change = 0;
+        for (s = 0; s < INTEGRATOR_STAGES; s++)
+        {
+            struct tensor_1 pos_s = *pos;
+            struct tensor_1 dir_s = *dir;
+            for (j = 0; j < INTEGRATOR_STAGES; j++)
+            for (i = 0; i < DIM; i++)
+            {
+                pos_s.x[i] += h * integrator_a[s][j] * pos_k[j].x[i];
+                dir_s.x[i] += h * integrator_a[s][j] * dir_k[j].x[i];
+            }
+            struct tensor_1 k = geodesic_diff(&pos_s, &dir_s, args, table);
+            for (i = 0; i < DIM; i++)
+            {
+                change = fmax(change, fabs(dir_s.x[i] - pos_k[s].x[i]) / (1 + fabs(dir_s.x[i])));
+                change = fmax(change, fabs(h * (k.x[i] - dir_k[s].x[i])) / (1 + fabs(dir_s.x[i])));
+            }
+            pos_k[s] = dir_s;
+            dir_k[s] = k;
+        }
+
+        if (isnan(change) || iteration == implicit_max_iterations)
+            return false;
+        if (change <= implicit_tol)
+            break;
+    }
+#else
+    for (s = 0; s < INTEGRATOR_STAGES; s++)
+    {
+        struct tensor_1 pos_s = *pos;
+        struct tensor_1 dir_s = *dir;
+        for (j = 0; j < s; j++)
+        for (i = 0; i < DIM; i++)
+        {
+            pos_s.x[i] += h * integrator_a[s][j] * pos_k[j].x[i];
+            dir_s.x[i] += h * integrator_a[s][j] * dir_k[j].x[i];
+        }
+        pos_k[s] = dir_s;
+        dir_k[s] = geodesic_diff(&pos_s, &dir_s, args, table);
+    }
+#endif
 
     for (i = 0; i < DIM; i++)
     {
-        pos->x[i] += delta_pos.x[i];
-        dir->x[i] += delta_dir.x[i];
+        delta_pos->x[i] = 0;
+        delta_dir->x[i] = 0;
+        for (s = 0; s < INTEGRATOR_STAGES; s++)
+        {
+            delta_pos->x[i] += integrator_b[s] * pos_k[s].x[i];
+            delta_dir->x[i] += integrator_b[s] * dir_k[s].x[i];
+        }
+        delta_pos->x[i] *= h;
+        delta_dir->x[i] *= h;
+        if (isnan(delta_pos->x[i]) || isinf(delta_pos->x[i]) || isnan(delta_dir->x[i]) || isinf(delta_dir->x[i]))
+            return false;
     }
 
-    return true;
+    return allowed_delta(pos, dir, delta_pos, delta_dir, args);
+}
+#endif
+
+/**
+ * Status of ray after successful step
+ * @return RAY_RUNNING if metric does not define stop_condition
+ */
+int ray_stop_status(struct tensor_1 *pos, struct tensor_1 *dir, __global const real *args)
+{
+#ifdef METRIC_STOP_CONDITION
+    return stop_condition(pos, dir, args);
+#else
+    return RAY_RUNNING;
+#endif
 }
 
 /**
  * Iteration step. New values of `p` and `d` will be stored in place.
- * Runge-Kutta method is used.
+ * Fixed step integrator chosen at build time is used.
  *
  * @param num amount of steps
+ * @param stride distance between components of ray in SOA_LAYOUT
  * @param pos current positions
  * @param dir current directions
  * @param finished status of each geodesic
+ * @param length integrated length of each geodesic
  * @param h iteration step
- * @param args parameters of metric
+ * @param T integration length
+ * @param scene_args parameters of metric of all scenes
+ * @param table tabulated cristofel symbol, can be NULL
+ * @param ray_id index of each geodesic in calculation
+ * @param scene_rays geodesics in each scene, 0 for one scene
+ * @param num_args parameters of metric in each scene
  */
-kernel void kernel_geodesic(int num, __global real *pos, __global real *dir, __global int *finished, real h, __global const real *args)
+kernel void kernel_geodesic(int num, int stride, __global state_real *pos, __global state_real *dir, __global int *finished,
+                            __global state_real *length, state_real h, state_real T,
+                            __global const real *scene_args, __global const real *table,
+                            __global const int *ray_id, int scene_rays, int num_args)
 {
     int id = get_global_id(0);
     int i, j;
+    __global const real *args = scene_args + (scene_rays > 0 ? ray_id[id] / scene_rays : 0) * num_args;
 
+    struct state_1 spos, sdir;
     struct tensor_1 cpos = {
         .covar = {false},
     };
@@ -281,40 +796,290 @@ kernel void kernel_geodesic(int num, __global real *pos, __global real *dir, __g
         .covar = {false},
     };
     
-    if (finished[id] == 1)
+    if (finished[id] != RAY_RUNNING)
+        return;
+
+    for (i = 0; i < DIM; i++)
+    {
+        spos.x[i] = pos[RAY(id, i)];
+        sdir.x[i] = dir[RAY(id, i)];
+    }
+    state_load(&spos, &cpos);
+    state_load(&sdir, &cdir);
+
+    state_real t = length[id];
+
+    bool bad_ray = false;
+	for (i = 0; i < num && t < T; i++)
+    {
+        if (!allowed_area(&cpos, args))
+        {
+            bad_ray = true;
+            finished[id] = RAY_STOPPED;
+            break;
+        }
+
+        limit_dir(&cdir);
+        state_sync(&sdir, &cdir);
+
+        struct tensor_1 delta_pos, delta_dir;
+    	if (!geodesic_calculation_step(&cpos, &cdir, h, args, table, &delta_pos, &delta_dir))
+        {
+            finished[id] = RAY_STOPPED;
+            break;
+        }
+        state_apply(&spos, &cpos, &delta_pos);
+        state_apply(&sdir, &cdir, &delta_dir);
+        t += h;
+
+        int status = ray_stop_status(&cpos, &cdir, args);
+        if (status != RAY_RUNNING)
+        {
+            state_sync(&spos, &cpos);
+            state_sync(&sdir, &cdir);
+            finished[id] = status;
+            break;
+        }
+    }
+
+    length[id] = t;
+
+    if (!bad_ray)
+    {
+        for (i = 0; i < DIM; i++)
+        {
+            pos[RAY(id, i)] = spos.x[i];
+            dir[RAY(id, i)] = sdir.x[i];
+        }
+    }
+}
+
+/**
+ * Adaptive iteration. Each geodesic has own step and own integrated length,
+ * it is iterated until `T` is reached.
+ *
+ * @param num amount of steps
+ * @param stride distance between components of ray in SOA_LAYOUT
+ * @param pos current positions
+ * @param dir current directions
+ * @param finished status of each geodesic
+ * @param length integrated length of each geodesic
+ * @param step current step of each geodesic
+ * @param T integration length
+ * @param atol absolute tolerance
+ * @param rtol relative tolerance
+ * @param scene_args parameters of metric of all scenes
+ * @param table tabulated cristofel symbol, can be NULL
+ * @param ray_id index of each geodesic in calculation
+ * @param scene_rays geodesics in each scene, 0 for one scene
+ * @param num_args parameters of metric in each scene
+ */
+kernel void kernel_geodesic_adaptive(int num, int stride, __global state_real *pos, __global state_real *dir, __global int *finished,
+                                     __global state_real *length, __global state_real *step,
+                                     state_real T, real atol, real rtol,
+                                     __global const real *scene_args, __global const real *table,
+                                     __global const int *ray_id, int scene_rays, int num_args)
+{
+    int id = get_global_id(0);
+    int i;
+    __global const real *args = scene_args + (scene_rays > 0 ? ray_id[id] / scene_rays : 0) * num_args;
+
+    struct state_1 spos, sdir;
+    struct tensor_1 cpos = {
+        .covar = {false},
+    };
+    struct tensor_1 cdir = {
+        .covar = {false},
+    };
+
+    if (finished[id] != RAY_RUNNING)
         return;
 
     for (i = 0; i < DIM; i++)
     {
-        cpos.x[i] = pos[DIM*id + i];
-        cdir.x[i] = dir[DIM*id + i];
+        spos.x[i] = pos[RAY(id, i)];
+        sdir.x[i] = dir[RAY(id, i)];
     }
+    state_load(&spos, &cpos);
+    state_load(&sdir, &cdir);
+
+    state_real t = length[id];
+    state_real h = step[id];
 
     bool bad_ray = false;
-	for (i = 0; i < num; i++)
+    for (i = 0; i < num && t < T; i++)
     {
         if (!allowed_area(&cpos, args))
         {
             bad_ray = true;
-            finished[id] = 1;
+            finished[id] = RAY_STOPPED;
             break;
         }
 
         limit_dir(&cdir);
+        state_sync(&sdir, &cdir);
+
+        real hc = fmin(h, T - t);
+        real done;
+        struct tensor_1 delta_pos, delta_dir;
+        if (!geodesic_adaptive_step(&cpos, &cdir, &hc, &done, atol, rtol, args, table, &delta_pos, &delta_dir))
+        {
+            finished[id] = RAY_STOPPED;
+            break;
+        }
+        state_apply(&spos, &cpos, &delta_pos);
+        state_apply(&sdir, &cdir, &delta_dir);
+        t += done;
+        /* do not let the final clamped step shrink the step of the geodesic */
+        if (t < T)
+            h = hc;
+        else
+            h = fmax(h, hc);
 
-    	if (!geodesic_calculation_step(&cpos, &cdir, h, args))
+        int status = ray_stop_status(&cpos, &cdir, args);
+        if (status != RAY_RUNNING)
         {
-            finished[id] = 1;
+            state_sync(&spos, &cpos);
+            state_sync(&sdir, &cdir);
+            finished[id] = status;
             break;
         }
     }
 
+    length[id] = t;
+    step[id] = h;
+
     if (!bad_ray)
     {
         for (i = 0; i < DIM; i++)
         {
-            pos[DIM*id + i] = cpos.x[i];
-            dir[DIM*id + i] = cdir.x[i];
+            pos[RAY(id, i)] = spos.x[i];
+            dir[RAY(id, i)] = sdir.x[i];
         }
     }
 }
+
+/**
+ * Stream compaction of rays after integration chunk. Geodesics which are
+ * not finished and have not reached `T` are moved to the beginning of
+ * output buffers in any order, others are moved to the end.
+ *
+ * @param num amount of rays
+ * @param stride distance between components of ray in SOA_LAYOUT, same for input and output
+ * @param T integration length
+ * @param pos, dir, finished, length, step, ray_id input rays
+ * @param out_pos, out_dir, out_finished, out_length, out_step, out_ray_id compacted rays
+ * @param count amount of live rays and amount of retired rays, must be zero before call
+ */
+kernel void kernel_compact(int num, int stride, state_real T,
+                           __global const state_real *pos, __global const state_real *dir, __global const int *finished,
+                           __global const state_real *length, __global const state_real *step, __global const int *ray_id,
+                           __global state_real *out_pos, __global state_real *out_dir, __global int *out_finished,
+                           __global state_real *out_length, __global state_real *out_step, __global int *out_ray_id,
+                           __global int *count)
+{
+    int id = get_global_id(0);
+    int i;
+
+    int dst;
+    if (finished[id] == 0 && length[id] < T)
+        dst = atomic_inc(&count[0]);
+    else
+        dst = num - 1 - atomic_inc(&count[1]);
+
+    for (i = 0; i < DIM; i++)
+    {
+        out_pos[RAY(dst, i)] = pos[RAY(id, i)];
+        out_dir[RAY(dst, i)] = dir[RAY(id, i)];
+    }
+    out_finished[dst] = finished[id];
+    out_length[dst] = length[id];
+    out_step[dst] = step[id];
+    out_ray_id[dst] = ray_id[id];
+}
+
+#ifdef METRIC_OBSERVER_POSITION
+
+/**
+ * Light ray emitted by observer in equatorial plane, as CommonCurvedSpace.emit_ray
+ * in py/metrics/common.py. Metric may have either signature, pos0 is time-like.
+ *
+ * @param t time of observer
+ * @param r radius of observer
+ * @param alpha angle between ray and direction to center
+ * @param pos position of ray
+ * @param dir null direction of ray, limited to 10 in each component
+ * @param args parameters of metric
+ * @return is ray valid
+ */
+bool emit_ray(real t, real r, real alpha, struct tensor_1 *pos, struct tensor_1 *dir,
+              __global const real *args)
+{
+    const real maxd = 10;
+    int i;
+
+    if (!observer_position(t, r, pos, args))
+        return false;
+
+    struct tensor_2 g = metric_tensor(pos, args);
+    if (g.x[0][0] * g.x[1][1] >= 0 || g.x[0][0] * g.x[3][3] >= 0)
+        return false;
+
+    real g00 = fabs(g.x[0][0]);
+    real g11 = fabs(g.x[1][1]);
+    real g33 = fabs(g.x[3][3]);
+
+    // dx3 / dx1 = tan(alpha), dx0 makes direction null
+    dir->covar[0] = false;
+    dir->x[1] = -cos(alpha) / sqrt(g11);
+    dir->x[2] = 0;
+    dir->x[3] = sin(alpha) / sqrt(g33);
+    dir->x[0] = -sqrt(dir->x[1] * dir->x[1] * g11 + dir->x[3] * dir->x[3] * g33) / sqrt(g00);
+
+    real md = 0;
+    for (i = 0; i < DIM; i++)
+        md = fmax(md, fabs(dir->x[i]));
+    if (md > maxd)
+    {
+        for (i = 0; i < DIM; i++)
+            dir->x[i] *= maxd / md;
+    }
+    return true;
+}
+
+/**
+ * Emit rays of observer with given angles, see emitter_angle.
+ * Invalid rays are finished.
+ *
+ * @param num amount of rays
+ * @param stride distance between components of ray in SOA_LAYOUT
+ * @param t time of observer
+ * @param r radius of observer
+ * @param angles angle of each ray to direction to center
+ * @param pos, dir, finished emitted rays
+ * @param args parameters of metric
+ */
+kernel void kernel_emit(int num, int stride, real t, real r, __global const real *angles,
+                        __global state_real *pos, __global state_real *dir, __global int *finished,
+                        __global const real *args)
+{
+    int id = get_global_id(0);
+    int i;
+
+    struct tensor_1 cpos = {
+        .covar = {false},
+    };
+    struct tensor_1 cdir = {
+        .covar = {false},
+    };
+
+    bool valid = emit_ray(t, r, angles[id], &cpos, &cdir, args);
+    for (i = 0; i < DIM; i++)
+    {
+        pos[RAY(id, i)] = valid ? cpos.x[i] : 0;
+        dir[RAY(id, i)] = valid ? cdir.x[i] : 0;
+    }
+    finished[id] = valid ? RAY_RUNNING : RAY_STOPPED;
+}
+
+#endif
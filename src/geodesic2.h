@@ -0,0 +1,42 @@
+#pragma once
+
+/*
+ * In-process interface of geodesic2, built as libgeodesic2.
+ *
+ * Context keeps backend alive between calculations: built OpenCL program
+ * and device buffers, or loaded native module of metric. Rays are passed
+ * in place as contiguous arrays: pos and dir of num * 4 doubles, ray after
+ * ray (or component after component with GEODESIC2_SOA), finished of num
+ * ints, 0 for rays to integrate.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GEODESIC2_SOA                   1   // arrays in structure of arrays layout
+#define GEODESIC2_NUMERIC_DERIVATIVE    2   // see --numeric-derivative
+#define GEODESIC2_BACKEND_CPU           4   // native cpu backend instead of OpenCL
+
+/* integrator of fixed step mode, classic Runge-Kutta if none is set, see --integrator */
+#define GEODESIC2_INTEGRATOR_DP5        8
+#define GEODESIC2_INTEGRATOR_GL4        16
+#define GEODESIC2_INTEGRATOR_GL6        24
+#define GEODESIC2_INTEGRATOR_MASK       24
+
+/* precision of OpenCL program, double if none is set, see --precision */
+#define GEODESIC2_PRECISION_FLOAT       32
+#define GEODESIC2_PRECISION_MIXED       64
+
+struct geodesic2_s;
+
+struct geodesic2_s *geodesic2_create(const char *metric_fname, const double *args, size_t num_args,
+                                     int flags, int num_threads);
+int geodesic2_set_args(struct geodesic2_s *ctx, const double *args, size_t num_args);
+int geodesic2_emit(struct geodesic2_s *ctx, double t0, double r0, double fov, size_t num,
+                   double *pos, double *dir, int32_t *finished);
+int geodesic2_emit_angles(struct geodesic2_s *ctx, double t0, double r0, const double *angles, size_t num,
+                          double *pos, double *dir, int32_t *finished);
+int geodesic2_calculate(struct geodesic2_s *ctx, double *pos, double *dir, int32_t *finished, size_t num,
+                        double T, double h, int num_steps, double atol, double rtol,
+                        const char *trajectory_fname);
+void geodesic2_release(struct geodesic2_s *ctx);
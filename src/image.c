@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include <png.h>
+
+#include <image.h>
+
+static bool is_png(const char *fname)
+{
+    const char *ext = strrchr(fname, '.');
+    return ext != NULL && !strcasecmp(ext, ".png");
+}
+
+int image_create(struct image_s *image, int width, int height)
+{
+    image->width = width;
+    image->height = height;
+    image->data = calloc((size_t)width * height * 3, sizeof(float));
+    if (image->data == NULL)
+    {
+        printf("Can not allocate image %ix%i\n", width, height);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Skip spaces and comments of PPM header
+ */
+static void ppm_skip(FILE *f)
+{
+    int c;
+    while ((c = fgetc(f)) != EOF)
+    {
+        if (c == '#')
+        {
+            while ((c = fgetc(f)) != EOF && c != '\n')
+                ;
+        }
+        else if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+        {
+            ungetc(c, f);
+            return;
+        }
+    }
+}
+
+/**
+ * Load binary PPM (P6), 8 or 16 bit
+ */
+static int load_ppm(const char *fname, struct image_s *image)
+{
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return -1;
+    }
+
+    char magic[3] = "";
+    int width, height, maxval;
+    bool ok = fread(magic, 1, 2, f) == 2 && !strcmp(magic, "P6");
+    ppm_skip(f);
+    ok = ok && fscanf(f, "%i", &width) == 1;
+    ppm_skip(f);
+    ok = ok && fscanf(f, "%i", &height) == 1;
+    ppm_skip(f);
+    ok = ok && fscanf(f, "%i", &maxval) == 1 && fgetc(f) != EOF;
+    if (!ok || width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535)
+    {
+        printf("[%s] is not binary PPM file\n", fname);
+        fclose(f);
+        return -1;
+    }
+
+    if (image_create(image, width, height) != 0)
+    {
+        fclose(f);
+        return -1;
+    }
+
+    size_t i, num = (size_t)width * height * 3;
+    int bytes = maxval > 255 ? 2 : 1;
+    unsigned char *row = malloc((size_t)width * 3 * bytes);
+    for (i = 0; i < num; i += (size_t)width * 3)
+    {
+        size_t k;
+        if (fread(row, bytes, (size_t)width * 3, f) != (size_t)width * 3)
+        {
+            printf("File [%s] is truncated\n", fname);
+            free(row);
+            image_release(image);
+            fclose(f);
+            return -1;
+        }
+        for (k = 0; k < (size_t)width * 3; k++)
+            image->data[i + k] = bytes == 2 ? (row[2 * k] << 8) | row[2 * k + 1] : row[k];
+    }
+    free(row);
+    fclose(f);
+    return 0;
+}
+
+static unsigned char to_byte(float v)
+{
+    v = v * 255 + 0.5f;
+    if (v < 0)
+        return 0;
+    if (v > 255)
+        return 255;
+    return (unsigned char)v;
+}
+
+static int save_ppm(const char *fname, const struct image_s *image)
+{
+    FILE *f = fopen(fname, "wb");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return -1;
+    }
+
+    fprintf(f, "P6\n%i %i\n255\n", image->width, image->height);
+    size_t i, num = (size_t)image->width * image->height * 3;
+    unsigned char *bytes = malloc(num);
+    for (i = 0; i < num; i++)
+        bytes[i] = to_byte(image->data[i]);
+    bool ok = fwrite(bytes, 1, num, f) == num;
+    free(bytes);
+    if (fclose(f) != 0 || !ok)
+    {
+        printf("Can not write file [%s]\n", fname);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_png(const char *fname, struct image_s *image)
+{
+    png_image png;
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&png, fname))
+    {
+        printf("Can not read PNG file [%s]: %s\n", fname, png.message);
+        return -1;
+    }
+
+    /* alpha and gray are converted to RGB */
+    png.format = PNG_FORMAT_RGB;
+    size_t num = PNG_IMAGE_SIZE(png);
+    png_bytep bytes = malloc(num);
+    if (!png_image_finish_read(&png, NULL, bytes, 0, NULL))
+    {
+        printf("Can not read PNG file [%s]: %s\n", fname, png.message);
+        free(bytes);
+        return -1;
+    }
+
+    if (image_create(image, png.width, png.height) != 0)
+    {
+        free(bytes);
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < num; i++)
+        image->data[i] = bytes[i];
+    free(bytes);
+    return 0;
+}
+
+static int save_png(const char *fname, const struct image_s *image)
+{
+    png_image png;
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    png.width = image->width;
+    png.height = image->height;
+    png.format = PNG_FORMAT_RGB;
+
+    size_t i, num = (size_t)image->width * image->height * 3;
+    png_bytep bytes = malloc(num);
+    for (i = 0; i < num; i++)
+        bytes[i] = to_byte(image->data[i]);
+
+    int res = png_image_write_to_file(&png, fname, 0, bytes, 0, NULL) ? 0 : -1;
+    if (res != 0)
+        printf("Can not write PNG file [%s]: %s\n", fname, png.message);
+    free(bytes);
+    return res;
+}
+
+/**
+ * Load PPM or PNG file, by extension of file name. Values are not scaled,
+ * see image_normalize
+ */
+int image_load(const char *fname, struct image_s *image)
+{
+    if (is_png(fname))
+        return load_png(fname, image);
+    return load_ppm(fname, image);
+}
+
+/**
+ * Save image with values from 0 to 1 as 8 bit PNG or PPM, by extension of file name
+ */
+int image_save(const char *fname, const struct image_s *image)
+{
+    if (is_png(fname))
+        return save_png(fname, image);
+    return save_ppm(fname, image);
+}
+
+/**
+ * Scale values, so maximum becomes 1
+ */
+void image_normalize(struct image_s *image)
+{
+    size_t i, num = (size_t)image->width * image->height * 3;
+    float vmax = 0;
+    for (i = 0; i < num; i++)
+        vmax = fmaxf(vmax, image->data[i]);
+    if (vmax <= 0)
+        return;
+    for (i = 0; i < num; i++)
+        image->data[i] /= vmax;
+}
+
+void image_release(struct image_s *image)
+{
+    free(image->data);
+    image->data = NULL;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * RGB image, 3 floats per pixel, rows from top to bottom
+ */
+struct image_s {
+    int width;
+    int height;
+    float *data;
+};
+
+int image_create(struct image_s *image, int width, int height);
+int image_load(const char *fname, struct image_s *image);
+int image_save(const char *fname, const struct image_s *image);
+void image_normalize(struct image_s *image);
+void image_release(struct image_s *image);
@@ -0,0 +1,506 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <input.h>
+
+/**
+ * Read whole file into zero terminated buffer
+ */
+static char *read_file(const char *fname, size_t *size)
+{
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *text = malloc(fsize + 1);
+    *size = fread(text, 1, fsize, f);
+    text[*size] = 0;
+    fclose(f);
+    return text;
+}
+
+/**
+ * Parse comma separated values of one line
+ * @return end of line, NULL if line has less values
+ */
+static char *parse_line(char *p, int columns, real *values)
+{
+    int i;
+    for (i = 0; i < columns; i++)
+    {
+        /* strtod skips new line too, value must be on this line */
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\n' || *p == '\r' || *p == 0)
+            return NULL;
+
+        char *end;
+        values[i] = strtod(p, &end);
+        if (end == p)
+            return NULL;
+        p = end;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == ',')
+            p++;
+    }
+
+    /* ignore rest of line */
+    while (*p != '\n' && *p != 0)
+        p++;
+    return p;
+}
+
+/**
+ * Parse csv file with header line in one pass
+ * @param columns number of values in each line
+ * @param values parsed values, line after line
+ * @return number of lines without header, -1 on error
+ */
+static long parse_csv(const char *fname, int columns, real **values)
+{
+    size_t size;
+    char *text = read_file(fname, &size);
+    if (text == NULL)
+        return -1;
+
+    size_t capacity = 1024;
+    size_t num = 0;
+    real *data = malloc(sizeof(real) * capacity * columns);
+
+    /* skip header */
+    char *p = strchr(text, '\n');
+    p = p ? p + 1 : text + size;
+
+    while (true)
+    {
+        while (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t')
+            p++;
+        if (*p == 0)
+            break;
+
+        if (num == capacity)
+        {
+            capacity *= 2;
+            data = realloc(data, sizeof(real) * capacity * columns);
+        }
+
+        p = parse_line(p, columns, &data[num * columns]);
+        if (p == NULL)
+        {
+            printf("Error in [%s], line %zu: expected %i values\n", fname, num + 2, columns);
+            free(data);
+            free(text);
+            return -1;
+        }
+        num++;
+    }
+
+    free(text);
+    *values = data;
+    return num;
+}
+
+/**
+ * Map binary file if it starts with magic
+ * @return mapping, NULL if file is not binary of this kind
+ */
+static void *map_binary(const char *fname, const char *magic, size_t *map_size)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    struct input_header_s header;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(header) ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, magic, sizeof(header.magic)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* private writable mapping, results do not go to file */
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    *map_size = st.st_size;
+    return map;
+}
+
+/**
+ * Check format of binary file and that its size holds header->num records
+ * @param record_size size of each record, 0 if size of file is not known
+ */
+static bool check_header(const char *fname, const struct input_header_s *header,
+                         size_t map_size, size_t record_size)
+{
+    if (header->version != INPUT_VERSION || header->dim != DIM || header->real_size != sizeof(real))
+    {
+        printf("Unsupported file [%s]: version %u, dim %u, real size %u\n",
+               fname, header->version, header->dim, header->real_size);
+        return false;
+    }
+    /* compared by division, so huge num in damaged header does not overflow */
+    if (record_size > 0 && header->num > (map_size - sizeof(*header)) / record_size)
+    {
+        printf("File [%s] is truncated\n", fname);
+        return false;
+    }
+    return true;
+}
+
+int load_rays(const char *fname, struct input_rays_s *rays, bool soa)
+{
+    size_t i;
+    int j;
+
+    rays->map = map_binary(fname, INPUT_RAYS_MAGIC, &rays->map_size);
+    if (rays->map != NULL)
+    {
+        const struct input_header_s *header = rays->map;
+        size_t num = header->num;
+        if (!check_header(fname, header, rays->map_size, sizeof(real) * DIM * 2))
+        {
+            munmap(rays->map, rays->map_size);
+            rays->map = NULL;
+            return -1;
+        }
+
+        real *pos = (real *)(header + 1);
+        real *dir = pos + num * DIM;
+        bool file_soa = header->layout == INPUT_LAYOUT_SOA;
+
+        rays->num_objects = num;
+        if (file_soa == soa)
+        {
+            rays->pos = pos;
+            rays->dir = dir;
+        }
+        else
+        {
+            /* layout differs, convert */
+            size_t src_stride = file_soa ? num : 0;
+            size_t dst_stride = soa ? num : 0;
+            rays->pos = malloc(sizeof(real) * DIM * num);
+            rays->dir = malloc(sizeof(real) * DIM * num);
+            for (i = 0; i < num; i++)
+            {
+                for (j = 0; j < DIM; j++)
+                {
+                    rays->pos[RAY_INDEX(i, j, dst_stride)] = pos[RAY_INDEX(i, j, src_stride)];
+                    rays->dir[RAY_INDEX(i, j, dst_stride)] = dir[RAY_INDEX(i, j, src_stride)];
+                }
+            }
+            munmap(rays->map, rays->map_size);
+            rays->map = NULL;
+        }
+    }
+    else
+    {
+        real *values;
+        long num = parse_csv(fname, 2 * DIM, &values);
+        if (num < 0)
+            return -1;
+
+        size_t stride = soa ? num : 0;
+        rays->num_objects = num;
+        rays->pos = malloc(sizeof(real) * DIM * num);
+        rays->dir = malloc(sizeof(real) * DIM * num);
+        for (i = 0; i < num; i++)
+        {
+            for (j = 0; j < DIM; j++)
+            {
+                rays->pos[RAY_INDEX(i, j, stride)] = values[i * 2 * DIM + j];
+                rays->dir[RAY_INDEX(i, j, stride)] = values[i * 2 * DIM + DIM + j];
+            }
+        }
+        free(values);
+    }
+
+    rays->finished = calloc(rays->num_objects, sizeof(cl_int));
+    return 0;
+}
+
+/**
+ * Allocate rays to be filled by caller, e.g. emitted by observer
+ */
+int alloc_rays(struct input_rays_s *rays, size_t num)
+{
+    rays->num_objects = num;
+    rays->map = NULL;
+    rays->pos = malloc(sizeof(real) * DIM * num);
+    rays->dir = malloc(sizeof(real) * DIM * num);
+    rays->finished = calloc(num, sizeof(cl_int));
+    if (rays->pos == NULL || rays->dir == NULL || rays->finished == NULL)
+    {
+        printf("Can not allocate %zu rays\n", num);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Save rays as csv file, which can be read back by load_rays
+ */
+int save_rays(const char *fname, const struct input_rays_s *rays, bool soa)
+{
+    size_t i;
+    int j;
+
+    FILE *f = fopen(fname, "wt");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return -1;
+    }
+
+    for (j = 0; j < DIM; j++)
+        fprintf(f, "pos%i,", j);
+    for (j = 0; j < DIM; j++)
+        fprintf(f, "dir%i%s", j, j < DIM - 1 ? "," : "\n");
+
+    size_t stride = soa ? rays->num_objects : 0;
+    for (i = 0; i < rays->num_objects; i++)
+    {
+        for (j = 0; j < DIM; j++)
+            fprintf(f, "%.17g,", (double)rays->pos[RAY_INDEX(i, j, stride)]);
+        for (j = 0; j < DIM; j++)
+            fprintf(f, "%.17g%s", (double)rays->dir[RAY_INDEX(i, j, stride)], j < DIM - 1 ? "," : "\n");
+    }
+    fclose(f);
+    return 0;
+}
+
+void release_rays(struct input_rays_s *rays)
+{
+    if (rays->map != NULL)
+    {
+        munmap(rays->map, rays->map_size);
+    }
+    else
+    {
+        free(rays->pos);
+        free(rays->dir);
+    }
+    free(rays->finished);
+}
+
+/**
+ * Number of comma separated fields in first line of file
+ */
+static int count_header_columns(const char *fname)
+{
+    FILE *f = fopen(fname, "rt");
+    if (f == NULL)
+        return 1;
+
+    int columns = 1;
+    int c;
+    while ((c = fgetc(f)) != EOF && c != '\n')
+        columns += c == ',';
+    fclose(f);
+    return columns;
+}
+
+/**
+ * Load parameters of metric. Csv file has parameter per line and scene per
+ * column, binary file has one scene
+ * @param args num_args parameters of each scene, scene after scene
+ */
+int load_args(const char *fname, real **args, size_t *num_args, size_t *num_scenes)
+{
+    size_t i, j;
+    size_t map_size;
+    void *map = map_binary(fname, INPUT_ARGS_MAGIC, &map_size);
+    if (map != NULL)
+    {
+        const struct input_header_s *header = map;
+        if (!check_header(fname, header, map_size, sizeof(real)))
+        {
+            munmap(map, map_size);
+            return -1;
+        }
+
+        *num_args = header->num;
+        *num_scenes = 1;
+        *args = malloc(sizeof(real) * header->num);
+        memcpy(*args, header + 1, sizeof(real) * header->num);
+        munmap(map, map_size);
+        return 0;
+    }
+
+    /* each column is a scene, parameters are stored scene after scene */
+    real *values;
+    int columns = count_header_columns(fname);
+    long num = parse_csv(fname, columns, &values);
+    if (num < 0)
+        return -1;
+
+    *num_args = num;
+    *num_scenes = columns;
+    *args = malloc(sizeof(real) * (num > 0 ? num * columns : 1));
+    for (i = 0; i < columns; i++)
+    {
+        for (j = 0; j < num; j++)
+            (*args)[i * num + j] = values[j * columns + i];
+    }
+    free(values);
+    return 0;
+}
+
+int open_ray_stream(const char *fname, struct ray_stream_s *stream)
+{
+    stream->dir_file = NULL;
+    stream->line = NULL;
+    stream->line_size = 0;
+    stream->num_read = 0;
+    stream->failed = false;
+
+    if (strcmp(fname, "-") == 0)
+    {
+        stream->file = stdin;
+        stream->binary = false;
+    }
+    else
+    {
+        stream->file = fopen(fname, "rb");
+        if (stream->file == NULL)
+        {
+            printf("Can not open file [%s]\n", fname);
+            return -1;
+        }
+
+        struct input_header_s header;
+        stream->binary = fread(&header, sizeof(header), 1, stream->file) == 1 &&
+                         memcmp(header.magic, INPUT_RAYS_MAGIC, sizeof(header.magic)) == 0;
+        if (stream->binary)
+        {
+            if (!check_header(fname, &header, (size_t)-1, 0))
+            {
+                fclose(stream->file);
+                return -1;
+            }
+            if (header.layout != INPUT_LAYOUT_AOS)
+            {
+                printf("Streaming of [%s] needs layout %i\n", fname, INPUT_LAYOUT_AOS);
+                fclose(stream->file);
+                return -1;
+            }
+
+            /* pos and dir are read with two file positions */
+            stream->num_total = header.num;
+            stream->dir_file = fopen(fname, "rb");
+            if (stream->dir_file == NULL ||
+                fseek(stream->dir_file, sizeof(header) + sizeof(real) * DIM * header.num, SEEK_SET) != 0)
+            {
+                printf("Can not open file [%s]\n", fname);
+                if (stream->dir_file != NULL)
+                    fclose(stream->dir_file);
+                fclose(stream->file);
+                return -1;
+            }
+            return 0;
+        }
+        fseek(stream->file, 0, SEEK_SET);
+    }
+
+    /* skip header of csv */
+    if (getline(&stream->line, &stream->line_size, stream->file) < 0)
+        stream->num_total = 0;
+    else
+        stream->num_total = (size_t)-1;
+    return 0;
+}
+
+size_t read_ray_stream(struct ray_stream_s *stream, real *pos, real *dir, size_t stride, size_t amount)
+{
+    size_t num = 0;
+    int j;
+
+    if (stream->binary)
+    {
+        real cpos[DIM], cdir[DIM];
+        while (num < amount && stream->num_read < stream->num_total &&
+               fread(cpos, sizeof(real), DIM, stream->file) == DIM &&
+               fread(cdir, sizeof(real), DIM, stream->dir_file) == DIM)
+        {
+            for (j = 0; j < DIM; j++)
+            {
+                pos[RAY_INDEX(num, j, stride)] = cpos[j];
+                dir[RAY_INDEX(num, j, stride)] = cdir[j];
+            }
+            num++;
+            stream->num_read++;
+        }
+        if (num < amount && stream->num_read < stream->num_total)
+        {
+            printf("Input is truncated after ray %zu of %zu\n", stream->num_read, stream->num_total);
+            stream->num_total = stream->num_read;
+            stream->failed = true;
+        }
+        return num;
+    }
+
+    while (num < amount && stream->num_read < stream->num_total)
+    {
+        if (getline(&stream->line, &stream->line_size, stream->file) < 0)
+        {
+            stream->num_total = stream->num_read;
+            break;
+        }
+
+        char *p = stream->line;
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            p++;
+        if (*p == '\n' || *p == 0)
+            continue;
+
+        real values[2 * DIM];
+        if (parse_line(p, 2 * DIM, values) == NULL)
+        {
+            /* ids of results are numbers of rays in input, so no ray can be skipped */
+            printf("Error in input, ray %zu: expected %i values\n", stream->num_read, 2 * DIM);
+            stream->num_total = stream->num_read;
+            stream->failed = true;
+            break;
+        }
+
+        for (j = 0; j < DIM; j++)
+        {
+            pos[RAY_INDEX(num, j, stride)] = values[j];
+            dir[RAY_INDEX(num, j, stride)] = values[DIM + j];
+        }
+        num++;
+        stream->num_read++;
+    }
+    return num;
+}
+
+bool ray_stream_has_data(const struct ray_stream_s *stream)
+{
+    return stream->num_read < stream->num_total;
+}
+
+void close_ray_stream(struct ray_stream_s *stream)
+{
+    if (stream->file != stdin)
+        fclose(stream->file);
+    if (stream->dir_file != NULL)
+        fclose(stream->dir_file);
+    free(stream->line);
+}
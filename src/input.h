@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <config.h>
+
+/*
+ * Binary file of rays or metric arguments. Header is followed by data:
+ * rays - pos array of num * DIM values, then dir array of the same size,
+ *        both in layout of header (see RAY_INDEX, stride is num for SoA)
+ * args - num values
+ */
+
+#define INPUT_RAYS_MAGIC "GEORAYS"
+#define INPUT_ARGS_MAGIC "GEOARGS"
+#define INPUT_VERSION 1
+
+#define INPUT_LAYOUT_AOS 0
+#define INPUT_LAYOUT_SOA 1
+
+struct input_header_s {
+    char magic[8];
+    cl_uint version;
+    cl_uint dim;
+    cl_uint real_size;
+    cl_uint layout;
+    cl_ulong num;
+};
+
+/**
+ * Loaded rays. When binary file has requested layout, pos and dir
+ * point into private mapping of file
+ */
+struct input_rays_s {
+    size_t num_objects;
+    real *pos;
+    real *dir;
+    cl_int *finished;
+
+    void *map;          // NULL if pos and dir are allocated
+    size_t map_size;
+};
+
+int load_rays(const char *fname, struct input_rays_s *rays, bool soa);
+int alloc_rays(struct input_rays_s *rays, size_t num);
+int save_rays(const char *fname, const struct input_rays_s *rays, bool soa);
+void release_rays(struct input_rays_s *rays);
+
+int load_args(const char *fname, real **args, size_t *num_args, size_t *num_scenes);
+
+/**
+ * Sequential reader of rays for streaming mode: csv file or stdin ("-"),
+ * or binary file in layout INPUT_LAYOUT_AOS
+ */
+struct ray_stream_s {
+    FILE *file;
+    FILE *dir_file;     // second position in binary file
+    bool binary;
+    size_t num_read;
+    size_t num_total;   // -1 while end of csv is not reached
+    bool failed;        // input is malformed or truncated, stream was stopped
+    char *line;
+    size_t line_size;
+};
+
+int open_ray_stream(const char *fname, struct ray_stream_s *stream);
+size_t read_ray_stream(struct ray_stream_s *stream, real *pos, real *dir, size_t stride, size_t amount);
+bool ray_stream_has_data(const struct ray_stream_s *stream);
+void close_ray_stream(struct ray_stream_s *stream);
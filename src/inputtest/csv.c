@@ -0,0 +1,127 @@
+/*
+ * Csv loader of rays and metric arguments (input.c). Well formed files
+ * are loaded with expected values, rows with missing values are rejected
+ * instead of taking values of the next row. Binary files whose header
+ * counts more rays than file holds are rejected. Returns 1 if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <input.h>
+
+static char fname[] = "/tmp/geodesic2_inputtest_XXXXXX";
+
+static void write_file(const char *text)
+{
+    FILE *f = fopen(fname, "wt");
+    fputs(text, f);
+    fclose(f);
+}
+
+static int check(const char *name, bool ok)
+{
+    printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+static int check_rays(const char *name, const char *text, long expected)
+{
+    struct input_rays_s rays;
+    write_file(text);
+    int res = load_rays(fname, &rays, false);
+    bool ok = expected < 0 ? res != 0 : res == 0 && rays.num_objects == expected;
+    if (res == 0)
+    {
+        /* second ray keeps its own values */
+        if (rays.num_objects > 1)
+            ok &= rays.pos[DIM] == 9 && rays.dir[2 * DIM - 1] == 16;
+        release_rays(&rays);
+    }
+    return check(name, ok);
+}
+
+static int check_args(const char *name, const char *text, long expected_args, size_t expected_scenes)
+{
+    real *args;
+    size_t num_args, num_scenes;
+    write_file(text);
+    int res = load_args(fname, &args, &num_args, &num_scenes);
+    bool ok = expected_args < 0 ? res != 0 : res == 0 && num_args == expected_args && num_scenes == expected_scenes;
+    if (res == 0)
+    {
+        /* scene after scene */
+        if (num_scenes == 2 && num_args == 2)
+            ok &= args[0] == 1 && args[1] == 3 && args[2] == 2 && args[3] == 4;
+        free(args);
+    }
+    return check(name, ok);
+}
+
+/**
+ * Binary file with one ray and header which counts num rays
+ */
+static int check_binary_rays(const char *name, cl_ulong num, bool expected)
+{
+    struct input_header_s header;
+    struct input_rays_s rays;
+    real values[2 * DIM] = {0};
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INPUT_RAYS_MAGIC, sizeof(header.magic));
+    header.version = INPUT_VERSION;
+    header.dim = DIM;
+    header.real_size = sizeof(real);
+    header.layout = INPUT_LAYOUT_AOS;
+    header.num = num;
+
+    FILE *f = fopen(fname, "wb");
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(values, sizeof(values), 1, f);
+    fclose(f);
+
+    int res = load_rays(fname, &rays, false);
+    if (res == 0)
+        release_rays(&rays);
+    return check(name, (res == 0) == expected);
+}
+
+int main(void)
+{
+    int failed = 0;
+    int fd = mkstemp(fname);
+    if (fd < 0)
+    {
+        printf("Can not create file [%s]\n", fname);
+        return 1;
+    }
+    close(fd);
+
+    static const char *header = "pos0,pos1,pos2,pos3,dir0,dir1,dir2,dir3\n";
+    char text[1024];
+
+    snprintf(text, sizeof(text), "%s1,2,3,4,5,6,7,8\n9,10,11,12,13,14,15,16\n", header);
+    failed |= check_rays("Rays", text, 2);
+
+    snprintf(text, sizeof(text), "%s1, 2 ,3,4,5,6,7,8\r\n\n9,10,11,12,13,14,15,16", header);
+    failed |= check_rays("Rays with spaces, CR and empty line", text, 2);
+
+    snprintf(text, sizeof(text), "%s1,2,3,4,5,6,7\n9,10,11,12,13,14,15,16\n17,18,19,20,21,22,23,24\n", header);
+    failed |= check_rays("Short row of rays", text, -1);
+
+    snprintf(text, sizeof(text), "%s1,2,3,4,5,6,7,\n9,10,11,12,13,14,15,16\n", header);
+    failed |= check_rays("Row of rays with empty value", text, -1);
+
+    failed |= check_binary_rays("Binary rays", 1, true);
+    failed |= check_binary_rays("Binary rays with too large count", 2, false);
+    failed |= check_binary_rays("Binary rays with overflowing count", (cl_ulong)-1 / sizeof(real), false);
+
+    failed |= check_args("Arguments", "rs\n1\n", 1, 1);
+    failed |= check_args("Arguments of two scenes", "a,b\n1,2\n3,4\n", 2, 2);
+    failed |= check_args("Short row of arguments", "a,b\n1\n3,4\n", -1, 0);
+
+    remove(fname);
+    return failed;
+}
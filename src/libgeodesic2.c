@@ -0,0 +1,169 @@
+/*
+ * Implementation of geodesic2.h over context of backend
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <config.h>
+#include <context.h>
+#include <geodesic2.h>
+
+struct geodesic2_s {
+    struct context_s context;
+    struct calculation_params_s params;
+};
+
+static void copy_args(struct geodesic2_s *ctx, const double *args, size_t num_args)
+{
+    free(ctx->params.args);
+    ctx->params.args = malloc(sizeof(real) * (num_args > 0 ? num_args : 1));
+    memcpy(ctx->params.args, args, sizeof(real) * num_args);
+    ctx->params.num_args = num_args;
+}
+
+/**
+ * Load metric and prepare backend
+ * @param metric_fname OpenCL file of metric, its native module for cpu backend is found as by geodesic2
+ * @param args parameters of metric
+ * @param flags GEODESIC2_* flags
+ * @param num_threads threads of cpu backend, 0 for number of cores
+ * @return context, NULL on error
+ */
+struct geodesic2_s *geodesic2_create(const char *metric_fname, const double *args, size_t num_args,
+                                     int flags, int num_threads)
+{
+    char build_options[1024] = "";
+    struct geodesic2_s *ctx = calloc(1, sizeof(*ctx));
+
+    ctx->params.soa = (flags & GEODESIC2_SOA) != 0;
+    switch (flags & GEODESIC2_INTEGRATOR_MASK)
+    {
+    case GEODESIC2_INTEGRATOR_DP5:
+        ctx->params.integrator = "dp5";
+        break;
+    case GEODESIC2_INTEGRATOR_GL4:
+        ctx->params.integrator = "gl4";
+        break;
+    case GEODESIC2_INTEGRATOR_GL6:
+        ctx->params.integrator = "gl6";
+        break;
+    }
+    if (flags & GEODESIC2_PRECISION_FLOAT)
+        ctx->params.precision = "float";
+    else if (flags & GEODESIC2_PRECISION_MIXED)
+        ctx->params.precision = "mixed";
+    ctx->params.table.nr = 0;
+    ctx->params.table.ntheta = 1;
+    ctx->params.table.theta_min = M_PI / 2;
+    ctx->params.table.theta_max = M_PI / 2;
+    copy_args(ctx, args, num_args);
+
+    if (flags & GEODESIC2_NUMERIC_DERIVATIVE)
+        strcat(build_options, " -DNUMERIC_DERIVATIVE");
+    if (flags & GEODESIC2_SOA)
+        strcat(build_options, " -DSOA_LAYOUT");
+    if (num_threads < 1)
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (context_init(&ctx->context, metric_fname, (flags & GEODESIC2_BACKEND_CPU) != 0,
+                     num_threads, PARTITION_NONE, build_options, &ctx->params) != 0)
+    {
+        geodesic2_release(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * Change parameters of metric for following calculations
+ */
+int geodesic2_set_args(struct geodesic2_s *ctx, const double *args, size_t num_args)
+{
+    copy_args(ctx, args, num_args);
+    context_set_args(&ctx->context, &ctx->params);
+    return 0;
+}
+
+/**
+ * Emit rays of observer, same as --emit
+ * @param fov field of view in degrees
+ * @return number of valid rays, -1 if metric can not emit rays
+ */
+int geodesic2_emit(struct geodesic2_s *ctx, double t0, double r0, double fov, size_t num,
+                   double *pos, double *dir, int32_t *finished)
+{
+    struct emitter_params_s emitter = {
+        .t = t0,
+        .r = r0,
+        .fov = fov * M_PI / 180,
+        .num = num,
+    };
+    return context_emit(&ctx->context, &ctx->params, &emitter, pos, dir, finished);
+}
+
+/**
+ * Emit rays of observer with given angles, for non-uniform sets of rays
+ * @param angles angle of each ray to direction to center in radians
+ * @return number of valid rays, -1 if metric can not emit rays
+ */
+int geodesic2_emit_angles(struct geodesic2_s *ctx, double t0, double r0, const double *angles, size_t num,
+                          double *pos, double *dir, int32_t *finished)
+{
+    struct emitter_params_s emitter = {
+        .t = t0,
+        .r = r0,
+        .num = num,
+        .angles = angles,
+    };
+    return context_emit(&ctx->context, &ctx->params, &emitter, pos, dir, finished);
+}
+
+/**
+ * Integrate rays in place
+ * @param atol, rtol tolerances of adaptive step, both 0 for fixed step h
+ * @param trajectory_fname file of trajectories, can be NULL
+ * @return 0 on success
+ */
+int geodesic2_calculate(struct geodesic2_s *ctx, double *pos, double *dir, int32_t *finished, size_t num,
+                        double T, double h, int num_steps, double atol, double rtol,
+                        const char *trajectory_fname)
+{
+    struct calculation_params_s *params = &ctx->params;
+    params->T = T;
+    params->h = h;
+    params->num_steps = num_steps;
+    params->adaptive = atol > 0 || rtol > 0;
+    params->atol = atol > 0 ? atol : 1e-9;
+    params->rtol = rtol > 0 ? rtol : 1e-9;
+
+    struct trajectory_s trajectory;
+    struct trajectory_s *output_rays = NULL;
+    if (trajectory_fname != NULL)
+    {
+        if (trajectory_open(&trajectory, trajectory_fname, num) != 0)
+            return -1;
+        output_rays = &trajectory;
+    }
+
+    struct dispatcher_s dispatcher;
+    dispatcher_init(&dispatcher, pos, dir, params->soa ? num : 0, finished, output_rays, num);
+    context_calculate(&ctx->context, params, &dispatcher);
+    dispatcher_release(&dispatcher);
+
+    if (output_rays != NULL)
+        trajectory_close(output_rays);
+    return 0;
+}
+
+void geodesic2_release(struct geodesic2_s *ctx)
+{
+    if (ctx == NULL)
+        return;
+    context_release(&ctx->context);
+    free(ctx->params.args);
+    free(ctx);
+}
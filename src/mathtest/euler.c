@@ -1,51 +1,150 @@
-#include <math.h>
+/*
+ * Accuracy and throughput of special functions of metrics (special.cl),
+ * compiled as C the same way as native CPU backend. Lambert W0, inverse
+ * of euler(x) = x exp(x), is checked against reference values and by round
+ * trip, and compared in speed with bisection it replaced. Returns 1 if any
+ * value is out of tolerance.
+ *
+ * Built twice, in double and with PRECISION_FLOAT.
+ */
+
 #include <stdio.h>
+#include <time.h>
+
+#include <cpu_compat.h>
+
+#include "space.cl"
+#include "special.cl"
+
+#define NUM_EVALUATIONS 1000000
 
-typedef double real;
+#if defined(PRECISION_FLOAT)
+#define TOLERANCE 1e-5
+#define MAX_ARGUMENT 1e30
+#define MAX_X 60
+#else
+#define TOLERANCE 1e-14
+#define MAX_ARGUMENT 1e300
+#define MAX_X 700
+#endif
 
-const real e = 2.71828;
+/* W0(y) found with 50 digits */
+static const double references[][2] = {
+    {-0.3678794, -0.99952696660756812626},
+    {-0.367,     -0.93239918474792848372},
+    {-0.3,       -0.48940222718021496904},
+    {-0.1,       -0.11183255915896296483},
+    {1e-10,      9.9999999990000000001e-11},
+    {0.5,        0.35173371124919582602},
+    {1,          0.56714329040978387300},
+    {10,         1.7455280027406993831},
+    {100,        3.3856301402900501849},
+    {1e5,        9.2845714286221089832},
+    {1e300,      684.24720862976084924},
+};
+
+#define NUM_REFERENCES (sizeof(references) / sizeof(references[0]))
 
 real euler(real x)
 {
     return x * exp(x);
 }
 
-real newton_iteration(real x, real y)
+/**
+ * Former W0 of kruskal.cl, bisection to 1e-8
+ */
+real W0_binary(real y)
 {
-    // x' = x - f(x) / f'(x)
-    // f(x) = euler(x) - y
-    // x' = x - (x*exp(x) - y) / ((x+1)*exp(x))
-    real expx = exp(x);
-    return x - (x*expx - y) / ((x+1)*expx);
+    real x1 = -1;
+    real x2 = 100000;
+
+    while (x2 - x1 > 1e-8)
+    {
+        real xv = (x1 + x2)/2;
+        if (xv == x1 || xv == x2)
+            break;
+        if (euler(xv) > y)
+            x2 = xv;
+        else
+            x1 = xv;
+    }
+    return (x1 + x2)/2;
 }
 
-real W0_newton(real y)
+/**
+ * Relative error of W0, scaled by condition number near branch point
+ */
+static double w0_error(double w, double expected)
 {
-    if (y <= -1)
-        return -1/e;
-    real x = 0;
-    real xn = x;
-    const real dx = 1e-8;
+    double scale = fmax(fabs(expected), 1e-300) / fmin(1, 1 + expected);
+    return fabs(w - expected) / scale;
+}
 
-    do
-    {
-        x = xn;
-        xn = newton_iteration(x, y);
-        if (xn <= -1)
-        {
-            xn = (xn+x)/2;
-        }
-    } while (fabs(x - xn) > dx);
+static double seconds_between(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) * 1e-9;
+}
 
-    return xn;
+/**
+ * Evaluations of function per second over arguments from -0.3 to 1e3
+ */
+static double throughput(real (*f)(real))
+{
+    struct timespec t0, t1;
+    volatile real sum = 0;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < NUM_EVALUATIONS; i++)
+        sum += f(-0.3 + 1000.3 * i / NUM_EVALUATIONS);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return NUM_EVALUATIONS / seconds_between(&t0, &t1);
 }
 
 int main(void)
 {
-	real x = -0.98;
-	real y = euler(x);
+    double max_error = 0;
+    int failed = 0;
+    size_t i;
+
+    printf("Precision: %s, tolerance %.1le\n", sizeof(real) == sizeof(float) ? "float" : "double", TOLERANCE);
+
+    for (i = 0; i < NUM_REFERENCES; i++)
+    {
+        if (references[i][0] > MAX_ARGUMENT)
+            continue;
+        double w = lambert_w0(references[i][0]);
+        double error = w0_error(w, references[i][1]);
+        if (error > TOLERANCE)
+        {
+            printf("W0(%.17le) = %.17le, expected %.17le\n", references[i][0], w, references[i][1]);
+            failed = 1;
+        }
+        max_error = fmax(max_error, error);
+    }
+    printf("Reference values: max error %.3le: %s\n", max_error, failed ? "FAILED" : "ok");
+
+    /* below branch point and at origin values are exact */
+    if (lambert_w0(-1) != -1 || lambert_w0(0) != 0)
+    {
+        printf("W0 at -1 or 0 is not exact: FAILED\n");
+        failed = 1;
+    }
+
+    /* W0(x exp(x)) = x */
+    max_error = 0;
+    for (i = 0; i <= 100000; i++)
+    {
+        real x = -0.999 + (MAX_X + 0.999) * i / 100000;
+        double error = w0_error(lambert_w0(euler(x)), x);
+        max_error = fmax(max_error, error);
+    }
+    printf("Round trip: max error %.3le: %s\n", max_error, max_error > TOLERANCE ? "FAILED" : "ok");
+    failed |= max_error > TOLERANCE;
+
+    double fast = throughput(lambert_w0);
+    double binary = throughput(W0_binary);
+    printf("Throughput: lambert_w0 %.3le/s, bisection %.3le/s, %.1lfx\n", fast, binary, fast / binary);
 
-	real x2 = W0_newton(y);
-	printf("x=%lf, y=%lf, x2=%lf\n", x, y, x2);
-	return 0;
+    return failed;
 }
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <numa_affinity.h>
+
+/**
+ * Number of NUMA nodes from /sys/devices/system/node, 1 if unknown
+ */
+int numa_num_nodes(void)
+{
+    int n = 0;
+    char fname[256];
+    while (true)
+    {
+        snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%i", n);
+        if (access(fname, F_OK) != 0)
+            break;
+        n++;
+    }
+    return n > 0 ? n : 1;
+}
+
+/**
+ * Parse cpu list of node, like "0-7,16-23"
+ */
+static bool node_cpus(int node, cpu_set_t *set)
+{
+    char fname[256];
+    char line[4096];
+    snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%i/cpulist", node);
+    FILE *f = fopen(fname, "rt");
+    if (f == NULL)
+        return false;
+
+    bool ok = fgets(line, sizeof(line), f) != NULL;
+    fclose(f);
+    if (!ok)
+        return false;
+
+    CPU_ZERO(set);
+    char *p = line;
+    while (*p >= '0' && *p <= '9')
+    {
+        int first = strtol(p, &p, 10);
+        int last = first;
+        if (*p == '-')
+            last = strtol(p + 1, &p, 10);
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+        if (*p == ',')
+            p++;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Number of cpus of node, 0 if unknown
+ */
+int numa_node_cpus(int node)
+{
+    cpu_set_t set;
+    if (node < 0 || !node_cpus(node, &set))
+        return 0;
+    return CPU_COUNT(&set);
+}
+
+/**
+ * Run current thread on cpus of node
+ * @return is thread bound
+ */
+bool numa_bind_thread(int node)
+{
+    cpu_set_t set;
+    if (node < 0 || !node_cpus(node, &set))
+        return false;
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/**
+ * Write each page of memory from current thread, so it is placed on node of thread
+ */
+void numa_first_touch(void *ptr, size_t size)
+{
+    memset(ptr, 0, size);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int numa_num_nodes(void);
+int numa_node_cpus(int node);
+bool numa_bind_thread(int node);
+void numa_first_touch(void *ptr, size_t size);
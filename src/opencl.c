@@ -1,8 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <config.h>
 
 #include <opencl.h>
+#include <numa_affinity.h>
 
 const char *opencl_error(int resv)
 {
@@ -26,20 +33,295 @@ const char *opencl_error(int resv)
     }
 }
 
-void init_opencl(struct opencl_state_s *state)
+/**
+ * Split cpu device into sub-devices
+ * @param partition PARTITION_NUMA or number of compute units in each sub-device
+ * @param sub_devices result
+ * @param max_sub_devices size of sub_devices
+ * @return number of sub-devices, 0 if device was not split
+ */
+static cl_uint partition_device(cl_device_id device, int partition,
+                                cl_device_id *sub_devices, cl_uint max_sub_devices)
 {
-    int i;
+    cl_device_type type;
+    cl_uint num = 0;
+    int err;
+
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    if (!(type & CL_DEVICE_TYPE_CPU))
+        return 0;
+
+    if (partition == PARTITION_NUMA)
+    {
+        const cl_device_partition_property props[] = {
+            CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+        };
+        err = clCreateSubDevices(device, props, max_sub_devices, sub_devices, &num);
+    }
+    else
+    {
+        const cl_device_partition_property props[] = {
+            CL_DEVICE_PARTITION_EQUALLY, partition, 0
+        };
+        err = clCreateSubDevices(device, props, max_sub_devices, sub_devices, &num);
+    }
+
+    if (err != CL_SUCCESS)
+    {
+        printf("Can not partition cpu device: %s\n", opencl_error(err));
+        return 0;
+    }
+    return num;
+}
+
+/**
+ * Do sub-devices by NUMA go in order of nodes. OpenCL does not tell node of
+ * sub-device, so order is trusted only if there is sub-device for each node
+ * and each has as many compute units as its node has cpus
+ */
+static bool numa_order_verified(const cl_device_id *sub_devices, cl_uint num_sub, int num_nodes)
+{
+    cl_uint k;
+    if (num_sub != (cl_uint)num_nodes)
+        return false;
+
+    for (k = 0; k < num_sub; k++)
+    {
+        cl_uint compute_units = 0;
+        clGetDeviceInfo(sub_devices[k], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+        if (compute_units != (cl_uint)numa_node_cpus(k))
+            return false;
+    }
+    return true;
+}
+
+void init_opencl(struct opencl_state_s *state, int partition)
+{
+    int i, j;
+    int num_nodes = numa_num_nodes();
     int err = clGetPlatformIDs(MAX_PLATFORMS, state->platform_ids, &state->num_platforms);
 
     printf("Number of platforms: %i\n", (int)state->num_platforms);
     for (i = 0; i < state->num_platforms && i < MAX_PLATFORMS; i++)
     {
-        err = clGetDeviceIDs(state->platform_ids[i], USE_DEVICE, MAX_DEVICES, state->device_ids[i], &state->num_devices[i]);
+        cl_device_id devices[MAX_DEVICES];
+        cl_uint num_devices;
+        err = clGetDeviceIDs(state->platform_ids[i], USE_DEVICE, MAX_DEVICES, devices, &num_devices);
+
+        state->num_devices[i] = 0;
+        for (j = 0; j < num_devices; j++)
+        {
+            cl_uint k, num_sub = 0;
+            cl_uint n = state->num_devices[i];
+            if (partition != PARTITION_NONE)
+                num_sub = partition_device(devices[j], partition, &state->device_ids[i][n], MAX_DEVICES - n);
+
+            if (num_sub == 0)
+            {
+                state->device_ids[i][n] = devices[j];
+                state->sub_device[i][n] = false;
+                state->numa_node[i][n] = -1;
+                state->num_devices[i]++;
+                continue;
+            }
+
+            /* cores of equal sub-devices are chosen by driver, they are not bound */
+            bool bind = partition == PARTITION_NUMA && numa_order_verified(&state->device_ids[i][n], num_sub, num_nodes);
+            for (k = 0; k < num_sub; k++)
+            {
+                state->sub_device[i][n + k] = true;
+                state->numa_node[i][n + k] = bind ? k : -1;
+            }
+            state->num_devices[i] += num_sub;
+            printf("Platform %i. Device %i split into %i sub-devices\n", i, j, (int)num_sub);
+            if (partition == PARTITION_NUMA && !bind)
+                printf("Platform %i. Sub-devices of device %i do not match NUMA nodes, workers are not bound\n", i, j);
+        }
         printf("Platform %i. Number of devices: %i\n", i, (int)state->num_devices[i]);
     }
 }
 
-void init_opencl_program(struct opencl_state_s *state, const char *source)
+/**
+ * FNV-1a hash of zero terminated string, continued from hash
+ */
+static cl_ulong hash_string(cl_ulong hash, const char *str)
+{
+    const unsigned char *p = (const unsigned char *)str;
+    while (*p)
+    {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    /* separator, so "ab" + "c" differs from "a" + "bc" */
+    hash ^= 0xff;
+    hash *= 0x100000001b3ULL;
+    return hash;
+}
+
+/**
+ * Directory of cached program binaries: GEODESIC2_CACHE_DIR,
+ * $XDG_CACHE_HOME/geodesic2 or ~/.cache/geodesic2
+ * @return false if cache is disabled (GEODESIC2_CACHE_DIR is empty)
+ */
+static bool cache_dir(char *dir, size_t size)
+{
+    const char *env = getenv("GEODESIC2_CACHE_DIR");
+    if (env != NULL)
+    {
+        snprintf(dir, size, "%s", env);
+        return env[0] != 0;
+    }
+
+    env = getenv("XDG_CACHE_HOME");
+    if (env != NULL && env[0] != 0)
+    {
+        snprintf(dir, size, "%s/geodesic2", env);
+        return true;
+    }
+
+    env = getenv("HOME");
+    if (env == NULL || env[0] == 0)
+        return false;
+    snprintf(dir, size, "%s/.cache/geodesic2", env);
+    return true;
+}
+
+/**
+ * Create directory with parents
+ */
+static bool make_dirs(const char *dir)
+{
+    char path[4096];
+    char *p;
+    snprintf(path, sizeof(path), "%s", dir);
+    for (p = path + 1; *p; p++)
+    {
+        if (*p != '/')
+            continue;
+        *p = 0;
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+            return false;
+        *p = '/';
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+/**
+ * Name of cache file for program built from source with options on device
+ * @return false if cache is disabled
+ */
+static bool cache_file_name(char *fname, size_t size, cl_device_id device_id,
+                            const char *source, const char *options)
+{
+    char dir[4096];
+    if (!cache_dir(dir, sizeof(dir)))
+        return false;
+
+    char device_name[1024] = "";
+    char driver_version[1024] = "";
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driver_version), driver_version, NULL);
+    device_name[sizeof(device_name) - 1] = 0;
+    driver_version[sizeof(driver_version) - 1] = 0;
+
+    cl_ulong hash = 0xcbf29ce484222325ULL;
+    hash = hash_string(hash, source);
+    hash = hash_string(hash, options);
+    hash = hash_string(hash, device_name);
+    hash = hash_string(hash, driver_version);
+
+    snprintf(fname, size, "%s/%016llx.bin", dir, (unsigned long long)hash);
+    return true;
+}
+
+/**
+ * Create program from cached binary
+ * @return NULL if there is no usable binary in cache
+ */
+static cl_program load_cached_program(cl_context context, cl_device_id device_id,
+                                      const char *fname, const char *options)
+{
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (fsize <= 0)
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    unsigned char *binary = malloc(fsize);
+    size_t size = fread(binary, 1, fsize, f);
+    fclose(f);
+
+    cl_int status, err;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &size,
+                                                   (const unsigned char **)&binary, &status, &err);
+    free(binary);
+    if (err != CL_SUCCESS || status != CL_SUCCESS)
+    {
+        if (program != NULL)
+            clReleaseProgram(program);
+        return NULL;
+    }
+
+    /* binary still has to be built for device, it does not compile source */
+    if (clBuildProgram(program, 1, &device_id, options, NULL, NULL) != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+/**
+ * Store binary of built program, file is renamed into place so
+ * concurrent runs never read partially written binary
+ */
+static void store_cached_program(cl_program program, const char *fname)
+{
+    size_t size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+        return;
+
+    unsigned char *binary = malloc(size);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) != CL_SUCCESS)
+    {
+        free(binary);
+        return;
+    }
+
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", fname);
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL)
+        *slash = 0;
+
+    char tmp_fname[4096];
+    snprintf(tmp_fname, sizeof(tmp_fname), "%s.%i.tmp", fname, (int)getpid());
+    FILE *f = (slash == NULL || make_dirs(dir)) ? fopen(tmp_fname, "wb") : NULL;
+    if (f == NULL)
+    {
+        printf("Can not write program cache [%s]\n", fname);
+        free(binary);
+        return;
+    }
+
+    bool ok = fwrite(binary, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_fname, fname) != 0)
+    {
+        printf("Can not write program cache [%s]\n", fname);
+        remove(tmp_fname);
+    }
+    free(binary);
+}
+
+void init_opencl_program(struct opencl_state_s *state, const char *source, const char *options)
 {
     int pid, did;
 
@@ -53,26 +335,61 @@ void init_opencl_program(struct opencl_state_s *state, const char *source)
             cl_device_id device_id = state->device_ids[pid][did];
             int err;
             unit->context = clCreateContext(0, 1, &device_id, NULL, NULL, &err);
-            unit->program = clCreateProgramWithSource(unit->context, 1, (const char **)&source, NULL, &err);
-            err = clBuildProgram(unit->program, 0, NULL, NULL, NULL, NULL);
 
-            size_t len;
-            char buffer[20480];
-            int resv = clGetProgramBuildInfo(unit->program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+            struct timespec build_start, build_end;
+            clock_gettime(CLOCK_MONOTONIC, &build_start);
 
-            printf("Get info: %s\n", opencl_error(resv));
-            printf("Log: %s\n", buffer);
+            char cache_fname[4096];
+            bool cache = cache_file_name(cache_fname, sizeof(cache_fname), device_id, source, options);
+            unit->program = cache ? load_cached_program(unit->context, device_id, cache_fname, options) : NULL;
+            bool cache_hit = unit->program != NULL;
 
-            if (err != CL_SUCCESS)
+            if (!cache_hit)
             {
-                printf("Error: Failed to build program executable!\n");
-                exit(1);
+                unit->program = clCreateProgramWithSource(unit->context, 1, (const char **)&source, NULL, &err);
+                err = clBuildProgram(unit->program, 0, NULL, options, NULL, NULL);
+
+                size_t len;
+                char buffer[20480];
+                int resv = clGetProgramBuildInfo(unit->program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+
+                printf("Get info: %s\n", opencl_error(resv));
+                printf("Log: %s\n", buffer);
+
+                if (err != CL_SUCCESS)
+                {
+                    printf("Error: Failed to build program executable!\n");
+                    exit(1);
+                }
+
+                if (cache)
+                    store_cached_program(unit->program, cache_fname);
             }
 
+            clock_gettime(CLOCK_MONOTONIC, &build_end);
+            double build_time = (build_end.tv_sec - build_start.tv_sec) + 1e-9 * (build_end.tv_nsec - build_start.tv_nsec);
+            if (cache)
+                printf("\tprogram cache %s [%s], build time %lf s\n", cache_hit ? "hit" : "miss", cache_fname, build_time);
+            else
+                printf("\tprogram cache disabled, build time %lf s\n", build_time);
+
             unit->kernel = clCreateKernel(unit->program, "kernel_geodesic", &err);
+            unit->kernel_adaptive = clCreateKernel(unit->program, "kernel_geodesic_adaptive", &err);
+            unit->kernel_compact = clCreateKernel(unit->program, "kernel_compact", &err);
             unit->queue = clCreateCommandQueue(unit->context, device_id, 0, &err);
 
-            unit->max_parallel_points = 1024;
+            unit->device = device_id;
+            unit->numa_node = state->numa_node[pid][did];
+            unit->cristofel_table = NULL;
+
+            /* enough work items to fill device, rays per compute unit */
+            cl_uint compute_units = 1;
+            clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+            unit->max_parallel_points = compute_units * 256;
+            if (unit->max_parallel_points < 1024)
+                unit->max_parallel_points = 1024;
+            if (unit->max_parallel_points > 65536)
+                unit->max_parallel_points = 65536;
         }
     }
 }
@@ -87,8 +404,14 @@ void release_opencl(struct opencl_state_s *state)
         {
             clReleaseProgram(state->units[i][j].program);
             clReleaseKernel(state->units[i][j].kernel);
+            clReleaseKernel(state->units[i][j].kernel_adaptive);
+            clReleaseKernel(state->units[i][j].kernel_compact);
+            if (state->units[i][j].cristofel_table != NULL)
+                clReleaseMemObject(state->units[i][j].cristofel_table);
             clReleaseContext(state->units[i][j].context);
             clReleaseCommandQueue(state->units[i][j].queue);
+            if (state->sub_device[i][j])
+                clReleaseDevice(state->device_ids[i][j]);
         }
     }
 }
@@ -1,14 +1,105 @@
 #pragma once
 
+#include <stdio.h>
+#include <stdbool.h>
 #include <config.h>
+#include <telemetry.h>
+
+#define NUM_SLOTS 2                     // blocks in flight on each device
+#define MAX_SLOT_EVENTS (6 * DIM + 12)  // commands between two waits of slot
+
+/* command of device timeline */
+enum event_kind_e {
+    EVENT_KERNEL,
+    EVENT_UPLOAD,
+    EVENT_READBACK,
+};
+
+/* readback of float state, converted to host after wait */
+struct slot_conversion_s {
+    real *host;
+    const cl_float *dev;
+    size_t num;
+};
+
+/**
+ * Set of rays processed on device. Each slot has own queue and own
+ * device buffers, so transfers of one slot overlap with kernels of another.
+ * After each chunk live rays are compacted to the beginning of buffers
+ * and free space is refilled with new rays from dispatcher.
+ */
+struct calculation_slot_s {
+    cl_command_queue queue;
+
+    /* device rays, kernel_compact copies from buffers `cur` to the others */
+    cl_mem pos_mem[2];
+    cl_mem dir_mem[2];
+    cl_mem finished_mem[2];
+    cl_mem length_mem[2];
+    cl_mem step_mem[2];
+    cl_mem ray_id_mem[2];
+    cl_mem count_mem;
+    int cur;
+
+    /* host copy of device rays, same layout */
+    size_t stride;
+    real *pos;
+    real *dir;
+    cl_int *finished;
+    real *length;
+    real *step;
+    cl_int *ray_id;             // index of ray in dispatcher
+    cl_int count[2];            // live and retired rays after compaction
+
+    /* staging arrays of device precision, NULL if device state is double */
+    cl_float *dev_pos;
+    cl_float *dev_dir;
+    cl_float *dev_length;
+    cl_float *dev_step;
+    struct slot_conversion_s conversions[MAX_SLOT_EVENTS];
+    int num_conversions;
+
+    cl_event events[MAX_SLOT_EVENTS];   // commands enqueued since last wait
+    enum event_kind_e event_kind[MAX_SLOT_EVENTS];
+    int num_events;
+
+    bool active;
+    size_t num_objects;         // rays on device
+    struct timespec saved;      // last save of live rays for checkpoint
+};
 
 struct calculation_unit_s {
     cl_context context;        // compute context
     cl_program program;        // compute program
     cl_kernel kernel;          // compute kernel
+    cl_kernel kernel_adaptive; // compute kernel with adaptive step
+    cl_kernel kernel_compact;  // compaction of live rays
     cl_command_queue queue;   // compute command queue
+    cl_device_id device;
+
+    cl_mem cristofel_table;    // tabulated cristofel symbol, NULL if not used
+    cl_mem args_mem;           // parameters of metric
+
+    /* precision of program, see PRECISION_FLOAT and PRECISION_MIXED */
+    size_t real_size;          // args, table and scalar arguments
+    size_t state_size;         // pos, dir, length and step of rays
+
+    struct calculation_slot_s slots[NUM_SLOTS];
 
     int max_parallel_points;
+    int numa_node;             // node of worker thread and host buffers, -1 if not bound
+
+    bool profiling;            // slot queues record timeline
+    struct telemetry_s *telemetry;  // of current calculation, can be NULL
+    int worker;                // index of unit in dispatcher
+
+    /* device timeline, ns */
+    cl_ulong kernel_time;
+    cl_ulong upload_time;
+    cl_ulong readback_time;
+    cl_ulong busy_time;
+    cl_ulong first_start;
+    cl_ulong last_end;
 };
 
 struct opencl_state_s
@@ -18,11 +109,16 @@ struct opencl_state_s
 
     cl_uint num_devices[MAX_PLATFORMS];
     cl_device_id device_ids[MAX_PLATFORMS][MAX_DEVICES];
+    bool sub_device[MAX_PLATFORMS][MAX_DEVICES];    // partition of cpu device, released with state
+    int numa_node[MAX_PLATFORMS][MAX_DEVICES];
 
     struct calculation_unit_s units[MAX_PLATFORMS][MAX_DEVICES];
 };
 
 const char *opencl_error(int resv);
-void init_opencl(struct opencl_state_s *state);
-void init_opencl_program(struct opencl_state_s *state, const char *source);
+#define PARTITION_NONE 0
+#define PARTITION_NUMA (-1)    // positive values are compute units in partition
+
+void init_opencl(struct opencl_state_s *state, int partition);
+void init_opencl_program(struct opencl_state_s *state, const char *source, const char *options);
 void release_opencl(struct opencl_state_s *state);
@@ -0,0 +1,542 @@
+/*
+ * Render image of sky seen by observer from table of deflection angles,
+ * native form of py/build_image.py
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <image.h>
+
+#define TILE_SIZE 64
+#define MAX_UNIVERSES 64
+
+/**
+ * Rays between two collided rays. Final angle is unwrapped, so it changes
+ * continuously over block
+ */
+struct deflection_block_s {
+    double begin;       // initial angle of first ray
+    double end;         // initial angle of last ray
+    int world;
+    size_t first;       // index of first ray in table
+    size_t num;
+};
+
+/**
+ * Table of initial angle to final angle, sorted by initial angle
+ */
+struct deflection_table_s {
+    double *init_angle;
+    double *final_angle;
+    struct deflection_block_s *blocks;
+    size_t num_blocks;
+};
+
+struct universe_s {
+    int world;
+    double phi;
+    struct image_s skymap;
+};
+
+struct render_s {
+    const struct deflection_table_s *table;
+    const struct universe_s *universes;
+    int num_universes;
+    double base_phi;
+    struct image_s *image;
+
+    pthread_mutex_t mutex;
+    int next_tile;
+    int num_tiles;
+};
+
+/**
+ * Find column with name in csv header
+ * @return index of column, -1 if there is no such column
+ */
+static int find_column(const char *header, const char *name)
+{
+    int column = 0;
+    const char *p = header;
+    size_t len = strlen(name);
+    while (true)
+    {
+        while (*p == ' ' || *p == '"')
+            p++;
+        if (!strncmp(p, name, len) && strchr(",\" \r\n", p[len]) != NULL)
+            return column;
+        p = strchr(p, ',');
+        if (p == NULL)
+            return -1;
+        p++;
+        column++;
+    }
+}
+
+static bool parse_bool(const char *p)
+{
+    while (*p == ' ')
+        p++;
+    return !strncasecmp(p, "true", 4) || atof(p) != 0;
+}
+
+/**
+ * Unwrap final angles of block by 2 pi, in direction in which most of them change
+ */
+static void normalize_block(double *angles, size_t num)
+{
+    size_t i;
+    size_t nrise = 0, nfall = 0;
+    for (i = 10; i < num; i++)
+    {
+        if (angles[i] > angles[i - 10])
+            nrise++;
+        else
+            nfall++;
+    }
+
+    bool rising = nrise > nfall;
+    for (i = 1; i < num; i++)
+    {
+        if (rising)
+        {
+            while (angles[i] < angles[i - 1])
+                angles[i] += 2 * M_PI;
+        }
+        else
+        {
+            while (angles[i] > angles[i - 1])
+                angles[i] -= 2 * M_PI;
+        }
+    }
+}
+
+/**
+ * Load angles.csv written by py/geodesic_rt.py: init_angle, final_angle,
+ * collided and world columns, rows sorted by init_angle
+ */
+static int load_deflection_table(const char *fname, struct deflection_table_s *table)
+{
+    FILE *f = fopen(fname, "rt");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    if (getline(&line, &line_size, f) < 0)
+    {
+        printf("File [%s] is empty\n", fname);
+        fclose(f);
+        return -1;
+    }
+
+    int col_init = find_column(line, "init_angle");
+    int col_final = find_column(line, "final_angle");
+    int col_collided = find_column(line, "collided");
+    int col_world = find_column(line, "world");
+    if (col_init < 0 || col_final < 0 || col_collided < 0)
+    {
+        printf("File [%s] needs init_angle, final_angle and collided columns\n", fname);
+        free(line);
+        fclose(f);
+        return -1;
+    }
+
+    size_t capacity = 1024, num = 0;
+    table->init_angle = malloc(sizeof(double) * capacity);
+    table->final_angle = malloc(sizeof(double) * capacity);
+    table->blocks = NULL;
+    table->num_blocks = 0;
+
+    size_t blocks_capacity = 0;
+    struct deflection_block_s block = {.num = 0};
+    bool eof = false;
+    while (!eof)
+    {
+        bool collided = true;
+        eof = getline(&line, &line_size, f) < 0;
+        if (!eof)
+        {
+            if (strspn(line, " \t\r\n") == strlen(line))
+                continue;
+
+            double init = 0, final = 0;
+            int world = 1, column = 0;
+            char *p = line;
+            while (p != NULL)
+            {
+                if (column == col_init)
+                    init = atof(p);
+                else if (column == col_final)
+                    final = atof(p);
+                else if (column == col_collided)
+                    collided = parse_bool(p);
+                else if (column == col_world)
+                    world = atoi(p);
+                p = strchr(p, ',');
+                if (p != NULL)
+                    p++;
+                column++;
+            }
+
+            if (!collided)
+            {
+                if (num == capacity)
+                {
+                    capacity *= 2;
+                    table->init_angle = realloc(table->init_angle, sizeof(double) * capacity);
+                    table->final_angle = realloc(table->final_angle, sizeof(double) * capacity);
+                }
+                if (block.num == 0)
+                {
+                    block.begin = init;
+                    block.first = num;
+                }
+                table->init_angle[num] = init;
+                table->final_angle[num] = final;
+                block.end = init;
+                block.world = world;
+                block.num++;
+                num++;
+            }
+        }
+
+        /* block ends with collided ray or end of file, single rays are dropped */
+        if (collided && block.num > 0)
+        {
+            if (block.num > 1)
+            {
+                normalize_block(&table->final_angle[block.first], block.num);
+                if (table->num_blocks == blocks_capacity)
+                {
+                    blocks_capacity = blocks_capacity ? 2 * blocks_capacity : 64;
+                    table->blocks = realloc(table->blocks, sizeof(block) * blocks_capacity);
+                }
+                table->blocks[table->num_blocks++] = block;
+            }
+            else
+            {
+                num = block.first;
+            }
+            block.num = 0;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+static void release_deflection_table(struct deflection_table_s *table)
+{
+    free(table->init_angle);
+    free(table->final_angle);
+    free(table->blocks);
+}
+
+/**
+ * Final angle of ray with initial angle, interpolated between rays of table.
+ * Blocks and rays inside of block are found by binary search, so rays need
+ * not be uniformly spaced
+ * @return false if ray collides
+ */
+static bool deflection_angle(const struct deflection_table_s *table, double angle,
+                             double *final_angle, int *world)
+{
+    /* last block, which begins before angle */
+    size_t lo = 0, hi = table->num_blocks;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (table->blocks[mid].begin <= angle)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return false;
+
+    const struct deflection_block_s *block = &table->blocks[lo - 1];
+    if (angle > block->end)
+        return false;
+
+    /* last ray of block before angle, not the last one */
+    const double *init = &table->init_angle[block->first];
+    const double *final = &table->final_angle[block->first];
+    lo = 0;
+    hi = block->num - 1;
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (init[mid] <= angle)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    double da = init[lo + 1] - init[lo];
+    double k = da > 0 ? (angle - init[lo]) / da : 0;
+    *final_angle = final[lo] * (1 - k) + final[lo + 1] * k;
+    *world = block->world;
+    return true;
+}
+
+/**
+ * Bilinear sample of skymap, wraps around by phi and clamps by theta
+ */
+static void sample_skymap(const struct image_s *skymap, double theta, double phi, float *color)
+{
+    int W = skymap->width;
+    int H = skymap->height;
+    int c;
+
+    phi = fmod(phi, 2 * M_PI);
+    if (phi < 0)
+        phi += 2 * M_PI;
+
+    double x = phi / (2 * M_PI) * W;
+    double y = theta / M_PI * H;
+    int xm = (int)floor(x);
+    int ym = (int)floor(y);
+    float fx = x - xm;
+    float fy = y - ym;
+
+    int xp = xm + 1;
+    int yp = ym + 1;
+    xm = ((xm % W) + W) % W;
+    xp = ((xp % W) + W) % W;
+    ym = ym < 0 ? 0 : (ym >= H ? H - 1 : ym);
+    yp = yp < 0 ? 0 : (yp >= H ? H - 1 : yp);
+
+    const float *imm = &skymap->data[((size_t)ym * W + xm) * 3];
+    const float *imp = &skymap->data[((size_t)ym * W + xp) * 3];
+    const float *ipm = &skymap->data[((size_t)yp * W + xm) * 3];
+    const float *ipp = &skymap->data[((size_t)yp * W + xp) * 3];
+
+    float wmm = (1 - fy) * (1 - fx);
+    float wmp = (1 - fy) * fx;
+    float wpm = fy * (1 - fx);
+    float wpp = fy * fx;
+    for (c = 0; c < 3; c++)
+        color[c] = imm[c] * wmm + imp[c] * wmp + ipm[c] * wpm + ipp[c] * wpp;
+}
+
+/**
+ * Color of pixel. Observer looks along e = (1, 0, 0), ray which leaves
+ * at angle to e comes from direction rotated by deflection in plane of ray and e
+ */
+static void render_pixel(const struct render_s *render, int X, int Y, float *color)
+{
+    int H = render->image->height;
+    int W = render->image->width;
+    int i;
+
+    double TH = (double)Y / H * M_PI;
+    double PHI = (double)X / W * 2 * M_PI + render->base_phi;
+    double vec[3] = {sin(TH) * cos(PHI), sin(TH) * sin(PHI), cos(TH)};
+
+    color[0] = color[1] = color[2] = 0;
+
+    double angle_initial = acos(vec[0]);
+    double angle_final;
+    int world;
+    if (!deflection_angle(render->table, angle_initial, &angle_final, &world))
+        return;
+
+    const struct universe_s *universe = NULL;
+    for (i = 0; i < render->num_universes; i++)
+    {
+        if (render->universes[i].world == world)
+            universe = &render->universes[i];
+    }
+    if (universe == NULL)
+        return;
+
+    /* n = vec x e, p = n x vec, rotation of vec around n by -da */
+    double da = angle_final - angle_initial;
+    double n[3] = {0, vec[2], -vec[1]};
+    double nn = sqrt(n[1] * n[1] + n[2] * n[2]);
+    double vv[3] = {vec[0], vec[1], vec[2]};
+    if (nn > 0)
+    {
+        n[1] /= nn;
+        n[2] /= nn;
+        double p[3] = {n[1] * vec[2] - n[2] * vec[1], n[2] * vec[0], -n[1] * vec[0]};
+        double pn = sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        double c = cos(-da), s = sin(-da) / pn;
+        for (i = 0; i < 3; i++)
+            vv[i] = vec[i] * c + p[i] * s;
+    }
+
+    double z = vv[2] > 1 ? 1 : (vv[2] < -1 ? -1 : vv[2]);
+    double theta = acos(z);
+    double phi = atan2(vv[1], vv[0]);
+    sample_skymap(&universe->skymap, theta, phi + universe->phi, color);
+}
+
+static void *render_function(void *args)
+{
+    struct render_s *render = args;
+    struct image_s *image = render->image;
+    int tiles_x = (image->width + TILE_SIZE - 1) / TILE_SIZE;
+
+    while (true)
+    {
+        pthread_mutex_lock(&render->mutex);
+        int tile = render->next_tile++;
+        pthread_mutex_unlock(&render->mutex);
+        if (tile >= render->num_tiles)
+            break;
+
+        int x0 = (tile % tiles_x) * TILE_SIZE;
+        int y0 = (tile / tiles_x) * TILE_SIZE;
+        int x, y;
+        for (y = y0; y < y0 + TILE_SIZE && y < image->height; y++)
+            for (x = x0; x < x0 + TILE_SIZE && x < image->width; x++)
+                render_pixel(render, x, y, &image->data[((size_t)y * image->width + x) * 3]);
+    }
+    return NULL;
+}
+
+static void usage(void)
+{
+    printf("Usage: geodesic2_render [options] angles.csv output.png|ppm\n");
+    printf("Options:\n");
+    printf("  --height <H>                 height of image, width is 2 H\n");
+    printf("  --orientation <degrees>      orientation of viewer\n");
+    printf("  --skymap <world,file,degrees>  skymap of world with its orientation, can be repeated\n");
+    printf("  --threads <n>                number of threads\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    static const struct option long_options[] = {
+        {"height", required_argument, NULL, 'h'},
+        {"orientation", required_argument, NULL, 'o'},
+        {"skymap", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 'j'},
+        {"help", no_argument,       NULL, 'H'},
+        {NULL,   0,                 NULL, 0},
+    };
+
+    struct universe_s universes[MAX_UNIVERSES];
+    int num_universes = 0;
+    int H = 700;
+    double orientation = 0;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            H = atoi(optarg);
+            if (H < 1)
+            {
+                printf("Invalid height [%s]\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            orientation = atof(optarg);
+            break;
+        case 'm':
+        {
+            /* file name is between first and last comma */
+            const char *first = strchr(optarg, ',');
+            const char *last = strrchr(optarg, ',');
+            if (first == NULL || last == first || num_universes == MAX_UNIVERSES)
+            {
+                printf("Invalid skymap [%s]\n", optarg);
+                return 1;
+            }
+
+            char fname[4096];
+            snprintf(fname, sizeof(fname), "%.*s", (int)(last - first - 1), first + 1);
+            struct universe_s *universe = &universes[num_universes];
+            universe->world = atoi(optarg);
+            universe->phi = atof(last + 1) * M_PI / 180;
+            if (image_load(fname, &universe->skymap) != 0)
+                return 1;
+            image_normalize(&universe->skymap);
+            num_universes++;
+            break;
+        }
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1)
+                num_threads = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 3)
+    {
+        usage();
+        return 0;
+    }
+
+    struct deflection_table_s table;
+    if (load_deflection_table(argv[1], &table) != 0)
+        return 1;
+    printf("Loaded %zu blocks of rays\n", table.num_blocks);
+
+    struct image_s image;
+    if (image_create(&image, 2 * H, H) != 0)
+        return 1;
+
+    struct render_s render = {
+        .table = &table,
+        .universes = universes,
+        .num_universes = num_universes,
+        .base_phi = orientation * M_PI / 180,
+        .image = &image,
+        .next_tile = 0,
+        .num_tiles = ((image.width + TILE_SIZE - 1) / TILE_SIZE) * ((image.height + TILE_SIZE - 1) / TILE_SIZE),
+    };
+    pthread_mutex_init(&render.mutex, NULL);
+
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    for (i = 0; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, render_function, &render);
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double render_time = (end_time.tv_sec - start_time.tv_sec) + 1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+    printf("Render time: %lf s\n", render_time);
+
+    int res = image_save(argv[2], &image) != 0;
+
+    pthread_mutex_destroy(&render.mutex);
+    free(threads);
+    image_release(&image);
+    for (i = 0; i < num_universes; i++)
+        image_release(&universes[i].skymap);
+    release_deflection_table(&table);
+    return res;
+}
@@ -0,0 +1,263 @@
+#define DIM 4
+
+#define SQR(x) ((x)*(x))
+
+/*
+ * Precision is chosen when program is built. PRECISION_FLOAT evaluates and
+ * stores everything in float. PRECISION_MIXED keeps rays and accumulates
+ * steps in double (state_real), while metric, cristofel symbol and stages
+ * of integrator are evaluated in float. Everything is double otherwise.
+ */
+#if defined(PRECISION_FLOAT)
+typedef float real;
+typedef float state_real;
+#elif defined(PRECISION_MIXED)
+typedef float real;
+typedef double state_real;
+#else
+typedef double real;
+typedef double state_real;
+#endif
+
+struct tensor_1
+{
+    bool covar[1];
+    real x[DIM];
+};
+
+struct tensor_2
+{
+    bool covar[2];
+    real x[DIM][DIM];
+};
+
+struct tensor_3
+{
+    bool covar[3];
+    real x[DIM][DIM][DIM];
+};
+
+/**
+ * Dual number: value and its derivatives by coordinates.
+ * Used for evaluation of metric together with its derivative
+ */
+struct dual
+{
+    real v;
+    real d[DIM];
+};
+
+struct dual_tensor_1
+{
+    bool covar[1];
+    struct dual x[DIM];
+};
+
+struct dual_tensor_2
+{
+    bool covar[2];
+    struct dual x[DIM][DIM];
+};
+
+/**
+ * Constant dual number
+ * @param v value
+ * @return dual number with zero derivatives
+ */
+struct dual dual_const(real v)
+{
+    struct dual r = {
+        .v = v,
+        .d = {0, 0, 0, 0},
+    };
+    return r;
+}
+
+/**
+ * Dual number for coordinate
+ * @param v value
+ * @param i index of coordinate
+ * @return dual number with unit derivative by i-th coordinate
+ */
+struct dual dual_var(real v, int i)
+{
+    struct dual r = dual_const(v);
+    r.d[i] = 1;
+    return r;
+}
+
+/**
+ * Apply function to dual number using chain rule
+ * @param a argument
+ * @param f value of function at a.v
+ * @param df derivative of function at a.v
+ * @return f(a)
+ */
+struct dual dual_chain(struct dual a, real f, real df)
+{
+    struct dual r;
+    int i;
+    r.v = f;
+    for (i = 0; i < DIM; i++)
+        r.d[i] = df * a.d[i];
+    return r;
+}
+
+struct dual dual_add(struct dual a, struct dual b)
+{
+    int i;
+    a.v += b.v;
+    for (i = 0; i < DIM; i++)
+        a.d[i] += b.d[i];
+    return a;
+}
+
+struct dual dual_sub(struct dual a, struct dual b)
+{
+    int i;
+    a.v -= b.v;
+    for (i = 0; i < DIM; i++)
+        a.d[i] -= b.d[i];
+    return a;
+}
+
+struct dual dual_mul(struct dual a, struct dual b)
+{
+    struct dual r;
+    int i;
+    r.v = a.v * b.v;
+    for (i = 0; i < DIM; i++)
+        r.d[i] = a.d[i] * b.v + a.v * b.d[i];
+    return r;
+}
+
+struct dual dual_div(struct dual a, struct dual b)
+{
+    struct dual r;
+    int i;
+    r.v = a.v / b.v;
+    for (i = 0; i < DIM; i++)
+        r.d[i] = (a.d[i] - r.v * b.d[i]) / b.v;
+    return r;
+}
+
+struct dual dual_add_real(struct dual a, real b)
+{
+    a.v += b;
+    return a;
+}
+
+struct dual dual_scale(struct dual a, real k)
+{
+    return dual_chain(a, a.v * k, k);
+}
+
+struct dual dual_neg(struct dual a)
+{
+    return dual_scale(a, -1);
+}
+
+struct dual dual_inv(struct dual a)
+{
+    return dual_chain(a, 1 / a.v, -1 / (a.v * a.v));
+}
+
+struct dual dual_sqr(struct dual a)
+{
+    return dual_chain(a, a.v * a.v, 2 * a.v);
+}
+
+struct dual dual_sqrt(struct dual a)
+{
+    real s = sqrt(a.v);
+    return dual_chain(a, s, 0.5 / s);
+}
+
+struct dual dual_powr(struct dual a, real p)
+{
+    real s = powr(a.v, p);
+    return dual_chain(a, s, p * s / a.v);
+}
+
+struct dual dual_exp(struct dual a)
+{
+    real s = exp(a.v);
+    return dual_chain(a, s, s);
+}
+
+struct dual dual_log(struct dual a)
+{
+    return dual_chain(a, log(a.v), 1 / a.v);
+}
+
+struct dual dual_sin(struct dual a)
+{
+    return dual_chain(a, sin(a.v), cos(a.v));
+}
+
+struct dual dual_cos(struct dual a)
+{
+    return dual_chain(a, cos(a.v), -sin(a.v));
+}
+
+/**
+ * This functions must be added to code.
+ *
+ * Metric can be written in dual numbers instead of `metric_tensor`,
+ * in this case metric file has to define METRIC_TENSOR_DUAL and
+ * `metric_tensor_dual`. Its derivative is then calculated exactly.
+ */
+struct tensor_2 metric_tensor(const struct tensor_1 *pos, __global const real *args);
+struct dual_tensor_2 metric_tensor_dual(const struct dual_tensor_1 *pos, __global const real *args);
+struct tensor_2 contravariant_metric_tensor(const struct tensor_2 *g);
+
+bool allowed_area(const struct tensor_1 *pos, __global const real *args);
+bool allowed_delta(const struct tensor_1 *pos,
+                   const struct tensor_1 *dir,
+                   const struct tensor_1 *dpos,
+                   const struct tensor_1 *ddir,
+                   __global const real *args);
+
+/**
+ * Optional. Metric which defines METRIC_OBSERVER_POSITION can emit rays
+ * of observer (see kernel_emit): position of observer at schwarzschild
+ * time t and radius r in equatorial plane, in coordinates of metric.
+ * Returns false if there is no such position.
+ */
+bool observer_position(real t, real r, struct tensor_1 *pos, __global const real *args);
+
+/*
+ * Status of ray in `finished` array
+ */
+#define RAY_RUNNING 0       // integration goes on
+#define RAY_STOPPED 1       // left allowed area, step failed or ray is invalid
+#define RAY_ESCAPED 2       // final direction is known, see stop_condition
+#define RAY_CAPTURED 3      // ray falls into black hole, see stop_condition
+
+/**
+ * Optional. Metric which defines METRIC_STOP_CONDITION can finish ray
+ * before `T` after each successful step: returns RAY_ESCAPED when final
+ * direction of ray is known (pos and dir can be replaced with their
+ * asymptotic values), RAY_CAPTURED when ray can not escape, or RAY_RUNNING.
+ */
+int stop_condition(struct tensor_1 *pos, struct tensor_1 *dir, __global const real *args);
+
+/**
+ * Find contravariant metric tensor for diagonal case
+ * It is just inverted matrix `g`
+ * @param g metric tensor in covariant form
+ * @return metric tensor in contravariant form
+ */
+struct tensor_2 contravariant_metric_tensor_diagonal(const struct tensor_2 *g)
+{
+	struct tensor_2 ig = {
+        .covar = {false, false}
+    };
+
+    int i;
+
+    for (i = 0; i < DIM; i++)
+        ig.x[i][i] = 1/g->x[i][i];
+    
+    return ig;
+}
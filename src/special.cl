@@ -0,0 +1,82 @@
+/*
+ * Special functions for metrics. Placed between space.cl and metric, so
+ * they are available to every metric file and to its native form
+ */
+
+#define SPECIAL_E 2.718281828459045
+
+/*
+ * Halley iteration converges cubically, so it stops when relative change
+ * of result is below cube root of precision of real: error of last step
+ * is then below precision
+ */
+#if defined(PRECISION_FLOAT) || defined(PRECISION_MIXED)
+#define SPECIAL_HALLEY_TOLERANCE 1e-3
+#else
+#define SPECIAL_HALLEY_TOLERANCE 1e-6
+#endif
+
+#define LAMBERT_W_MAX_ITERATIONS 8
+
+/**
+ * Initial approximation of W0, error is below 1e-2
+ * @param y argument, greater than -1/e
+ */
+real lambert_w0_guess(real y)
+{
+    if (y < -0.25)
+    {
+        // series at branch point, p = sqrt(2 (e y + 1))
+        real p = sqrt(2 * (SPECIAL_E * y + 1));
+        return -1 + p * (1 + p * (-1.0/3 + p * 11.0/72));
+    }
+    if (y < 3)
+    {
+        // Winitzki approximation
+        real l = log(1 + y);
+        return l * (1 - log(1 + l) / (2 + l));
+    }
+    // asymptotic expansion
+    real l1 = log(y);
+    real l2 = log(l1);
+    return l1 - l2 + l2 / l1;
+}
+
+/**
+ * Principal branch of Lambert W function, solution of w exp(w) = y, w >= -1.
+ * Initial approximation is refined by Halley iteration, usually 2 steps
+ * @param y argument, -1 is returned for y <= -1/e
+ */
+real lambert_w0(real y)
+{
+    if (y <= -1 / SPECIAL_E)
+        return -1;
+    if (y == 0)
+        return 0;
+
+    real w = lambert_w0_guess(y);
+    int i;
+    for (i = 0; i < LAMBERT_W_MAX_ITERATIONS; i++)
+    {
+        // f = w exp(w) - y, f' = exp(w) (w + 1), f'' = exp(w) (w + 2)
+        real ew = exp(w);
+        real f = w * ew - y;
+        real w1 = w + 1;
+        if (w1 <= 0)
+            return -1;
+        real dw = f / (ew * w1 - (w + 2) * f / (2 * w1));
+        w -= dw;
+        if (fabs(dw) <= SPECIAL_HALLEY_TOLERANCE * (1 + fabs(w)))
+            break;
+    }
+    return w;
+}
+
+/**
+ * Lambert W0 of dual number, dW/dz = 1 / (z + exp(W))
+ */
+struct dual dual_lambert_w0(struct dual z)
+{
+    real w = lambert_w0(z.v);
+    return dual_chain(z, w, 1 / (z.v + exp(w)));
+}
@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <telemetry.h>
+
+static const char *span_names[TELEMETRY_NUM_SPANS] = {
+    "kernel",
+    "upload",
+    "readback",
+    "wait",
+    "output",
+};
+
+static bool is_device_span(enum telemetry_span_e span)
+{
+    return span == TELEMETRY_KERNEL || span == TELEMETRY_UPLOAD || span == TELEMETRY_READBACK;
+}
+
+static double device_idle(const struct telemetry_worker_s *w)
+{
+    if (w->first_start < 0)
+        return 0;
+    return w->last_end - w->first_start - w->busy;
+}
+
+/**
+ * Start event of trace, caller holds mutex
+ */
+static void trace_separator(struct telemetry_s *telemetry)
+{
+    fprintf(telemetry->trace, telemetry->trace_empty ? "\n" : ",\n");
+    telemetry->trace_empty = false;
+}
+
+/**
+ * Write counters of all workers to stats stream, caller holds mutex
+ * @param record "periodic" or "summary"
+ */
+static void write_record(struct telemetry_s *telemetry, const char *record, double now)
+{
+    int i, k;
+    FILE *f = telemetry->stream;
+
+    if (telemetry->json)
+        fprintf(f, "{\"record\": \"%s\", \"time\": %.6lf, \"workers\": [", record, now);
+
+    for (i = 0; i < telemetry->num_workers; i++)
+    {
+        const struct telemetry_worker_s *w = &telemetry->workers[i];
+        double per_chunk = w->chunks > 0 ? (double)w->rays_retired / w->chunks : 0;
+        if (telemetry->json)
+        {
+            fprintf(f, "%s{\"worker\": %i, \"name\": \"%s\", \"chunks\": %lu, \"rays_retired\": %lu, "
+                    "\"retired_per_chunk\": %.3lf, \"ray_steps\": %.0lf",
+                    i > 0 ? ", " : "", i, w->name, w->chunks, w->rays_retired, per_chunk, w->ray_steps);
+            for (k = 0; k < TELEMETRY_NUM_SPANS; k++)
+                fprintf(f, ", \"%s\": %.6lf", span_names[k], w->time[k]);
+            fprintf(f, ", \"device_idle\": %.6lf}", device_idle(w));
+        }
+        else
+        {
+            fprintf(f, "%s,%.6lf,%i,\"%s\",%lu,%lu,%.3lf,%.0lf", record, now, i, w->name,
+                    w->chunks, w->rays_retired, per_chunk, w->ray_steps);
+            for (k = 0; k < TELEMETRY_NUM_SPANS; k++)
+                fprintf(f, ",%.6lf", w->time[k]);
+            fprintf(f, ",%.6lf\n", device_idle(w));
+        }
+    }
+
+    if (telemetry->json)
+        fprintf(f, "]}\n");
+    fflush(f);
+}
+
+/**
+ * Open stats stream and trace
+ * @param stats_fname csv or .json file of periodic records, can be NULL
+ * @param trace_fname Chrome trace file, can be NULL
+ * @param interval time between records of stats stream, s
+ */
+int telemetry_open(struct telemetry_s *telemetry, const char *stats_fname, const char *trace_fname, double interval)
+{
+    int k;
+
+    memset(telemetry, 0, sizeof(*telemetry));
+    telemetry->interval = interval;
+    telemetry->trace_empty = true;
+    pthread_mutex_init(&telemetry->mutex, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &telemetry->start);
+
+    if (stats_fname != NULL)
+    {
+        size_t len = strlen(stats_fname);
+        telemetry->json = len > 5 && strcmp(stats_fname + len - 5, ".json") == 0;
+        telemetry->stream = fopen(stats_fname, "wt");
+        if (telemetry->stream == NULL)
+        {
+            printf("Can not open file [%s]\n", stats_fname);
+            return -1;
+        }
+        if (!telemetry->json)
+        {
+            fprintf(telemetry->stream, "record,time,worker,name,chunks,rays_retired,retired_per_chunk,ray_steps");
+            for (k = 0; k < TELEMETRY_NUM_SPANS; k++)
+                fprintf(telemetry->stream, ",%s", span_names[k]);
+            fprintf(telemetry->stream, ",device_idle\n");
+        }
+    }
+
+    if (trace_fname != NULL)
+    {
+        telemetry->trace = fopen(trace_fname, "wt");
+        if (telemetry->trace == NULL)
+        {
+            printf("Can not open file [%s]\n", trace_fname);
+            return -1;
+        }
+        fprintf(telemetry->trace, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    }
+    return 0;
+}
+
+void telemetry_set_workers(struct telemetry_s *telemetry, int num_workers)
+{
+    int i;
+    if (telemetry == NULL)
+        return;
+
+    pthread_mutex_lock(&telemetry->mutex);
+    if (num_workers > telemetry->num_workers)
+    {
+        telemetry->workers = realloc(telemetry->workers, sizeof(struct telemetry_worker_s) * num_workers);
+        for (i = telemetry->num_workers; i < num_workers; i++)
+        {
+            struct telemetry_worker_s *w = &telemetry->workers[i];
+            memset(w, 0, sizeof(*w));
+            snprintf(w->name, sizeof(w->name), "worker %i", i);
+            w->first_start = -1;
+            w->device_offset = INFINITY;
+        }
+        telemetry->num_workers = num_workers;
+    }
+    pthread_mutex_unlock(&telemetry->mutex);
+}
+
+/**
+ * Name worker in stats and trace, e.g. by its device
+ */
+void telemetry_set_worker_name(struct telemetry_s *telemetry, int worker, const char *name)
+{
+    if (telemetry == NULL)
+        return;
+
+    pthread_mutex_lock(&telemetry->mutex);
+    struct telemetry_worker_s *w = &telemetry->workers[worker];
+    /* quotes would break csv and JSON */
+    snprintf(w->name, sizeof(w->name), "%s", name);
+    char *c;
+    for (c = w->name; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            *c = '\'';
+    }
+
+    if (telemetry->trace != NULL)
+    {
+        trace_separator(telemetry);
+        fprintf(telemetry->trace, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %i, "
+                "\"args\": {\"name\": \"%i %s host\"}},\n", 2 * worker, worker, w->name);
+        fprintf(telemetry->trace, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %i, "
+                "\"args\": {\"name\": \"%i %s device\"}}", 2 * worker + 1, worker, w->name);
+    }
+    pthread_mutex_unlock(&telemetry->mutex);
+}
+
+/**
+ * Time since telemetry was opened, s. 0 if telemetry is disabled
+ */
+double telemetry_now(const struct telemetry_s *telemetry)
+{
+    struct timespec now;
+    if (telemetry == NULL)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - telemetry->start.tv_sec) + (now.tv_nsec - telemetry->start.tv_nsec) * 1e-9;
+}
+
+/**
+ * Account span of work of worker
+ * @param start, end time as given by telemetry_now
+ */
+void telemetry_span(struct telemetry_s *telemetry, int worker, enum telemetry_span_e span, double start, double end)
+{
+    if (telemetry == NULL)
+        return;
+
+    pthread_mutex_lock(&telemetry->mutex);
+    struct telemetry_worker_s *w = &telemetry->workers[worker];
+    bool device = is_device_span(span);
+    w->time[span] += end - start;
+    if (device)
+    {
+        if (w->first_start < 0 || start < w->first_start)
+            w->first_start = start;
+        if (end > w->last_end)
+        {
+            w->busy += end - (start > w->last_end ? start : w->last_end);
+            w->last_end = end;
+        }
+    }
+
+    if (telemetry->trace != NULL)
+    {
+        trace_separator(telemetry);
+        fprintf(telemetry->trace, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %i, "
+                "\"ts\": %.3lf, \"dur\": %.3lf}",
+                span_names[span], device ? "device" : "host", 2 * worker + device,
+                start * 1e6, (end - start) * 1e6);
+    }
+    pthread_mutex_unlock(&telemetry->mutex);
+}
+
+/**
+ * Account command of OpenCL device which has just completed. Device clock
+ * is moved to host time by the least observed difference of two clocks,
+ * so commands never end after host has seen them completed
+ * @param start_ns, end_ns profiling info of event
+ */
+void telemetry_device_span(struct telemetry_s *telemetry, int worker, enum telemetry_span_e span,
+                           uint64_t start_ns, uint64_t end_ns)
+{
+    if (telemetry == NULL)
+        return;
+
+    double now = telemetry_now(telemetry);
+    pthread_mutex_lock(&telemetry->mutex);
+    struct telemetry_worker_s *w = &telemetry->workers[worker];
+    double offset = now - end_ns * 1e-9;
+    if (offset < w->device_offset)
+        w->device_offset = offset;
+    offset = w->device_offset;
+    pthread_mutex_unlock(&telemetry->mutex);
+
+    telemetry_span(telemetry, worker, span, start_ns * 1e-9 + offset, end_ns * 1e-9 + offset);
+}
+
+/**
+ * Account processed chunk or block of rays and write periodic record
+ * @param live rays which stay on worker
+ * @param retired rays which collided or reached T
+ * @param ray_steps ray steps done in chunk
+ */
+void telemetry_chunk(struct telemetry_s *telemetry, int worker, size_t live, size_t retired, double ray_steps)
+{
+    if (telemetry == NULL)
+        return;
+
+    double now = telemetry_now(telemetry);
+    pthread_mutex_lock(&telemetry->mutex);
+    struct telemetry_worker_s *w = &telemetry->workers[worker];
+    w->chunks++;
+    w->rays_retired += retired;
+    w->ray_steps += ray_steps;
+
+    if (telemetry->trace != NULL)
+    {
+        trace_separator(telemetry);
+        fprintf(telemetry->trace, "{\"name\": \"rays %i\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3lf, "
+                "\"args\": {\"live\": %zu, \"retired\": %zu}}", worker, now * 1e6, live, retired);
+    }
+
+    if (telemetry->stream != NULL && now - telemetry->last_report >= telemetry->interval)
+    {
+        telemetry->last_report = now;
+        write_record(telemetry, "periodic", now);
+    }
+    pthread_mutex_unlock(&telemetry->mutex);
+}
+
+/**
+ * Print counters of all workers and write final record of stats stream
+ */
+void telemetry_summary(struct telemetry_s *telemetry)
+{
+    int i;
+    if (telemetry == NULL)
+        return;
+
+    double now = telemetry_now(telemetry);
+    pthread_mutex_lock(&telemetry->mutex);
+    for (i = 0; i < telemetry->num_workers; i++)
+    {
+        const struct telemetry_worker_s *w = &telemetry->workers[i];
+        printf("Worker %i (%s): %lu chunks, %.1lf rays retired per chunk, kernel %.3lf s, upload %.3lf s, "
+               "readback %.3lf s, device idle %.3lf s, wait %.3lf s, output %.3lf s\n",
+               i, w->name, w->chunks, w->chunks > 0 ? (double)w->rays_retired / w->chunks : 0.0,
+               w->time[TELEMETRY_KERNEL], w->time[TELEMETRY_UPLOAD], w->time[TELEMETRY_READBACK],
+               device_idle(w), w->time[TELEMETRY_WAIT], w->time[TELEMETRY_OUTPUT]);
+    }
+    if (telemetry->stream != NULL)
+        write_record(telemetry, "summary", now);
+    pthread_mutex_unlock(&telemetry->mutex);
+}
+
+void telemetry_close(struct telemetry_s *telemetry)
+{
+    if (telemetry->stream != NULL)
+        fclose(telemetry->stream);
+    if (telemetry->trace != NULL)
+    {
+        fprintf(telemetry->trace, "\n]}\n");
+        fclose(telemetry->trace);
+    }
+    free(telemetry->workers);
+    pthread_mutex_destroy(&telemetry->mutex);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <pthread.h>
+
+/*
+ * Optional instrumentation of calculation. Counters of every worker are
+ * written periodically to stats stream (csv, or JSON lines if file name
+ * ends with .json) and at the end of run, spans of device commands and
+ * host work can be written as Chrome trace (chrome://tracing, Perfetto).
+ */
+
+enum telemetry_span_e {
+    TELEMETRY_KERNEL,
+    TELEMETRY_UPLOAD,
+    TELEMETRY_READBACK,
+    TELEMETRY_WAIT,             // worker waits for rays returned by others
+    TELEMETRY_OUTPUT,           // host stores results and writes trajectories
+    TELEMETRY_NUM_SPANS,
+};
+
+struct telemetry_worker_s {
+    char name[128];
+    double time[TELEMETRY_NUM_SPANS];   // total time of spans, s
+    double busy;                // device time covered by kernel or transfers, s
+    double first_start;         // first device span, -1 before it
+    double last_end;
+    double device_offset;       // host time minus device clock, s
+    unsigned long chunks;
+    unsigned long rays_retired;
+    double ray_steps;
+};
+
+struct telemetry_s {
+    FILE *stream;               // NULL if stats are not written
+    bool json;
+    double interval;            // between records of stats stream, s
+    double last_report;
+
+    FILE *trace;                // NULL if trace is not written
+    bool trace_empty;
+
+    struct timespec start;
+    pthread_mutex_t mutex;
+
+    struct telemetry_worker_s *workers;
+    int num_workers;
+};
+
+int telemetry_open(struct telemetry_s *telemetry, const char *stats_fname, const char *trace_fname, double interval);
+void telemetry_set_workers(struct telemetry_s *telemetry, int num_workers);
+void telemetry_set_worker_name(struct telemetry_s *telemetry, int worker, const char *name);
+double telemetry_now(const struct telemetry_s *telemetry);
+void telemetry_span(struct telemetry_s *telemetry, int worker, enum telemetry_span_e span, double start, double end);
+void telemetry_device_span(struct telemetry_s *telemetry, int worker, enum telemetry_span_e span,
+                           uint64_t start_ns, uint64_t end_ns);
+void telemetry_chunk(struct telemetry_s *telemetry, int worker, size_t live, size_t retired, double ray_steps);
+void telemetry_summary(struct telemetry_s *telemetry);
+void telemetry_close(struct telemetry_s *telemetry);
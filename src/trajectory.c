@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <trajectory.h>
+
+/* calculation threads wait for writer when more records are queued */
+#define MAX_QUEUED_RECORDS (1 << 22)
+
+static void *trajectory_writer(void *args)
+{
+    struct trajectory_s *traj = args;
+
+    pthread_mutex_lock(&traj->mutex);
+    while (true)
+    {
+        while (traj->head == NULL && !traj->closing)
+            pthread_cond_wait(&traj->cond, &traj->mutex);
+
+        struct trajectory_chunk_s *chunk = traj->head;
+        if (chunk == NULL)
+            break;
+
+        traj->head = chunk->next;
+        if (traj->head == NULL)
+            traj->tail = NULL;
+        pthread_mutex_unlock(&traj->mutex);
+
+        size_t i;
+        fwrite(chunk->records, sizeof(struct trajectory_record_s), chunk->num, traj->file);
+        for (i = 0; i < chunk->num; i++)
+        {
+            cl_uint id = chunk->records[i].ray_id;
+            if (id >= traj->num_rays)
+            {
+                cl_uint n = traj->num_rays;
+                while (n <= id)
+                    n = n ? 2 * n : 1024;
+                traj->ray_records = realloc(traj->ray_records, sizeof(cl_ulong) * n);
+                memset(traj->ray_records + traj->num_rays, 0, sizeof(cl_ulong) * (n - traj->num_rays));
+                traj->num_rays = n;
+            }
+            traj->ray_records[id]++;
+        }
+        traj->num_records += chunk->num;
+
+        pthread_mutex_lock(&traj->mutex);
+        traj->queued -= chunk->num;
+        pthread_cond_broadcast(&traj->cond);
+        free(chunk);
+    }
+    pthread_mutex_unlock(&traj->mutex);
+    return NULL;
+}
+
+static void write_header(struct trajectory_s *traj, cl_ulong index_offset)
+{
+    struct trajectory_header_s header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC));
+    header.version = TRAJECTORY_VERSION;
+    header.dim = DIM;
+    header.real_size = sizeof(real);
+    header.num_rays = traj->num_rays;
+    header.num_records = traj->num_records;
+    header.index_offset = index_offset;
+
+    fseek(traj->file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, traj->file);
+}
+
+int trajectory_open(struct trajectory_s *traj, const char *fname, cl_uint num_rays)
+{
+    traj->file = fopen(fname, "w+b");
+    if (traj->file == NULL)
+    {
+        printf("Can not open file [%s]\n", fname);
+        return -1;
+    }
+
+    traj->num_rays = num_rays;
+    traj->num_records = 0;
+    traj->ray_records = calloc(num_rays, sizeof(cl_ulong));
+    traj->head = NULL;
+    traj->tail = NULL;
+    traj->queued = 0;
+    traj->closing = false;
+    write_header(traj, 0);
+
+    pthread_mutex_init(&traj->mutex, NULL);
+    pthread_cond_init(&traj->cond, NULL);
+    pthread_create(&traj->writer, NULL, trajectory_writer, traj);
+    return 0;
+}
+
+/**
+ * Queue current point of rays
+ * @param ray_id index of each ray, NULL if rays are first, first + 1, ...
+ * @param first index of first ray, when ray_id is NULL
+ * @param length integrated length of each ray, NULL if all rays have length t
+ */
+void trajectory_write_rays(struct trajectory_s *traj, const cl_int *ray_id, size_t first,
+                           size_t num_objects, const real *pos, const real *dir, size_t stride,
+                           const cl_int *finished, const real *length, real t)
+{
+    size_t i;
+    int j;
+    struct trajectory_chunk_s *chunk = malloc(sizeof(*chunk) + sizeof(struct trajectory_record_s) * num_objects);
+    chunk->next = NULL;
+    chunk->num = num_objects;
+    for (i = 0; i < num_objects; i++)
+    {
+        struct trajectory_record_s *r = &chunk->records[i];
+        r->ray_id = ray_id ? ray_id[i] : first + i;
+        r->finished = finished[i];
+        r->t = length ? length[i] : t;
+        for (j = 0; j < DIM; j++)
+        {
+            r->pos[j] = pos[RAY_INDEX(i, j, stride)];
+            r->dir[j] = dir[RAY_INDEX(i, j, stride)];
+        }
+    }
+
+    pthread_mutex_lock(&traj->mutex);
+    while (traj->queued > MAX_QUEUED_RECORDS)
+        pthread_cond_wait(&traj->cond, &traj->mutex);
+
+    if (traj->tail)
+        traj->tail->next = chunk;
+    else
+        traj->head = chunk;
+    traj->tail = chunk;
+    traj->queued += num_objects;
+    pthread_cond_broadcast(&traj->cond);
+    pthread_mutex_unlock(&traj->mutex);
+}
+
+/**
+ * Build index of records by rescanning file
+ */
+static void write_index(struct trajectory_s *traj)
+{
+    cl_ulong i;
+
+    /* drop unused tail of counters grown in streaming mode */
+    while (traj->num_rays > 0 && traj->ray_records[traj->num_rays - 1] == 0)
+        traj->num_rays--;
+
+    cl_ulong *start = malloc(sizeof(cl_ulong) * (traj->num_rays + 1));
+    cl_ulong *index = malloc(sizeof(cl_ulong) * (traj->num_records > 0 ? traj->num_records : 1));
+
+    start[0] = 0;
+    for (i = 0; i < traj->num_rays; i++)
+        start[i + 1] = start[i] + traj->ray_records[i];
+
+    /* records of each ray are in order of writing, so in order of t */
+    struct trajectory_record_s r;
+    fseek(traj->file, sizeof(struct trajectory_header_s), SEEK_SET);
+    for (i = 0; i < traj->num_records; i++)
+    {
+        if (fread(&r, sizeof(r), 1, traj->file) != 1)
+            break;
+        index[start[r.ray_id]++] = i;
+    }
+
+    for (i = traj->num_rays; i > 0; i--)
+        start[i] = start[i - 1];
+    start[0] = 0;
+
+    fseek(traj->file, 0, SEEK_END);
+    cl_ulong index_offset = ftell(traj->file);
+    fwrite(start, sizeof(cl_ulong), traj->num_rays + 1, traj->file);
+    fwrite(index, sizeof(cl_ulong), traj->num_records, traj->file);
+    write_header(traj, index_offset);
+
+    free(start);
+    free(index);
+}
+
+void trajectory_close(struct trajectory_s *traj)
+{
+    pthread_mutex_lock(&traj->mutex);
+    traj->closing = true;
+    pthread_cond_broadcast(&traj->cond);
+    pthread_mutex_unlock(&traj->mutex);
+    pthread_join(traj->writer, NULL);
+
+    write_index(traj);
+    fclose(traj->file);
+
+    pthread_mutex_destroy(&traj->mutex);
+    pthread_cond_destroy(&traj->cond);
+    free(traj->ray_records);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <config.h>
+
+/*
+ * Binary trajectory file. Layout:
+ *
+ *   struct trajectory_header_s
+ *   struct trajectory_record_s * num_records, in order of writing
+ *   cl_ulong * (num_rays + 1)     start of records of each ray in list below
+ *   cl_ulong * num_records        record numbers, grouped by ray in order of t
+ *
+ * Index is written when file is closed, index_offset is 0 until then.
+ */
+
+#define TRAJECTORY_MAGIC "GEOTRAJ"
+#define TRAJECTORY_VERSION 1
+
+struct trajectory_header_s {
+    char magic[8];
+    cl_uint version;
+    cl_uint dim;
+    cl_uint real_size;
+    cl_uint num_rays;
+    cl_ulong num_records;
+    cl_ulong index_offset;
+};
+
+struct trajectory_record_s {
+    cl_uint ray_id;
+    cl_int finished;
+    real t;
+    real pos[DIM];
+    real dir[DIM];
+};
+
+struct trajectory_chunk_s {
+    struct trajectory_chunk_s *next;
+    size_t num;
+    struct trajectory_record_s records[];
+};
+
+/**
+ * Trajectory file with background writer. Calculation threads append
+ * chunks of records to queue, writer thread stores them to file
+ */
+struct trajectory_s {
+    FILE *file;
+    cl_uint num_rays;           // grows with ray ids in streaming mode
+    cl_ulong num_records;       // written by writer thread
+    cl_ulong *ray_records;      // records of each ray, written by writer thread
+
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct trajectory_chunk_s *head;
+    struct trajectory_chunk_s *tail;
+    size_t queued;              // records in queue
+    bool closing;
+};
+
+int trajectory_open(struct trajectory_s *traj, const char *fname, cl_uint num_rays);
+void trajectory_write_rays(struct trajectory_s *traj, const cl_int *ray_id, size_t first,
+                           size_t num_objects, const real *pos, const real *dir, size_t stride,
+                           const cl_int *finished, const real *length, real t);
+void trajectory_close(struct trajectory_s *traj);
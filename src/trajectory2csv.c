@@ -0,0 +1,91 @@
+/*
+ * Convert binary trajectory file to directory with one csv file per ray
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <trajectory.h>
+
+int main(int argc, char **argv)
+{
+    cl_ulong i, k;
+    int j;
+
+    if (argc < 3)
+    {
+        printf("Usage: geodesic2_trajectory2csv trajectory.bin output_dir\n");
+        return 0;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL)
+    {
+        printf("Can not open file [%s]. Exiting.\n", argv[1]);
+        return 1;
+    }
+
+    struct trajectory_header_s header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC)) != 0)
+    {
+        printf("[%s] is not trajectory file\n", argv[1]);
+        return 1;
+    }
+
+    if (header.version != TRAJECTORY_VERSION || header.dim != DIM || header.real_size != sizeof(real))
+    {
+        printf("Unsupported trajectory file: version %u, dim %u, real size %u\n",
+               header.version, header.dim, header.real_size);
+        return 1;
+    }
+
+    if (header.index_offset == 0)
+    {
+        printf("Trajectory file has no index, calculation was not finished\n");
+        return 1;
+    }
+
+    cl_ulong *start = malloc(sizeof(cl_ulong) * (header.num_rays + 1));
+    cl_ulong *index = malloc(sizeof(cl_ulong) * (header.num_records > 0 ? header.num_records : 1));
+    fseek(f, header.index_offset, SEEK_SET);
+    fread(start, sizeof(cl_ulong), header.num_rays + 1, f);
+    fread(index, sizeof(cl_ulong), header.num_records, f);
+
+    for (i = 0; i < header.num_rays; i++)
+    {
+        char fname[4096];
+        snprintf(fname, 4096, "%s/%05i.csv", argv[2], (int)i);
+        FILE *output = fopen(fname, "wt");
+        if (output == NULL)
+        {
+            printf("Can not open file [%s]. Exiting.\n", fname);
+            return 1;
+        }
+
+        for (k = start[i]; k < start[i + 1]; k++)
+        {
+            struct trajectory_record_s r;
+            fseek(f, sizeof(header) + index[k] * sizeof(r), SEEK_SET);
+            fread(&r, sizeof(r), 1, f);
+
+            if (r.finished)
+                fprintf(output, "true");
+            else
+                fprintf(output, "false");
+            fprintf(output, ", %0.12lf", (double)r.t);
+            for (j = 0; j < DIM; j++)
+                fprintf(output, ", %0.12lf", (double)r.pos[j]);
+            for (j = 0; j < DIM; j++)
+                fprintf(output, ", %0.12lf", (double)r.dir[j]);
+            fprintf(output, "\n");
+        }
+        fclose(output);
+    }
+
+    free(start);
+    free(index);
+    fclose(f);
+    return 0;
+}